@@ -0,0 +1,554 @@
+#include "codec.h"
+#include "dtype.h"
+#include "staging.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Elements per frame of reference of the delta encoding.
+static const size_t BlockSize = 128;
+// Shortest LZ match worth encoding.
+static const size_t MinMatch = 4;
+static const unsigned HashBits = 14;
+static const size_t HeaderSize = sizeof(uint64_t);
+
+// Encoded data is little endian, like every host we run on.
+static void putLE(std::string &out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+static uint64_t getLE(const unsigned char *in, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+bool parseEncoding(const std::string &name, Encoding &encoding) {
+    if (name.empty() || name == "plain") {
+        encoding = Encoding::Plain;
+    } else if (name == "delta") {
+        encoding = Encoding::Delta;
+    } else if (name == "shuffle") {
+        encoding = Encoding::Shuffle;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Delta + frame of reference
+
+// Elements of up to 32 bits are differenced modulo 2^32, so that decoding
+// runs on 32-bit lanes; 64-bit elements need 64-bit lanes.
+template<typename T>
+using Lane = typename std::conditional<sizeof(T) <= 4, uint32_t, uint64_t>::type;
+
+// Widens an element to its lane, sign-extending signed types so that small
+// negative differences stay small.
+template<typename T>
+static Lane<T> toLane(T value) {
+    typedef Lane<T> L;
+    typedef typename std::conditional<std::is_signed<T>::value,
+                                      typename std::make_signed<L>::type, L>::type Extended;
+    return static_cast<L>(static_cast<Extended>(value));
+}
+
+static unsigned bitWidth(uint64_t value) {
+    unsigned width = 0;
+    while (value != 0) {
+        width++;
+        value >>= 1;
+    }
+    return width;
+}
+
+// Appends `width` bits of every value, least significant first.
+template<typename L>
+static void packBits(const L *values, size_t count, unsigned width, std::string &out) {
+    unsigned char current = 0;
+    unsigned used = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t value = values[i];
+        unsigned bits = width;
+        while (bits > 0) {
+            const unsigned take = std::min(bits, 8u - used);
+            current |= static_cast<unsigned char>((value & ((1u << take) - 1)) << used);
+            value >>= take;
+            bits -= take;
+            used += take;
+            if (used == 8) {
+                out.push_back(static_cast<char>(current));
+                current = 0;
+                used = 0;
+            }
+        }
+    }
+    if (used > 0) {
+        out.push_back(static_cast<char>(current));
+    }
+}
+
+// Reads `count` values of `width` bits from `packed` bytes.
+template<typename L>
+static void unpackBits(const unsigned char *in, size_t packed, size_t count, unsigned width, L *out) {
+    if (width == 0) {
+        std::fill(out, out + count, L(0));
+        return;
+    }
+
+    // Padded copy, so that every value is read with one unaligned load
+    // and one more byte at most.
+    unsigned char buffer[BlockSize * sizeof(uint64_t) + 16] = {};
+    memcpy(buffer, in, packed);
+
+    const uint64_t mask = width >= 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+    size_t bit = 0;
+    for (size_t i = 0; i < count; i++, bit += width) {
+        const size_t byte = bit >> 3;
+        const unsigned shift = bit & 7;
+        uint64_t word;
+        memcpy(&word, buffer + byte, sizeof(word));
+        word >>= shift;
+        if (shift + width > 64) {
+            word |= static_cast<uint64_t>(buffer[byte + 8]) << (64 - shift);
+        }
+        out[i] = static_cast<L>(word & mask);
+    }
+}
+
+// Turns offsets from the block's smallest difference into running sums,
+// in place. Returns the last sum.
+template<typename L>
+static L prefixSum(L *values, size_t count, L low, L previous) {
+    for (size_t i = 0; i < count; i++) {
+        previous += values[i] + low;
+        values[i] = previous;
+    }
+    return previous;
+}
+
+#if defined(__SSE2__)
+// Four lanes at a time: two shifted adds give the sums within the vector,
+// then the carry from the previous vector is added to all of them.
+static uint32_t prefixSum(uint32_t *values, size_t count, uint32_t low, uint32_t previous) {
+    const __m128i base = _mm_set1_epi32(static_cast<int>(low));
+    __m128i carry = _mm_set1_epi32(static_cast<int>(previous));
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i x = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)), base);
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    previous = static_cast<uint32_t>(_mm_cvtsi128_si32(carry));
+    for (; i < count; i++) {
+        previous += values[i] + low;
+        values[i] = previous;
+    }
+    return previous;
+}
+#endif
+
+template<typename T>
+static typename std::enable_if<std::is_integral<T>::value, bool>::type
+encodeDelta(const T *values, size_t count, std::string &out, std::string&) {
+    typedef Lane<T> L;
+    typedef typename std::make_signed<L>::type S;
+
+    putLE(out, count, HeaderSize);
+    L deltas[BlockSize];
+    L previous = 0;
+    for (size_t start = 0; start < count; start += BlockSize) {
+        const size_t n = std::min(BlockSize, count - start);
+        S low = std::numeric_limits<S>::max();
+        S high = std::numeric_limits<S>::min();
+        for (size_t i = 0; i < n; i++) {
+            const L value = toLane(values[start + i]);
+            deltas[i] = value - previous;
+            previous = value;
+            low = std::min(low, static_cast<S>(deltas[i]));
+            high = std::max(high, static_cast<S>(deltas[i]));
+        }
+        for (size_t i = 0; i < n; i++) {
+            deltas[i] -= static_cast<L>(low);
+        }
+        const unsigned width = bitWidth(static_cast<L>(high) - static_cast<L>(low));
+
+        putLE(out, static_cast<L>(low), sizeof(L));
+        out.push_back(static_cast<char>(width));
+        packBits(deltas, n, width, out);
+    }
+    return true;
+}
+
+template<typename T>
+static typename std::enable_if<std::is_integral<T>::value, bool>::type
+decodeDelta(const unsigned char *in, size_t size, T *out, size_t count, std::string &error) {
+    typedef Lane<T> L;
+
+    size_t pos = HeaderSize;
+    L values[BlockSize];
+    L previous = 0;
+    for (size_t start = 0; start < count; start += BlockSize) {
+        const size_t n = std::min(BlockSize, count - start);
+        if (size - pos < sizeof(L) + 1) {
+            error = "Encoded data is truncated";
+            return false;
+        }
+        const L low = static_cast<L>(getLE(in + pos, sizeof(L)));
+        const unsigned width = in[pos + sizeof(L)];
+        pos += sizeof(L) + 1;
+        const size_t packed = (n * width + 7) / 8;
+        if (width > 8 * sizeof(L) || size - pos < packed) {
+            error = "Encoded data is corrupt";
+            return false;
+        }
+
+        unpackBits(in + pos, packed, n, width, values);
+        pos += packed;
+        previous = prefixSum(values, n, low, previous);
+        for (size_t i = 0; i < n; i++) {
+            out[start + i] = static_cast<T>(values[i]);
+        }
+    }
+    if (pos != size) {
+        error = "Encoded data has trailing bytes";
+        return false;
+    }
+    return true;
+}
+
+template<typename T>
+static typename std::enable_if<!std::is_integral<T>::value, bool>::type
+encodeDelta(const T*, size_t, std::string&, std::string &error) {
+    error = "Delta encoding only applies to integers";
+    return false;
+}
+
+template<typename T>
+static typename std::enable_if<!std::is_integral<T>::value, bool>::type
+decodeDelta(const unsigned char*, size_t, T*, size_t, std::string &error) {
+    error = "Delta encoding only applies to integers";
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Byte shuffle + LZ
+//
+// The LZ stream is a sequence of (literals, match) pairs. Each starts with a
+// token: the literal count in the high nibble and the match length minus
+// MinMatch in the low one, 15 meaning that bytes follow, added to it until
+// one is not 255. The literals come next, then the match offset as two
+// little endian bytes. The last sequence has literals only.
+
+static void putLength(std::string &out, size_t length) {
+    while (length >= 255) {
+        out.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+static void putSequence(std::string &out, const unsigned char *literals, size_t count,
+                        size_t offset, size_t length) {
+    const size_t matchCode = length >= MinMatch ? length - MinMatch : 0;
+    out.push_back(static_cast<char>((std::min<size_t>(count, 15) << 4) |
+                                    std::min<size_t>(matchCode, 15)));
+    if (count >= 15) {
+        putLength(out, count - 15);
+    }
+    out.append(reinterpret_cast<const char*>(literals), count);
+    if (length == 0) {
+        return;
+    }
+    putLE(out, offset, 2);
+    if (matchCode >= 15) {
+        putLength(out, matchCode - 15);
+    }
+}
+
+static void compressLZ(const unsigned char *in, size_t size, std::string &out) {
+    std::vector<size_t> table(size_t(1) << HashBits, std::numeric_limits<size_t>::max());
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + MinMatch <= size) {
+        uint32_t sequence;
+        memcpy(&sequence, in + pos, sizeof(sequence));
+        const uint32_t hash = (sequence * 2654435761u) >> (32 - HashBits);
+        const size_t candidate = table[hash];
+        table[hash] = pos;
+
+        if (candidate == std::numeric_limits<size_t>::max() || pos - candidate > 65535 ||
+            memcmp(in + candidate, in + pos, MinMatch) != 0) {
+            pos++;
+            continue;
+        }
+        size_t length = MinMatch;
+        while (pos + length < size && in[candidate + length] == in[pos + length]) {
+            length++;
+        }
+        putSequence(out, in + anchor, pos - anchor, pos - candidate, length);
+        pos += length;
+        anchor = pos;
+    }
+    putSequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+static bool readLength(const unsigned char *in, size_t size, size_t &pos, size_t limit,
+                       size_t &length) {
+    unsigned char byte;
+    do {
+        if (pos >= size || length > limit) {
+            return false;
+        }
+        byte = in[pos++];
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static bool decompressLZ(const unsigned char *in, size_t size, unsigned char *out, size_t bytes) {
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < size) {
+        const unsigned token = in[ip++];
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(in, size, ip, bytes, literals)) {
+            return false;
+        }
+        if (literals > size - ip || literals > bytes - op) {
+            return false;
+        }
+        memcpy(out + op, in + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == size) {
+            break;
+        }
+
+        if (size - ip < 2) {
+            return false;
+        }
+        const size_t offset = getLE(in + ip, 2);
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !readLength(in, size, ip, bytes, length)) {
+            return false;
+        }
+        length += MinMatch;
+        if (offset == 0 || offset > op || length > bytes - op) {
+            return false;
+        }
+
+        const unsigned char *match = out + op - offset;
+        if (offset >= length) {
+            memcpy(out + op, match, length);
+        } else {
+            // Overlapping match: repeats the last `offset` bytes.
+            for (size_t i = 0; i < length; i++) {
+                out[op + i] = match[i];
+            }
+        }
+        op += length;
+    }
+    return op == bytes;
+}
+
+static void shuffle(const unsigned char *in, size_t count, size_t size, unsigned char *out) {
+    for (size_t i = 0; i < count; i++) {
+        for (size_t b = 0; b < size; b++) {
+            out[b * count + i] = in[i * size + b];
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Interleave 16 elements at a time from their byte planes. Returns the
+// number of elements done.
+static size_t unshuffleSIMD(const unsigned char *in, size_t count, size_t size, unsigned char *out) {
+    auto plane = [&](size_t b, size_t i) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + b * count + i));
+    };
+    auto store = [&](size_t i, size_t k, __m128i value) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * size + 16 * k), value);
+    };
+
+    size_t i = 0;
+    if (size == 2) {
+        for (; i + 16 <= count; i += 16) {
+            const __m128i p0 = plane(0, i), p1 = plane(1, i);
+            store(i, 0, _mm_unpacklo_epi8(p0, p1));
+            store(i, 1, _mm_unpackhi_epi8(p0, p1));
+        }
+    } else if (size == 4) {
+        for (; i + 16 <= count; i += 16) {
+            const __m128i p0 = plane(0, i), p1 = plane(1, i), p2 = plane(2, i), p3 = plane(3, i);
+            const __m128i lo01 = _mm_unpacklo_epi8(p0, p1), hi01 = _mm_unpackhi_epi8(p0, p1);
+            const __m128i lo23 = _mm_unpacklo_epi8(p2, p3), hi23 = _mm_unpackhi_epi8(p2, p3);
+            store(i, 0, _mm_unpacklo_epi16(lo01, lo23));
+            store(i, 1, _mm_unpackhi_epi16(lo01, lo23));
+            store(i, 2, _mm_unpacklo_epi16(hi01, hi23));
+            store(i, 3, _mm_unpackhi_epi16(hi01, hi23));
+        }
+    } else if (size == 8) {
+        for (; i + 16 <= count; i += 16) {
+            __m128i quads[2][4];
+            for (size_t half = 0; half < 2; half++) {
+                const size_t b = 4 * half;
+                const __m128i p0 = plane(b, i), p1 = plane(b + 1, i);
+                const __m128i p2 = plane(b + 2, i), p3 = plane(b + 3, i);
+                const __m128i lo01 = _mm_unpacklo_epi8(p0, p1), hi01 = _mm_unpackhi_epi8(p0, p1);
+                const __m128i lo23 = _mm_unpacklo_epi8(p2, p3), hi23 = _mm_unpackhi_epi8(p2, p3);
+                // Bytes b..b+3 of elements 0-3, 4-7, 8-11 and 12-15.
+                quads[half][0] = _mm_unpacklo_epi16(lo01, lo23);
+                quads[half][1] = _mm_unpackhi_epi16(lo01, lo23);
+                quads[half][2] = _mm_unpacklo_epi16(hi01, hi23);
+                quads[half][3] = _mm_unpackhi_epi16(hi01, hi23);
+            }
+            for (size_t q = 0; q < 4; q++) {
+                store(i, 2 * q, _mm_unpacklo_epi32(quads[0][q], quads[1][q]));
+                store(i, 2 * q + 1, _mm_unpackhi_epi32(quads[0][q], quads[1][q]));
+            }
+        }
+    }
+    return i;
+}
+#endif
+
+static void unshuffle(const unsigned char *in, size_t count, size_t size, unsigned char *out) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    i = unshuffleSIMD(in, count, size, out);
+#endif
+    for (; i < count; i++) {
+        for (size_t b = 0; b < size; b++) {
+            out[i * size + b] = in[b * count + i];
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool encode(Encoding encoding, unsigned int type, const void *data, size_t bytes,
+            std::string &out, std::string &error) {
+    const size_t typeSize = dataTypeSize(type);
+    if (typeSize == 0 || bytes % typeSize != 0) {
+        error = "Size is not a multiple of the element size";
+        return false;
+    }
+    const size_t count = bytes / typeSize;
+    out.clear();
+
+    switch (encoding) {
+        case Encoding::Plain:
+            out.assign(static_cast<const char*>(data), bytes);
+            return true;
+        case Encoding::Delta:
+            return visitDataType(type, [&](auto tag) {
+                typedef typename decltype(tag)::type T;
+                return encodeDelta(static_cast<const T*>(data), count, out, error);
+            });
+        case Encoding::Shuffle: {
+            Arena::Scope scope;
+            unsigned char *shuffled = Arena::local().allocate<unsigned char>(bytes);
+            shuffle(static_cast<const unsigned char*>(data), count, typeSize, shuffled);
+            putLE(out, count, HeaderSize);
+            compressLZ(shuffled, bytes, out);
+            return true;
+        }
+    }
+    error = "Unknown encoding";
+    return false;
+}
+
+bool decodedSize(Encoding encoding, unsigned int type, const void *data, size_t size,
+                 size_t &bytes, std::string &error) {
+    const size_t typeSize = dataTypeSize(type);
+    if (typeSize == 0) {
+        error = "Invalid data type";
+        return false;
+    }
+    if (encoding == Encoding::Plain) {
+        if (size % typeSize != 0) {
+            error = "Size is not a multiple of the element size";
+            return false;
+        }
+        bytes = size;
+        return true;
+    }
+
+    if (size < HeaderSize) {
+        error = "Encoded data is truncated";
+        return false;
+    }
+    const uint64_t count = getLE(static_cast<const unsigned char*>(data), HeaderSize);
+    const size_t payload = size - HeaderSize;
+
+    // Reject counts the payload cannot possibly hold before anything is
+    // allocated for them.
+    bool plausible = count <= std::numeric_limits<size_t>::max() / typeSize;
+    if (plausible && encoding == Encoding::Delta) {
+        const size_t blockHeader = (typeSize <= 4 ? 4 : 8) + 1;
+        plausible = (count + BlockSize - 1) / BlockSize <= payload / blockHeader;
+    } else if (plausible) {
+        // A byte of LZ stream expands to at most 255 bytes, plus a match.
+        plausible = count * typeSize <= payload * 255 + 64;
+    }
+    if (!plausible) {
+        error = "Encoded data is corrupt";
+        return false;
+    }
+    bytes = count * typeSize;
+    return true;
+}
+
+bool decode(Encoding encoding, unsigned int type, const void *data, size_t size,
+            void *out, size_t bytes, std::string &error) {
+    size_t expected;
+    if (!decodedSize(encoding, type, data, size, expected, error)) {
+        return false;
+    } else if (expected != bytes) {
+        error = "Decoded size does not match";
+        return false;
+    }
+    const auto *in = static_cast<const unsigned char*>(data);
+    const size_t typeSize = dataTypeSize(type);
+    const size_t count = bytes / typeSize;
+
+    switch (encoding) {
+        case Encoding::Plain:
+            memcpy(out, data, bytes);
+            return true;
+        case Encoding::Delta:
+            return visitDataType(type, [&](auto tag) {
+                typedef typename decltype(tag)::type T;
+                return decodeDelta(in, size, static_cast<T*>(out), count, error);
+            });
+        case Encoding::Shuffle: {
+            Arena::Scope scope;
+            unsigned char *shuffled = Arena::local().allocate<unsigned char>(bytes);
+            if (!decompressLZ(in + HeaderSize, size - HeaderSize, shuffled, bytes)) {
+                error = "Encoded data is corrupt";
+                return false;
+            }
+            unshuffle(shuffled, count, typeSize, static_cast<unsigned char*>(out));
+            return true;
+        }
+    }
+    error = "Unknown encoding";
+    return false;
+}
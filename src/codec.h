@@ -0,0 +1,61 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief Wire encoding of an array of elements.
+ *
+ * Encoded arrays start with the number of elements as a 64-bit little
+ * endian integer.
+ */
+enum class Encoding {
+    /** The elements as they are, without the element count. */
+    Plain,
+    /**
+     * Integers only: differences of consecutive elements, in blocks of 128
+     * bit-packed relative to the block's smallest difference (frame of
+     * reference). Sorted ids and slowly changing counters pack into a few
+     * bits per element.
+     */
+    Delta,
+    /**
+     * Any type: byte i of every element, then byte i + 1 of every element,
+     * and so on, LZ compressed. Floating point data compresses well this
+     * way, since neighbouring values share sign and exponent bytes.
+     */
+    Shuffle,
+};
+
+/**
+ * @brief Parse "plain" (or ""), "delta" or "shuffle".
+ */
+bool parseEncoding(const std::string &name, Encoding &encoding);
+
+/**
+ * @brief Encode @p bytes of elements of @p type (DataType).
+ * @param out Receives the encoded array.
+ * @param error Receives a message if the encoding does not apply to the
+ * type.
+ */
+bool encode(Encoding encoding, unsigned int type, const void *data, size_t bytes,
+            std::string &out, std::string &error);
+
+/**
+ * @brief Size in bytes of the decoded array, so that it can be decoded
+ * straight into its final buffer. Fails if the encoded array cannot hold
+ * that many elements.
+ */
+bool decodedSize(Encoding encoding, unsigned int type, const void *data, size_t size,
+                 size_t &bytes, std::string &error);
+
+/**
+ * @brief Decode an array of elements of @p type (DataType) into @p out,
+ * which holds decodedSize() bytes. Encoded data is not trusted: anything
+ * malformed fails instead of reading or writing out of bounds.
+ */
+bool decode(Encoding encoding, unsigned int type, const void *data, size_t size,
+            void *out, size_t bytes, std::string &error);
+
+#endif
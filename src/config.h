@@ -0,0 +1,31 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+/**
+ * @brief Read a setting from the environment.
+ * @param name Environment variable, e.g. COMPUTE_SNAPSHOT.
+ * @param fallback Value used when the variable is unset.
+ */
+inline std::string getConfig(const char* name, const std::string &fallback = "") {
+    const char* value = std::getenv(name);
+    return value != nullptr ? std::string(value) : fallback;
+}
+
+/**
+ * @brief Read an unsigned integer setting from the environment.
+ */
+inline uint64_t getConfigUInt(const char* name, uint64_t fallback) {
+    const char* value = std::getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return fallback;
+    }
+    char* end = nullptr;
+    const auto result = std::strtoull(value, &end, 10);
+    return *end == '\0' ? result : fallback;
+}
+
+#endif
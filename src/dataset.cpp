@@ -0,0 +1,120 @@
+#include "dataset.h"
+#include <iostream>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace compute = boost::compute;
+namespace ipc = boost::interprocess;
+
+Dataset::Dataset(const std::string &name, const std::string &path)
+    : m_name(name)
+    , m_data(nullptr)
+    , m_size(0)
+{
+    ipc::file_mapping file(path.c_str(), ipc::read_only);
+    auto region = std::make_shared<ipc::mapped_region>(file, ipc::read_only);
+
+    m_data = static_cast<char*>(region->get_address());
+    m_size = region->get_size();
+    m_mapping = std::move(region);
+}
+
+compute::buffer Dataset::wrap(const compute::context &context, size_t offset, size_t length) {
+    const auto device = context.get_device();
+    const bool cpu = (device.type() & CL_DEVICE_TYPE_CPU) != 0;
+
+    // The mapping is read-only, so the device is never allowed to write it.
+    const cl_mem_flags flags = compute::buffer::read_only |
+        (cpu ? compute::buffer::use_host_ptr : compute::buffer::copy_host_ptr);
+
+    return compute::buffer(context, length, flags, m_data + offset);
+}
+
+bool Dataset::buffer(const compute::context &context, size_t offset, size_t length,
+                     compute::buffer &result, std::string &error) {
+    const auto device = context.get_device();
+    const size_t maxAlloc = device.max_memory_alloc_size();
+    if (length > maxAlloc) {
+        error = "Dataset range is larger than the device can allocate";
+        return false;
+    }
+
+    const size_t alignment = device.get_info<cl_uint>(CL_DEVICE_MEM_BASE_ADDR_ALIGN) / 8;
+    const bool whole = offset == 0 && length == m_size;
+    const bool aligned = alignment > 0 && offset % alignment == 0;
+    try {
+        if (m_size > maxAlloc || (!whole && !aligned)) {
+            // Not cached: the buffer lives as long as the inputs using it.
+            result = wrap(context, offset, length);
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_whole.find(context.get());
+        if (it == m_whole.end()) {
+            it = m_whole.emplace(context.get(), wrap(context, 0, m_size)).first;
+        }
+        // Sub-buffers share the whole file's memory, so they aren't cached.
+        result = whole ? it->second
+                       : it->second.create_subbuffer(compute::buffer::read_only, offset, length);
+    } catch (const compute::opencl_error &e) {
+        error = std::string("Cannot create dataset buffer: ") + e.what();
+        return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+size_t DatasetRegistry::scan(const std::string &directory) {
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr) {
+        std::cerr << "Cannot open data directory " << directory << "\n";
+        return 0;
+    }
+
+    size_t added = 0;
+    while (dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        const std::string path = directory + "/" + name;
+
+        struct stat info;
+        if (name[0] == '.' || stat(path.c_str(), &info) != 0 ||
+            !S_ISREG(info.st_mode) || info.st_size == 0) {
+            continue;
+        }
+
+        try {
+            auto dataset = std::make_shared<Dataset>(name, path);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_datasets[name] = std::move(dataset);
+            added++;
+        } catch (const std::exception &e) {
+            std::cerr << "Cannot map dataset " << path << ": " << e.what() << "\n";
+        }
+    }
+    closedir(dir);
+
+    return added;
+}
+
+std::shared_ptr<Dataset> DatasetRegistry::find(const std::string &name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_datasets.find(name);
+    if (it == m_datasets.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+std::vector<std::shared_ptr<Dataset>> DatasetRegistry::list() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::shared_ptr<Dataset>> result;
+    result.reserve(m_datasets.size());
+    for (const auto &entry : m_datasets) {
+        result.push_back(entry.second);
+    }
+    return result;
+}
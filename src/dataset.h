@@ -0,0 +1,91 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/compute/core.hpp>
+
+/**
+ * @brief A read-only file mapped into the server's memory that kernels can
+ * use as input without the client uploading it.
+ */
+class Dataset {
+public:
+    /**
+     * @brief Map a file.
+     * @param name Name clients use to refer to the dataset.
+     * @param path File to map. Throws if it cannot be mapped.
+     */
+    Dataset(const std::string &name, const std::string &path);
+
+    const std::string& name() const {
+        return m_name;
+    }
+
+    /**
+     * @brief Size of the dataset in bytes.
+     */
+    size_t size() const {
+        return m_size;
+    }
+
+    const void* data() const {
+        return m_data;
+    }
+
+    /**
+     * @brief Device buffer holding the bytes [offset, offset + length).
+     *
+     * On CPU devices buffers wrap the mapping itself (CL_MEM_USE_HOST_PTR),
+     * so no copy is made at all. One buffer for the whole file is kept per
+     * context, if the device can allocate it, and aligned ranges are
+     * sub-buffers of it. Other ranges get a buffer of their own, freed when
+     * the last input using it goes away.
+     * @returns false if the range is larger than the device can allocate.
+     */
+    bool buffer(const boost::compute::context &context, size_t offset, size_t length,
+                boost::compute::buffer &result, std::string &error);
+
+private:
+    boost::compute::buffer wrap(const boost::compute::context &context,
+                                size_t offset, size_t length);
+
+    std::string m_name;
+    std::shared_ptr<void> m_mapping;
+    char* m_data;
+    size_t m_size;
+    std::mutex m_mutex;
+    std::map<cl_context, boost::compute::buffer> m_whole;
+};
+
+/**
+ * @brief Named datasets available to all sessions.
+ */
+class DatasetRegistry {
+public:
+    /**
+     * @brief Register every regular file in @p directory under its file name.
+     * @returns the number of datasets added.
+     */
+    size_t scan(const std::string &directory);
+
+    /**
+     * @brief Look up a dataset.
+     * @returns the dataset, or nullptr if @p name is unknown.
+     */
+    std::shared_ptr<Dataset> find(const std::string &name);
+
+    /**
+     * @brief All registered datasets.
+     */
+    std::vector<std::shared_ptr<Dataset>> list();
+
+private:
+    std::map<std::string, std::shared_ptr<Dataset>> m_datasets;
+    std::mutex m_mutex;
+};
+
+#endif
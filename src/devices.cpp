@@ -0,0 +1,130 @@
+#include "devices.h"
+#include "config.h"
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace compute = boost::compute;
+
+static std::vector<size_t> parseCounts(const std::string &text) {
+    std::vector<size_t> counts;
+    std::istringstream stream(text);
+    std::string count;
+    while (std::getline(stream, count, ',')) {
+        counts.push_back(std::stoul(count));
+    }
+    return counts;
+}
+
+static std::vector<compute::device> partition(const compute::device &device,
+                                              const std::string &spec) {
+    if (spec.empty()) {
+        return { device };
+    }
+    if (device.type() != compute::device::cpu) {
+        std::cerr << "Devices: only CPU devices are partitioned\n";
+        return { device };
+    }
+
+    std::vector<compute::device> devices;
+    try {
+        if (spec == "numa") {
+            devices = device.partition_by_affinity_domain(CL_DEVICE_AFFINITY_DOMAIN_NUMA);
+        } else if (spec == "cache") {
+            devices = device.partition_by_affinity_domain(CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE);
+        } else if (spec.compare(0, 8, "equally:") == 0) {
+            devices = device.partition_equally(std::stoul(spec.substr(8)));
+        } else if (spec.compare(0, 7, "counts:") == 0) {
+            devices = device.partition_by_counts(parseCounts(spec.substr(7)));
+        } else {
+            std::cerr << "Devices: unknown partitioning " << spec << "\n";
+        }
+    } catch (const std::exception &e) {
+        // Not supported by the driver, or more cores asked for than exist.
+        std::cerr << "Devices: failed to partition " << device.name() << ": " << e.what() << "\n";
+    }
+
+    if (devices.empty()) {
+        return { device };
+    }
+    std::cerr << "Devices: split " << device.name() << " into " << devices.size()
+              << " sub-devices\n";
+    return devices;
+}
+
+DevicePool::DevicePool()
+    : DevicePool(compute::system::default_device(), getConfig("COMPUTE_PARTITION"),
+                 getConfig("COMPUTE_RESERVE"))
+{
+}
+
+DevicePool::DevicePool(const compute::device &device, const std::string &spec,
+                       const std::string &reservations)
+    : m_devices(partition(device, spec))
+    , m_sessions(m_devices.size(), 0)
+    , m_reserved(m_devices.size(), false)
+{
+    std::istringstream tenants(reservations);
+    std::string entry;
+    while (std::getline(tenants, entry, ';')) {
+        const auto colon = entry.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::vector<size_t> indices;
+        try {
+            indices = parseCounts(entry.substr(colon + 1));
+        } catch (const std::logic_error&) {
+            std::cerr << "Devices: invalid reservation " << entry << "\n";
+            continue;
+        }
+
+        auto &reserved = m_reservations[entry.substr(0, colon)];
+        for (const auto index : indices) {
+            if (index >= m_devices.size() || m_reserved[index]) {
+                std::cerr << "Devices: cannot reserve sub-device " << index << "\n";
+                continue;
+            }
+            m_reserved[index] = true;
+            reserved.push_back(index);
+        }
+    }
+}
+
+size_t DevicePool::place(const std::string &tenant) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<size_t> candidates;
+    const auto it = m_reservations.find(tenant);
+    if (it != m_reservations.end() && !it->second.empty()) {
+        candidates = it->second;
+    } else {
+        for (size_t i = 0; i < m_devices.size(); i++) {
+            if (!m_reserved[i]) {
+                candidates.push_back(i);
+            }
+        }
+        if (candidates.empty()) {
+            // Everything is reserved; share with the reserving tenants.
+            for (size_t i = 0; i < m_devices.size(); i++) {
+                candidates.push_back(i);
+            }
+        }
+    }
+
+    size_t best = candidates.front();
+    for (const auto index : candidates) {
+        if (m_sessions[index] < m_sessions[best]) {
+            best = index;
+        }
+    }
+    m_sessions[best]++;
+    return best;
+}
+
+void DevicePool::release(size_t index) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (index < m_sessions.size() && m_sessions[index] > 0) {
+        m_sessions[index]--;
+    }
+}
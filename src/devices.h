@@ -0,0 +1,69 @@
+#ifndef DEVICES_H
+#define DEVICES_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/compute/core.hpp>
+
+/**
+ * @brief The devices sessions are placed on.
+ *
+ * Normally this is just the default device. A CPU device can instead be
+ * split with clCreateSubDevices, e.g. into one sub-device per NUMA node, so
+ * that each session's kernels run on the cores of one node only. Every
+ * sub-device gets its own context (see Kernel::sharedContext()) and each
+ * session its own queue, and buffers are first written by that queue, so
+ * their pages end up on the session's node.
+ */
+class DevicePool {
+public:
+    /**
+     * @brief Use the default device, partitioned as COMPUTE_PARTITION says,
+     * with sub-devices reserved as in COMPUTE_RESERVE.
+     */
+    DevicePool();
+
+    /**
+     * @param device Device to place sessions on.
+     * @param partition How to split a CPU device: "numa" or "cache" (by
+     * affinity domain), "equally:<cores>" or "counts:<cores>,<cores>,...".
+     * Empty to use the whole device.
+     * @param reservations Sub-devices set aside for tenants, e.g.
+     * "alice:0,1;bob:2". Other tenants' sessions are placed on the rest.
+     */
+    DevicePool(const boost::compute::device &device, const std::string &partition,
+               const std::string &reservations);
+
+    size_t size() const {
+        return m_devices.size();
+    }
+
+    const boost::compute::device& device(size_t index) const {
+        return m_devices[index];
+    }
+
+    /**
+     * @brief Choose the device for a new session of @p tenant: the one with
+     * the fewest sessions among those reserved for the tenant or, if it has
+     * none, among those not reserved for anyone.
+     * @returns the index of the device.
+     */
+    size_t place(const std::string &tenant);
+
+    /**
+     * @brief Forget a session placed on device @p index, e.g. because it
+     * failed to build or was never registered.
+     */
+    void release(size_t index);
+
+private:
+    std::vector<boost::compute::device> m_devices;
+    std::vector<size_t> m_sessions;
+    std::vector<bool> m_reserved;
+    std::map<std::string, std::vector<size_t>> m_reservations;
+    std::mutex m_mutex;
+};
+
+#endif
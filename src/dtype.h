@@ -0,0 +1,202 @@
+#ifndef DTYPE_H
+#define DTYPE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+/**
+ * @brief Element type of a session's inputs and outputs. The values match
+ * the DataType enum of the gRPC API.
+ */
+enum DataType {
+    UINT32,
+    FLOAT,
+    INT8,
+    INT16,
+    INT32,
+    INT64,
+    UINT8,
+    UINT16,
+    UINT64,
+    HALF,
+    DOUBLE,
+};
+
+/**
+ * @brief Host representation of an IEEE 754 half precision number, as
+ * read by OpenCL's vload_half/vstore_half.
+ */
+struct half_t {
+    uint16_t bits = 0;
+
+    half_t() = default;
+
+    explicit half_t(float value) {
+        uint32_t f;
+        std::memcpy(&f, &value, sizeof(f));
+        const uint32_t sign = (f >> 16) & 0x8000;
+        const int32_t exponent = static_cast<int32_t>((f >> 23) & 0xff) - 127 + 15;
+        uint32_t mantissa = f & 0x7fffff;
+
+        if (((f >> 23) & 0xff) == 0xff) {
+            // Infinity or NaN.
+            bits = static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+        } else if (exponent >= 0x1f) {
+            bits = static_cast<uint16_t>(sign | 0x7c00);
+        } else if (exponent <= 0) {
+            // Subnormal, or too small: round to nearest even.
+            if (exponent < -10) {
+                bits = static_cast<uint16_t>(sign);
+                return;
+            }
+            mantissa |= 0x800000;
+            const uint32_t shift = static_cast<uint32_t>(14 - exponent);
+            uint32_t half = mantissa >> shift;
+            const uint32_t rest = mantissa & ((1u << shift) - 1);
+            const uint32_t middle = 1u << (shift - 1);
+            if (rest > middle || (rest == middle && (half & 1))) {
+                half++;
+            }
+            bits = static_cast<uint16_t>(sign | half);
+        } else {
+            uint32_t half = sign | (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+            const uint32_t rest = mantissa & 0x1fff;
+            if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+                // May carry into the exponent, up to infinity, as it should.
+                half++;
+            }
+            bits = static_cast<uint16_t>(half);
+        }
+    }
+
+    explicit operator float() const {
+        const uint32_t sign = static_cast<uint32_t>(bits & 0x8000) << 16;
+        uint32_t exponent = (bits >> 10) & 0x1f;
+        uint32_t mantissa = bits & 0x3ff;
+        uint32_t f;
+
+        if (exponent == 0x1f) {
+            f = sign | 0x7f800000 | (mantissa << 13);
+        } else if (exponent == 0) {
+            if (mantissa == 0) {
+                f = sign;
+            } else {
+                // Normalize the subnormal.
+                exponent = 127 - 15 + 1;
+                while (!(mantissa & 0x400)) {
+                    mantissa <<= 1;
+                    exponent--;
+                }
+                f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+            }
+        } else {
+            f = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+
+        float value;
+        std::memcpy(&value, &f, sizeof(value));
+        return value;
+    }
+};
+
+/**
+ * @brief Tag carrying an element type to a visitor.
+ */
+template<typename T>
+struct TypeTag {
+    typedef T type;
+};
+
+/**
+ * @brief Compile-time properties of an element type.
+ */
+template<typename T>
+struct DataTypeTraits {
+    static constexpr bool isFloat = std::is_floating_point<T>::value;
+    static constexpr bool isSigned = std::is_signed<T>::value;
+    /** Type values are converted through, e.g. when parsing. */
+    typedef typename std::conditional<isFloat, double,
+            typename std::conditional<isSigned, int64_t, uint64_t>::type>::type Wide;
+
+    static T fromWide(Wide value) {
+        return static_cast<T>(value);
+    }
+
+    static Wide toWide(T value) {
+        return static_cast<Wide>(value);
+    }
+
+    /**
+     * @brief Whether @p value fits in T. Floating point values always do.
+     */
+    static bool fits(Wide value) {
+        return isFloat || (value >= static_cast<Wide>(std::numeric_limits<T>::lowest()) &&
+                           value <= static_cast<Wide>(std::numeric_limits<T>::max()));
+    }
+};
+
+template<>
+struct DataTypeTraits<half_t> {
+    static constexpr bool isFloat = true;
+    static constexpr bool isSigned = true;
+    typedef double Wide;
+
+    static half_t fromWide(double value) {
+        return half_t(static_cast<float>(value));
+    }
+
+    static double toWide(half_t value) {
+        return static_cast<float>(value);
+    }
+
+    static bool fits(double) {
+        return true;
+    }
+};
+
+/**
+ * @brief Call @p visitor with the TypeTag of @p type.
+ *
+ * This is the only place the element type is looked at at runtime; the
+ * visitor is instantiated for every type, so loops over elements inside it
+ * have no type branches.
+ * @throws std::invalid_argument for an unknown type.
+ */
+template<typename Visitor>
+auto visitDataType(unsigned int type, Visitor &&visitor) -> decltype(visitor(TypeTag<uint32_t>())) {
+    switch (type) {
+        case UINT32: return visitor(TypeTag<uint32_t>());
+        case FLOAT: return visitor(TypeTag<float>());
+        case INT8: return visitor(TypeTag<int8_t>());
+        case INT16: return visitor(TypeTag<int16_t>());
+        case INT32: return visitor(TypeTag<int32_t>());
+        case INT64: return visitor(TypeTag<int64_t>());
+        case UINT8: return visitor(TypeTag<uint8_t>());
+        case UINT16: return visitor(TypeTag<uint16_t>());
+        case UINT64: return visitor(TypeTag<uint64_t>());
+        case HALF: return visitor(TypeTag<half_t>());
+        case DOUBLE: return visitor(TypeTag<double>());
+    }
+    throw std::invalid_argument("Unknown data type " + std::to_string(type));
+}
+
+inline bool isValidDataType(unsigned int type) {
+    return type <= DOUBLE;
+}
+
+/**
+ * @brief Size in bytes of one element of @p type, 0 if unknown.
+ */
+inline size_t dataTypeSize(unsigned int type) {
+    if (!isValidDataType(type)) {
+        return 0;
+    }
+    return visitDataType(type, [](auto tag) { return sizeof(typename decltype(tag)::type); });
+}
+
+#endif
@@ -0,0 +1,521 @@
+/*
+Load and soak test for http_server.
+
+  http_loadgen --url=http://127.0.0.1:8848 --rps=500 --duration=60 \
+               --mix=create:1,update:10,compute:10 --pid=$(pidof http_server) \
+               --max-p99=50 --max-error-rate=0.001
+
+Sends a mix of /create, /update/{id} and /compute/{id} requests, either at a
+fixed rate (--rps) or with a fixed number of requests in flight
+(--concurrency), and prints throughput, latency percentiles, errors and the
+server's RSS every --interval seconds. Exits with 1 if a threshold is
+exceeded.
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <drogon/drogon.h>
+
+using namespace drogon;
+
+using Clock = std::chrono::steady_clock;
+
+static const char Source[] =
+    "__kernel void add(__global const uint *a,"
+    "                  __global const uint *b,"
+    "                  __global uint *c)"
+    "{"
+    "    const uint i = get_global_id(0);"
+    "    c[i] = a[i] + b[i];"
+    "}";
+
+enum Operation {
+  Create,
+  Update,
+  Compute,
+  Operations,
+};
+
+static const char* OperationNames[Operations] = { "create", "update", "compute" };
+
+struct Settings {
+  std::string url = "http://127.0.0.1:8848";
+  double rps = 0;
+  size_t concurrency = 8;
+  size_t connections = 16;
+  double duration = 30;
+  double interval = 5;
+  size_t sessions = 8;
+  size_t elements = 1024;
+  size_t maxInFlight = 1024;
+  unsigned weights[Operations] = { 0, 1, 1 };
+  int pid = 0;
+  // Thresholds; 0 disables them.
+  double maxP99 = 0;
+  double maxErrorRate = 0;
+  double minThroughput = 0;
+  double maxRssGrowth = 0;
+};
+
+static bool parseMix(const std::string &text, Settings &options) {
+  std::fill(std::begin(options.weights), std::end(options.weights), 0);
+  std::istringstream entries(text);
+  std::string entry;
+  while (std::getline(entries, entry, ',')) {
+    const auto colon = entry.find(':');
+    const auto name = entry.substr(0, colon);
+    const auto it = std::find_if(std::begin(OperationNames), std::end(OperationNames),
+                                 [&](const char* n) { return name == n; });
+    if (it == std::end(OperationNames)) {
+      return false;
+    }
+    options.weights[it - std::begin(OperationNames)] =
+        colon == std::string::npos ? 1 : std::stoul(entry.substr(colon + 1));
+  }
+  return std::any_of(std::begin(options.weights), std::end(options.weights),
+                     [](unsigned w) { return w > 0; });
+}
+
+static bool parseOptions(int argc, char **argv, Settings &options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const auto equals = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equals == std::string::npos) {
+      std::cerr << "Unrecognized argument " << arg << std::endl;
+      return false;
+    }
+    const auto name = arg.substr(2, equals - 2);
+    const auto value = arg.substr(equals + 1);
+    try {
+      if (name == "url") {
+        options.url = value;
+      } else if (name == "rps") {
+        options.rps = std::stod(value);
+      } else if (name == "concurrency") {
+        options.concurrency = std::stoul(value);
+      } else if (name == "connections") {
+        options.connections = std::max<size_t>(std::stoul(value), 1);
+      } else if (name == "duration") {
+        options.duration = std::stod(value);
+      } else if (name == "interval") {
+        options.interval = std::max(std::stod(value), 0.1);
+      } else if (name == "sessions") {
+        options.sessions = std::max<size_t>(std::stoul(value), 1);
+      } else if (name == "elements") {
+        options.elements = std::max<size_t>(std::stoul(value), 4);
+      } else if (name == "max-in-flight") {
+        options.maxInFlight = std::max<size_t>(std::stoul(value), 1);
+      } else if (name == "mix") {
+        if (!parseMix(value, options)) {
+          std::cerr << "Invalid mix " << value << std::endl;
+          return false;
+        }
+      } else if (name == "pid") {
+        options.pid = std::stoi(value);
+      } else if (name == "max-p99") {
+        options.maxP99 = std::stod(value);
+      } else if (name == "max-error-rate") {
+        options.maxErrorRate = std::stod(value);
+      } else if (name == "min-throughput") {
+        options.minThroughput = std::stod(value);
+      } else if (name == "max-rss-growth") {
+        options.maxRssGrowth = std::stod(value);
+      } else {
+        std::cerr << "Unrecognized option " << name << std::endl;
+        return false;
+      }
+    } catch (const std::logic_error&) {
+      std::cerr << "Invalid value for " << name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Resident set size of a process in MiB, or 0 if unknown.
+static double residentMiB(int pid) {
+  if (pid <= 0) {
+    return 0;
+  }
+  std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return std::stod(line.substr(6)) / 1024.0;
+    }
+  }
+  return 0;
+}
+
+struct Stats {
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+  std::vector<double> latencies; // Milliseconds
+
+  void merge(const Stats &other) {
+    requests += other.requests;
+    errors += other.errors;
+    latencies.insert(latencies.end(), other.latencies.begin(), other.latencies.end());
+  }
+};
+
+static double percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+  return sorted[index];
+}
+
+class LoadGenerator {
+public:
+  LoadGenerator(const Settings &options, trantor::EventLoop *loop)
+      : m_options(options), m_loop(loop), m_random(std::random_device()()), m_inFlight(0),
+        m_dropped(0), m_next(0) {
+    for (size_t i = 0; i < options.connections; i++) {
+      m_clients.push_back(HttpClient::newHttpClient(options.url, loop));
+    }
+    for (unsigned op = 0; op < Operations; op++) {
+      for (unsigned w = 0; w < options.weights[op]; w++) {
+        m_choices.push_back(static_cast<Operation>(op));
+      }
+    }
+  }
+
+  // Creates the sessions that updates and computations use, and waits for
+  // their kernels to be built.
+  bool setUp() {
+    for (size_t i = 0; i < m_options.sessions; i++) {
+      const auto id = createSync();
+      if (id.empty()) {
+        return false;
+      }
+      m_sessions.push_back(id);
+    }
+
+    for (const auto &id : m_sessions) {
+      if (!waitUntilReady(id)) {
+        std::cerr << "Kernel " << id << " failed to build" << std::endl;
+        return false;
+      }
+      for (size_t input = 0; input < 2; input++) {
+        if (!sendSync(inputRequest(id, input, false))) {
+          std::cerr << "Failed to set the inputs of " << id << std::endl;
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  void start() {
+    m_start = Clock::now();
+    if (m_options.rps > 0) {
+      // Open loop: send whatever is due every millisecond, regardless of
+      // how many requests are still waiting for a response.
+      m_timer = m_loop->runEvery(0.001, [this]() {
+        const double elapsed = std::chrono::duration<double>(Clock::now() - m_start).count();
+        const auto due = static_cast<uint64_t>(elapsed * m_options.rps);
+        while (m_next < due) {
+          m_next++;
+          if (m_inFlight >= m_options.maxInFlight) {
+            m_dropped++;
+            continue;
+          }
+          send();
+        }
+      });
+    } else {
+      // Closed loop: each worker sends its next request once the previous
+      // one completed.
+      m_loop->runInLoop([this]() {
+        for (size_t i = 0; i < m_options.concurrency; i++) {
+          sendNext();
+        }
+      });
+    }
+  }
+
+  void stop() {
+    m_stopping = true;
+    m_loop->runInLoop([this]() {
+      if (m_timer != 0) {
+        m_loop->invalidateTimer(m_timer);
+      }
+    });
+    for (int i = 0; i < 1000 && m_inFlight > 0; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  // Statistics since the last call.
+  std::map<Operation, Stats> collect() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<Operation, Stats> result;
+    std::swap(result, m_stats);
+    return result;
+  }
+
+  uint64_t dropped() const {
+    return m_dropped;
+  }
+
+private:
+  HttpClientPtr client() {
+    return m_clients[m_clientIndex++ % m_clients.size()];
+  }
+
+  HttpRequestPtr createRequest() {
+    Json::Value json;
+    json["source"] = Source;
+    json["type"] = 0;
+    json["outputs"].append(static_cast<Json::UInt64>(m_options.elements * sizeof(uint32_t)));
+    auto req = HttpRequest::newHttpJsonRequest(json);
+    req->setPath("/create");
+    req->setMethod(Post);
+    return req;
+  }
+
+  // Appends an input, or overwrites the first one.
+  HttpRequestPtr inputRequest(const std::string &id, size_t index, bool overwrite) {
+    Json::Value json;
+    json["update"] = "input";
+    json["index"] = static_cast<Json::UInt64>(index);
+    if (overwrite) {
+      json["offset"] = 0;
+    }
+    Json::Value data(Json::arrayValue);
+    for (size_t i = 0; i < m_options.elements; i++) {
+      data.append(static_cast<Json::UInt>(m_random() % 1000));
+    }
+    json["data"] = data;
+    auto req = HttpRequest::newHttpJsonRequest(json);
+    req->setPath("/update/" + id);
+    req->setMethod(Put);
+    return req;
+  }
+
+  HttpRequestPtr computeRequest(const std::string &id) {
+    auto req = HttpRequest::newHttpRequest();
+    req->setPath("/compute/" + id);
+    req->setMethod(Get);
+    return req;
+  }
+
+  bool sendSync(const HttpRequestPtr &req, HttpResponsePtr *response = nullptr) {
+    std::mutex mutex;
+    std::condition_variable done;
+    bool finished = false;
+    bool ok = false;
+    client()->sendRequest(req, [&](ReqResult result, const HttpResponsePtr &resp) {
+      std::lock_guard<std::mutex> lock(mutex);
+      ok = result == ReqResult::Ok && resp->getStatusCode() < 300;
+      if (response != nullptr) {
+        *response = resp;
+      }
+      finished = true;
+      done.notify_all();
+    }, 30);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return finished; });
+    return ok;
+  }
+
+  std::string createSync() {
+    HttpResponsePtr resp;
+    if (!sendSync(createRequest(), &resp) || !resp->getJsonObject()) {
+      std::cerr << "Failed to create a kernel" << std::endl;
+      return "";
+    }
+    return (*resp->getJsonObject())["uuid"].asString();
+  }
+
+  bool waitUntilReady(const std::string &id) {
+    for (;;) {
+      auto req = HttpRequest::newHttpRequest();
+      req->setPath("/" + id);
+      req->setMethod(Get);
+      HttpResponsePtr resp;
+      if (!sendSync(req, &resp) || !resp->getJsonObject()) {
+        return false;
+      }
+      const auto state = (*resp->getJsonObject())["state"].asString();
+      if (state == "ready") {
+        return true;
+      } else if (state == "failed") {
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  void sendNext() {
+    if (!m_stopping) {
+      send([this]() { sendNext(); });
+    }
+  }
+
+  // Runs on the event loop.
+  void send(std::function<void()> then = nullptr) {
+    const auto op = m_choices[m_random() % m_choices.size()];
+    const auto &id = m_sessions[m_random() % m_sessions.size()];
+
+    HttpRequestPtr req;
+    switch (op) {
+      case Create:
+        req = createRequest();
+        break;
+      case Update:
+        req = inputRequest(id, 0, true);
+        break;
+      default:
+        req = computeRequest(id);
+        break;
+    }
+
+    m_inFlight++;
+    const auto sent = Clock::now();
+    client()->sendRequest(req, [this, op, sent, then](ReqResult result, const HttpResponsePtr &resp) {
+      const double latency = std::chrono::duration<double, std::milli>(Clock::now() - sent).count();
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto &stats = m_stats[op];
+        stats.requests++;
+        if (result != ReqResult::Ok || resp->getStatusCode() >= 300) {
+          stats.errors++;
+        }
+        stats.latencies.push_back(latency);
+      }
+      m_inFlight--;
+      if (then) {
+        then();
+      }
+    }, 30);
+  }
+
+  const Settings &m_options;
+  trantor::EventLoop *m_loop;
+  std::vector<HttpClientPtr> m_clients;
+  size_t m_clientIndex = 0;
+  std::vector<Operation> m_choices;
+  std::vector<std::string> m_sessions;
+  std::mt19937 m_random;
+  std::atomic<size_t> m_inFlight;
+  std::atomic<uint64_t> m_dropped;
+  std::atomic<bool> m_stopping{false};
+  uint64_t m_next;
+  trantor::TimerId m_timer = 0;
+  Clock::time_point m_start;
+  std::mutex m_mutex;
+  std::map<Operation, Stats> m_stats;
+};
+
+static void printLine(const std::string &label, Stats stats, double seconds) {
+  std::sort(stats.latencies.begin(), stats.latencies.end());
+  char line[256];
+  std::snprintf(line, sizeof(line),
+                "%-8s %8.1f req/s  errors %6.3f%%  p50 %8.2f  p90 %8.2f  p99 %8.2f  p99.9 %8.2f ms",
+                label.c_str(), stats.requests / seconds,
+                stats.requests > 0 ? 100.0 * stats.errors / stats.requests : 0.0,
+                percentile(stats.latencies, 0.5), percentile(stats.latencies, 0.9),
+                percentile(stats.latencies, 0.99), percentile(stats.latencies, 0.999));
+  std::cout << line << std::endl;
+}
+
+int main(int argc, char **argv) {
+  Settings options;
+  if (!parseOptions(argc, argv, options)) {
+    return 2;
+  }
+
+  trantor::EventLoopThread loopThread("loadgen");
+  loopThread.run();
+
+  LoadGenerator generator(options, loopThread.getLoop());
+  if (!generator.setUp()) {
+    return 1;
+  }
+
+  const double rssStart = residentMiB(options.pid);
+  std::map<Operation, Stats> total;
+  generator.start();
+
+  const auto start = Clock::now();
+  auto last = start;
+  double elapsed = 0;
+  while (elapsed < options.duration) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(
+        std::min(options.interval, options.duration - elapsed)));
+    const auto now = Clock::now();
+    const double seconds = std::chrono::duration<double>(now - last).count();
+    last = now;
+    elapsed = std::chrono::duration<double>(now - start).count();
+
+    Stats interval;
+    for (const auto &entry : generator.collect()) {
+      interval.merge(entry.second);
+      total[entry.first].merge(entry.second);
+    }
+    std::cout << "[" << static_cast<int>(elapsed) << "s] rss " << residentMiB(options.pid)
+              << " MiB, dropped " << generator.dropped() << std::endl;
+    printLine("all", interval, seconds);
+  }
+
+  generator.stop();
+  for (const auto &entry : generator.collect()) {
+    total[entry.first].merge(entry.second);
+  }
+  const double rssEnd = residentMiB(options.pid);
+
+  std::cout << "\nTotal over " << elapsed << "s" << std::endl;
+  Stats all;
+  for (const auto &entry : total) {
+    printLine(OperationNames[entry.first], entry.second, elapsed);
+    all.merge(entry.second);
+  }
+  printLine("all", all, elapsed);
+  if (options.pid > 0) {
+    std::cout << "Server RSS " << rssStart << " -> " << rssEnd << " MiB" << std::endl;
+  }
+
+  std::sort(all.latencies.begin(), all.latencies.end());
+  const double p99 = percentile(all.latencies, 0.99);
+  const double errorRate = all.requests > 0 ? static_cast<double>(all.errors) / all.requests : 0;
+  const double throughput = all.requests / elapsed;
+
+  bool failed = false;
+  if (options.maxP99 > 0 && p99 > options.maxP99) {
+    std::cout << "FAIL: p99 " << p99 << " ms > " << options.maxP99 << " ms" << std::endl;
+    failed = true;
+  }
+  if (options.maxErrorRate > 0 && errorRate > options.maxErrorRate) {
+    std::cout << "FAIL: error rate " << errorRate << " > " << options.maxErrorRate << std::endl;
+    failed = true;
+  }
+  if (options.minThroughput > 0 && throughput < options.minThroughput) {
+    std::cout << "FAIL: throughput " << throughput << " req/s < " << options.minThroughput
+              << " req/s" << std::endl;
+    failed = true;
+  }
+  if (options.maxRssGrowth > 0 && options.pid > 0 && rssEnd - rssStart > options.maxRssGrowth) {
+    std::cout << "FAIL: server RSS grew by " << rssEnd - rssStart << " MiB > "
+              << options.maxRssGrowth << " MiB" << std::endl;
+    failed = true;
+  }
+
+  loopThread.getLoop()->quit();
+  return failed ? 1 : 0;
+}
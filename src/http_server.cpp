@@ -15,7 +15,10 @@ curl -XPOST http://localhost:8848/3a322920d42ef0763152a6efff2ed51985530aedd45370
         -H 'content-type: application/json' -d '{"foo":{"bar":42}}'
 
 */
+#include <algorithm>
+#include <thread>
 #include <drogon/drogon.h>
+#include "config.h"
 #include "server.h"
 
 using namespace drogon;
@@ -59,8 +62,21 @@ int main() {
   // line of addListener("127.0.0.1", 5555)
   LOG_INFO << "Server running on 127.0.0.1:8848";
 
+  // Computations run on the server's job threads, but other requests still
+  // wait for a session's lock on an IO thread.
+  const size_t threads = getConfigUInt("COMPUTE_HTTP_THREADS",
+                                       std::max(std::thread::hardware_concurrency(), 1u));
+
   app()
     //.setLogLevel(trantor::Logger::kWarn)
+    .setThreadNum(threads)
     .addListener("127.0.0.1", 8848)
     .run();
+
+  // run() returns once drogon has handled SIGINT/SIGTERM. Snapshot the
+  // sessions so the next start can pick them up again.
+  auto server = DrClassMap::getSingleInstance<Server>();
+  if (server) {
+    server->saveSnapshot();
+  }
 }
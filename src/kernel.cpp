@@ -1,4 +1,8 @@
 #include "kernel.h"
+#include "trace.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
 #include <utility>
 #include <iostream>
 #include <iterator>
@@ -7,23 +11,304 @@ namespace compute = boost::compute;
 
 Kernel::Kernel(boost::compute::device device)
     : m_device(device)
-    , m_context(m_device)
-    , m_queue(m_context, m_device)
+    , m_context(sharedContext(m_device))
+    , m_queue(m_context, m_device, compute::command_queue::enable_profiling)
     , m_program()
-    , m_kernel()
     , m_work_size(0)
+    , m_tileBudget(0)
+    , m_inputMutex(new std::mutex)
+    , m_poolMutex(new std::mutex)
 {
 }
 
-bool Kernel::compile(const std::string &kernel) {
+compute::context Kernel::sharedContext(const compute::device &device) {
+    static std::mutex mutex;
+    static std::map<cl_device_id, compute::context> contexts;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = contexts.find(device.id());
+    if (it == contexts.end()) {
+        it = contexts.emplace(device.id(), compute::context(device)).first;
+    }
+    return it->second;
+}
+
+bool Kernel::build(compute::program program, const std::string &entry) {
     try {
-        m_program = compute::program::create_with_source(kernel, m_context);
-        m_program.build();
-        m_kernel = boost::compute::kernel(m_program, "add");
-        return true;
-    } catch (...) {
+        program.build();
+        m_buildLog = program.build_log();
+    } catch (const compute::program_build_failure &e) {
+        m_buildLog = e.build_log();
+        return false;
+    } catch (const std::exception &e) {
+        m_buildLog = e.what();
+        return false;
+    }
+
+    if (!entry.empty()) {
+        try {
+            compute::kernel(program, entry);
+        } catch (const std::exception &e) {
+            m_buildLog += "Entry point " + entry + " not found: " + e.what() + "\n";
+            return false;
+        }
+    }
+
+    m_program = program;
+    m_entry = entry;
+    // Invocations hold kernel objects of the previous program.
+    std::lock_guard<std::mutex> lock(*m_poolMutex);
+    m_idle.clear();
+    return true;
+}
+
+bool Kernel::compile(const std::string &kernel, const std::string &entry) {
+    try {
+        if (!build(compute::program::create_with_source(kernel, m_context), entry)) {
+            return false;
+        }
+    } catch (const std::exception &e) {
+        m_buildLog = e.what();
+        return false;
+    }
+    m_source = kernel;
+    m_il.clear();
+    return true;
+}
+
+bool Kernel::compileIL(const std::vector<unsigned char> &il, const std::string &entry) {
+    if (il.empty()) {
+        m_buildLog = "Empty intermediate language module";
+        return false;
+    }
+    try {
+        if (!build(compute::program::create_with_il(il, m_context), entry)) {
+            return false;
+        }
+    } catch (const std::exception &e) {
+        // Devices before OpenCL 2.1 don't take IL at all.
+        m_buildLog = e.what();
+        return false;
+    }
+    m_source.clear();
+    m_il = il;
+    return true;
+}
+
+bool Kernel::compileBinary(const std::vector<unsigned char> &binary, const std::string &source,
+                           const std::string &entry, const std::vector<unsigned char> &il) {
+    if (!binary.empty()) {
+        try {
+            if (build(compute::program::create_with_binary(binary, m_context), entry)) {
+                m_source = source;
+                m_il = il;
+                return true;
+            }
+        } catch (const std::exception &e) {
+            m_buildLog = e.what();
+        }
+        // Binary was built for another device or driver. Recompile.
+    }
+    if (!source.empty()) {
+        return compile(source, entry);
+    } else if (!il.empty()) {
+        return compileIL(il, entry);
+    }
+    if (binary.empty()) {
+        m_buildLog = "Empty program";
+    }
+    return false;
+}
+
+bool Kernel::setPipeline(const std::vector<PipelineStage> &stages,
+                         const std::vector<size_t> &intermediates) {
+    for (const auto &stage : stages) {
+        for (const auto &arg : stage.args) {
+            if ((arg.kind == PipelineArg::Output && arg.index >= m_outputSizes.size()) ||
+                (arg.kind == PipelineArg::Intermediate && arg.index >= intermediates.size())) {
+                return false;
+            }
+        }
+        try {
+            if (compute::kernel(m_program, stage.entry).arity() != stage.args.size()) {
+                return false;
+            }
+        } catch (...) {
+            return false;
+        }
+    }
+
+    m_pipeline = stages;
+    m_intermediateSizes = intermediates;
+    std::lock_guard<std::mutex> lock(*m_poolMutex);
+    m_idle.clear();
+    return true;
+}
+
+std::vector<unsigned char> Kernel::binary() const {
+    if (!m_program.get()) {
+        return {};
+    }
+    return m_program.binary();
+}
+
+bool Kernel::addMappedInputData(const uint64_t index, void* ptr, size_t size,
+                                size_t typeSize, std::shared_ptr<void> mapping) {
+    // Not uploaded until the kernel runs, so that restoring a snapshot
+    // does not fault in every page.
+    BufferInfo info;
+    info.ptr = ptr;
+    info.size = size;
+    info.typeSize = typeSize;
+    info.mapping = std::move(mapping);
+    markDirty(info, 0, size * typeSize);
+    return setInput(index, std::move(info));
+}
+
+bool Kernel::addHostInput(const uint64_t index, void* ptr, size_t size,
+                          size_t typeSize, std::shared_ptr<void> mapping) {
+    BufferInfo info;
+    info.ptr = ptr;
+    info.size = size;
+    info.typeSize = typeSize;
+    info.mapping = std::move(mapping);
+    info.shared = true;
+    if (size * typeSize > 0) {
+        info.buffer = compute::buffer(m_context, size * typeSize,
+                                      compute::buffer::read_only | compute::buffer::use_host_ptr,
+                                      ptr);
+    }
+    return setInput(index, std::move(info));
+}
+
+bool Kernel::addBufferInput(const uint64_t index, compute::buffer buffer,
+                            size_t size, size_t typeSize,
+                            const std::string &dataset, size_t offset) {
+    BufferInfo info;
+    info.buffer = buffer;
+    info.size = size;
+    info.typeSize = typeSize;
+    info.dataset = dataset;
+    info.datasetOffset = offset;
+    return setInput(index, std::move(info));
+}
+
+void Kernel::addInputData(StagingBuffer data, size_t typeSize) {
+    addInputData(m_input.size(), std::move(data), typeSize);
+}
+
+bool Kernel::addInputData(const uint64_t index, StagingBuffer data, size_t typeSize) {
+    // The previous host copy is freed once its last transfer is done.
+    BufferInfo info;
+    info.size = typeSize > 0 ? data.size() / typeSize : 0;
+    info.typeSize = typeSize;
+    info.ptr = data.data();
+    info.staging = std::move(data);
+    if (!setInput(index, std::move(info))) {
         return false;
     }
+    replaced(m_input[index]);
+    return true;
+}
+
+bool Kernel::setInput(const uint64_t index, BufferInfo info) {
+    if (index > m_input.size()) {
+        return false;
+    } else if (index == m_input.size()) {
+        m_input.push_back(std::move(info));
+    } else {
+        // The old buffer may wrap the old input's memory, so it has to go
+        // first, and a transfer from mapped memory has to finish.
+        auto &old = m_input[index];
+        old.buffer = compute::buffer();
+        if (old.mapping && old.upload.get()) {
+            old.upload.wait();
+        }
+        old = std::move(info);
+    }
+
+    if (m_input[index].size > m_work_size) {
+        m_work_size = m_input[index].size;
+    }
+    return true;
+}
+
+void Kernel::replaced(BufferInfo &info) {
+    markDirty(info, 0, info.size * info.typeSize);
+    // Tiled kernels stream their inputs from the host instead.
+    if (m_tileBudget == 0) {
+        upload(info);
+    }
+}
+
+void Kernel::markDirty(BufferInfo &info, size_t begin, size_t end) {
+    if (begin >= end) {
+        return;
+    }
+
+    auto &dirty = info.dirty;
+    auto it = std::lower_bound(dirty.begin(), dirty.end(), std::make_pair(begin, end));
+    if (it != dirty.begin() && std::prev(it)->second >= begin) {
+        --it;
+    }
+
+    // Merge every range that overlaps or touches [begin, end).
+    auto last = it;
+    while (last != dirty.end() && last->first <= end) {
+        begin = std::min(begin, last->first);
+        end = std::max(end, last->second);
+        ++last;
+    }
+    it = dirty.erase(it, last);
+    dirty.insert(it, std::make_pair(begin, end));
+}
+
+void Kernel::upload(BufferInfo &info) {
+    const size_t bytes = info.size * info.typeSize;
+    if (info.ptr == nullptr || bytes == 0) {
+        return;
+    }
+    if (!info.buffer.get() || info.buffer.size() != bytes) {
+        info.buffer = compute::buffer(m_context, bytes);
+        info.dirty.assign(1, std::make_pair(size_t(0), bytes));
+    }
+    if (info.dirty.empty()) {
+        return;
+    }
+
+    TraceSpan span("upload");
+    const char* host = static_cast<const char*>(info.ptr);
+    for (const auto &range : info.dirty) {
+        info.upload = m_queue.enqueue_write_buffer_async(info.buffer, range.first,
+            range.second - range.first, host + range.first);
+        traceDeviceEvent("write", info.upload, range.second - range.first);
+    }
+    info.staging.fence(info.upload);
+    info.dirty.clear();
+    m_queue.flush();
+}
+
+size_t Kernel::memory() const {
+    size_t bytes = 0;
+    for (const auto &info : m_input) {
+        bytes += info.size * info.typeSize;
+    }
+    for (const auto size : m_outputSizes) {
+        bytes += size;
+    }
+    for (const auto size : m_intermediateSizes) {
+        bytes += size;
+    }
+    return bytes;
+}
+
+std::vector<Kernel::InputView> Kernel::inputs() const {
+    std::vector<InputView> views;
+    views.reserve(m_input.size());
+    for (const auto &info : m_input) {
+        views.push_back({ info.ptr, info.size, info.typeSize, info.dataset, info.datasetOffset });
+    }
+    return views;
 }
 
 // TODO: append, not replace.
@@ -31,43 +316,395 @@ void Kernel::addOutputParams(std::vector<size_t> params) {
     m_outputSizes = params;
 }
 
-void Kernel::execute() {
-    // setup input arrays
+compute::buffer& Kernel::outputBuffer(Invocation &invocation, size_t index) {
+    if (invocation.outputs.size() < m_outputSizes.size()) {
+        invocation.outputs.resize(m_outputSizes.size());
+    }
+    auto &buffer = invocation.outputs[index];
+    if (!buffer.get() || buffer.size() != m_outputSizes[index]) {
+        buffer = compute::buffer(m_context, m_outputSizes[index]);
+    }
+    return buffer;
+}
 
-    std::cout << "pre-input\n";
-    std::cout << "Size: " << m_input.size() << "\n";
-    for(auto i=0; i<m_input.size(); i++)
+compute::buffer Kernel::deviceBuffer(const PipelineArg &arg) {
+    switch (arg.kind) {
+        case PipelineArg::Input: {
+            if (arg.index >= m_input.size()) {
+                return compute::buffer();
+            }
+            std::lock_guard<std::mutex> lock(*m_inputMutex);
+            auto &d = m_input[arg.index];
+            upload(d);
+            return d.buffer;
+        }
+        case PipelineArg::Output:
+            if (!m_latest || arg.index >= m_latest->outputs.size() ||
+                !m_latest->outputData.empty()) {
+                return compute::buffer();
+            }
+            return m_latest->outputs[arg.index];
+        default:
+            return compute::buffer();
+    }
+}
+
+size_t Kernel::outputSize(const Invocation &invocation, size_t index) {
+    if (index < invocation.outputData.size() && !invocation.outputData[index].empty()) {
+        return invocation.outputData[index].size();
+    }
+    if (index >= invocation.outputs.size() || !invocation.outputs[index].get()) {
+        return 0;
+    }
+    return invocation.outputs[index].size();
+}
+
+size_t Kernel::readOutput(Invocation &invocation, size_t index, void *data, size_t bytes) {
+    bytes = std::min(bytes, outputSize(invocation, index));
+    if (bytes == 0) {
+        return 0;
+    }
+    // Tiled execution reads the output back to the host as it goes.
+    if (index < invocation.outputData.size() && !invocation.outputData[index].empty()) {
+        memcpy(data, invocation.outputData[index].data(), bytes);
+        return bytes;
+    }
+
+    TraceSpan span("readback");
+    invocation.queue.enqueue_read_buffer(invocation.outputs[index], 0, bytes, data);
+    return bytes;
+}
+
+Kernel::Execution::Execution(Kernel &kernel, std::unique_ptr<Invocation> invocation)
+    : m_kernel(&kernel)
+    , m_invocation(std::move(invocation))
+{
+}
+
+Kernel::Execution::Execution(Execution &&other) noexcept
+    : m_kernel(other.m_kernel)
+    , m_invocation(std::move(other.m_invocation))
+{
+}
+
+uint64_t Kernel::Execution::deviceTime() const {
+    uint64_t total = 0;
+    for (const auto &event : m_invocation->launches) {
+        event.wait();
+        const auto start = event.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_START);
+        const auto end = event.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_END);
+        total += end > start ? end - start : 0;
+    }
+    return total;
+}
+
+Kernel::Execution::~Execution() {
+    if (m_invocation) {
+        m_kernel->finish(std::move(m_invocation));
+    }
+}
+
+std::unique_ptr<Kernel::Invocation> Kernel::acquire() {
     {
-        std::cout << "  0\n";
-        auto d = m_input[i];
-        std::cout << "  1\n";
+        std::lock_guard<std::mutex> lock(*m_poolMutex);
+        if (!m_idle.empty()) {
+            auto invocation = std::move(m_idle.back());
+            m_idle.pop_back();
+            return invocation;
+        }
+    }
 
-        // Transfer the data the host to the device.
-        m_queue.enqueue_write_buffer(d.buffer, 0, d.size * d.typeSize, d.ptr);
-        std::cout << "  2\n";
-        // Set the kernel argument.
-        m_kernel.set_arg(i, d.buffer);
+    // Kernel objects are created from the shared program; each invocation
+    // sets its own arguments on its own objects, so launches don't race.
+    std::unique_ptr<Invocation> invocation(new Invocation);
+    invocation->queue = compute::command_queue(m_context, m_device,
+                                               compute::command_queue::enable_profiling);
+    if (!m_entry.empty()) {
+        invocation->kernel = compute::kernel(m_program, m_entry);
+    }
+    for (const auto &stage : m_pipeline) {
+        invocation->stageKernels.emplace_back(m_program, stage.entry);
+    }
+    if (!m_pipeline.empty()) {
+        // Stages are ordered with events, so let independent ones overlap
+        // when the device allows it.
+        const auto supported = m_device.get_info<cl_command_queue_properties>(CL_DEVICE_QUEUE_PROPERTIES);
+        const auto properties = (supported & compute::command_queue::enable_out_of_order_execution) |
+                                compute::command_queue::enable_profiling;
+        invocation->pipelineQueue = compute::command_queue(m_context, m_device, properties);
+    }
+    return invocation;
+}
+
+void Kernel::finish(std::unique_ptr<Invocation> invocation) {
+    try {
+        invocation->queue.finish();
+        if (invocation->pipelineQueue.get()) {
+            invocation->pipelineQueue.finish();
+        }
+    } catch (const std::exception &e) {
+        // The outputs are unusable, and so is the invocation.
+        std::cerr << "Kernel: execution failed: " << e.what() << "\n";
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(*m_poolMutex);
+    std::swap(invocation, m_latest);
+    if (invocation && m_idle.size() < IdleInvocations) {
+        m_idle.push_back(std::move(invocation));
+    }
+}
+
+std::vector<compute::event> Kernel::prepareInputs() {
+    std::lock_guard<std::mutex> lock(*m_inputMutex);
+    std::vector<compute::event> uploads;
+    uploads.reserve(m_input.size());
+    for (auto &d : m_input) {
+        // Transfer whatever changed since the last run from the host to the
+        // device. Usually the upload already started when the input was
+        // updated. Dataset inputs are already on the device.
+        upload(d);
+        uploads.push_back(d.upload);
+    }
+    return uploads;
+}
+
+Kernel::Execution Kernel::launch() {
+    Execution execution(*this, acquire());
+    auto &invocation = *execution.m_invocation;
+    invocation.outputData.clear();
+    invocation.launches.clear();
+
+    if (!m_pipeline.empty()) {
+        executePipeline(invocation);
+    } else if (m_tileBudget == 0 || !executeTiled(invocation)) {
+        // Kernels that aren't element-wise run in one launch.
+        executeSingle(invocation);
+    }
+    return execution;
+}
+
+void Kernel::execute() {
+    launch();
+}
+
+void Kernel::executeSingle(Invocation &invocation) {
+    auto &kernel = invocation.kernel;
+
+    // Launches go to the invocation's queue, so they have to wait for the
+    // uploads on the kernel's queue explicitly.
+    compute::wait_list uploads;
+    const auto events = prepareInputs();
+    for (size_t i = 0; i < m_input.size(); i++) {
+        if (events[i].get()) {
+            uploads.insert(events[i]);
+        }
+        kernel.set_arg(i, m_input[i].buffer);
     }
 
-    std::cout << "pre-output\n";
-    // Make space for the output
     const size_t outputStart = m_input.size();
-    const size_t outputEnd = outputStart + 1;
-    for (auto i=outputStart; i<outputEnd; i++)
-    {
-        const auto sizeOffset = i - outputStart;
-        const auto size = m_outputSizes[sizeOffset];
+    for (size_t j = 0; j < m_outputSizes.size(); j++) {
+        kernel.set_arg(outputStart + j, outputBuffer(invocation, j));
+    }
 
-        compute::buffer buffer(m_context, size);
-        m_kernel.set_arg(i, buffer);
-        m_output.push_back(buffer);
+    TraceSpan span("launch");
+    const auto event = invocation.queue.enqueue_1d_range_kernel(kernel, 0, m_work_size, 0, uploads);
+    traceDeviceEvent("kernel", event);
+    invocation.launches.push_back(event);
+    invocation.queue.flush();
+}
+
+bool Kernel::executeTiled(Invocation &invocation) {
+    TraceSpan span("tiles");
+    const size_t items = m_work_size;
+    if (items == 0 || m_entry.empty()) {
+        return false;
     }
 
-    // run the add kernel
-    std::cout << "pre-enqueue\n";
-    m_queue.enqueue_1d_range_kernel(m_kernel, 0, m_work_size, 0);
+    // Every input must cover the whole range, and every output must use a
+    // whole number of bytes per work item.
+    size_t bytesPerItem = 0;
+    size_t largestItem = 0;
+    for (const auto &d : m_input) {
+        if (d.size != items || d.typeSize == 0) {
+            return false;
+        }
+        bytesPerItem += d.typeSize;
+        largestItem = std::max(largestItem, d.typeSize);
+    }
+    std::vector<size_t> outputItemSizes;
+    for (const auto size : m_outputSizes) {
+        if (size == 0 || size % items != 0) {
+            return false;
+        }
+        outputItemSizes.push_back(size / items);
+        bytesPerItem += size / items;
+        largestItem = std::max(largestItem, size / items);
+    }
+    if (bytesPerItem == 0) {
+        return false;
+    }
 
-    for(size_t i=0; i<m_input.size(); i++) {
-        // delete ptr
+    const size_t maxAlloc = m_device.max_memory_alloc_size();
+    size_t tileItems = m_tileBudget / (TileBufferSets * bytesPerItem);
+    tileItems = std::min(tileItems, maxAlloc / largestItem);
+    tileItems = std::min(tileItems, items);
+    if (tileItems == 0) {
+        return false;
     }
+    const size_t tiles = (items + tileItems - 1) / tileItems;
+
+    auto &uploadQueue = invocation.uploadQueue;
+    auto &downloadQueue = invocation.downloadQueue;
+    auto &queue = invocation.queue;
+    auto &kernel = invocation.kernel;
+    if (!uploadQueue.get()) {
+        uploadQueue = compute::command_queue(m_context, m_device,
+                                             compute::command_queue::enable_profiling);
+        downloadQueue = compute::command_queue(m_context, m_device,
+                                               compute::command_queue::enable_profiling);
+    }
+
+    auto &outputData = invocation.outputData;
+    outputData.resize(m_outputSizes.size());
+    for (size_t j = 0; j < m_outputSizes.size(); j++) {
+        outputData[j].resize(m_outputSizes[j]);
+    }
+
+    struct TileSet {
+        std::vector<compute::buffer> inputs;
+        std::vector<compute::buffer> outputs;
+        // Completes once the set's last tile has been read back.
+        compute::event done;
+    };
+
+    std::vector<TileSet> sets(std::min(TileBufferSets, tiles));
+    for (auto &set : sets) {
+        for (const auto &d : m_input) {
+            set.inputs.emplace_back(m_context, tileItems * d.typeSize);
+        }
+        for (const auto itemSize : outputItemSizes) {
+            set.outputs.emplace_back(m_context, tileItems * itemSize);
+        }
+    }
+
+    for (size_t t = 0; t < tiles; t++) {
+        auto &set = sets[t % sets.size()];
+        const size_t start = t * tileItems;
+        const size_t count = std::min(tileItems, items - start);
+
+        // Don't overwrite the set before its previous tile was read back.
+        compute::wait_list reuse;
+        if (set.done.get()) {
+            reuse.insert(set.done);
+        }
+
+        compute::wait_list ready = reuse;
+        for (size_t i = 0; i < m_input.size(); i++) {
+            const auto &d = m_input[i];
+            const size_t offset = start * d.typeSize;
+            const size_t bytes = count * d.typeSize;
+
+            compute::event written;
+            if (d.ptr != nullptr) {
+                const char* src = static_cast<const char*>(d.ptr) + offset;
+                written = uploadQueue.enqueue_write_buffer_async(set.inputs[i], 0, bytes, src, reuse);
+            } else {
+                // Dataset inputs are already on the device.
+                written = uploadQueue.enqueue_copy_buffer(d.buffer, set.inputs[i], offset, 0, bytes, reuse);
+            }
+            traceDeviceEvent("write", written, t);
+            ready.insert(written);
+            kernel.set_arg(i, set.inputs[i]);
+        }
+        for (size_t j = 0; j < set.outputs.size(); j++) {
+            kernel.set_arg(m_input.size() + j, set.outputs[j]);
+        }
+
+        compute::event computed = queue.enqueue_1d_range_kernel(kernel, 0, count, 0, ready);
+        traceDeviceEvent("kernel", computed, t);
+        invocation.launches.push_back(computed);
+
+        set.done = computed;
+        for (size_t j = 0; j < set.outputs.size(); j++) {
+            unsigned char* dst = outputData[j].data() + start * outputItemSizes[j];
+            set.done = downloadQueue.enqueue_read_buffer_async(set.outputs[j], 0,
+                count * outputItemSizes[j], dst, compute::wait_list(computed));
+            traceDeviceEvent("read", set.done, t);
+        }
+
+        uploadQueue.flush();
+        queue.flush();
+        downloadQueue.flush();
+    }
+
+    downloadQueue.finish();
+    queue.finish();
+    return true;
+}
+
+void Kernel::executePipeline(Invocation &invocation) {
+    TraceSpan span("pipeline");
+
+    // Events of the last commands that used each buffer. A stage waits for
+    // all of them before touching the buffer.
+    std::map<cl_mem, compute::wait_list> pending;
+
+    const auto uploads = prepareInputs();
+    for (size_t i = 0; i < m_input.size(); i++) {
+        if (uploads[i].get()) {
+            pending[m_input[i].buffer.get()].insert(uploads[i]);
+        }
+    }
+
+    auto &intermediates = invocation.intermediates;
+    if (intermediates.size() != m_intermediateSizes.size()) {
+        intermediates.clear();
+        for (const auto size : m_intermediateSizes) {
+            intermediates.emplace_back(m_context, size);
+        }
+    }
+
+    for (size_t s = 0; s < m_pipeline.size(); s++) {
+        const auto &stage = m_pipeline[s];
+        auto &kernel = invocation.stageKernels[s];
+
+        std::vector<cl_mem> used;
+        compute::wait_list dependencies;
+        for (size_t a = 0; a < stage.args.size(); a++) {
+            const auto &arg = stage.args[a];
+
+            compute::buffer buffer;
+            switch (arg.kind) {
+                case PipelineArg::Input:
+                    if (arg.index >= m_input.size()) {
+                        throw std::out_of_range("Pipeline input " + std::to_string(arg.index) + " is not set");
+                    }
+                    buffer = m_input[arg.index].buffer;
+                    break;
+                case PipelineArg::Output:
+                    buffer = outputBuffer(invocation, arg.index);
+                    break;
+                case PipelineArg::Intermediate:
+                    buffer = intermediates[arg.index];
+                    break;
+            }
+
+            for (const auto &event : pending[buffer.get()]) {
+                dependencies.insert(event);
+            }
+            used.push_back(buffer.get());
+            kernel.set_arg(a, buffer);
+        }
+
+        const size_t workSize = stage.workSize > 0 ? stage.workSize : m_work_size;
+        const auto event = invocation.pipelineQueue.enqueue_1d_range_kernel(kernel, 0, workSize, 0, dependencies);
+        traceDeviceEvent("kernel", event, s);
+        invocation.launches.push_back(event);
+        for (const auto mem : used) {
+            pending[mem] = compute::wait_list(event);
+        }
+    }
+
+    invocation.pipelineQueue.finish();
 }
@@ -1,10 +1,17 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
+#include <cstring>
 #include <boost/compute/core.hpp>
 #include <iostream>
+#include "pipeline.h"
+#include "staging.h"
+#include "trace.h"
 
 /**
  * @brief A computing kernel.
@@ -19,11 +26,115 @@ public:
      */
     Kernel(boost::compute::device device = boost::compute::system::default_device());
 
+    /**
+     * @brief The context shared by all kernels running on @p device.
+     * Buffers created in it (e.g. datasets) can be used by any of them.
+     */
+    static boost::compute::context sharedContext(const boost::compute::device &device);
+
+    const boost::compute::context& context() const {
+        return m_context;
+    }
+
     /**
      * @brief Compile an OpenCL Kernel.
      * @param kernel Kernel source.
+     * @param entry Kernel function run by execute(). Leave empty when the
+     * program is run as a pipeline.
+     */
+    bool compile(const std::string &kernel, const std::string &entry = "add");
+
+    /**
+     * @brief Build a program from SPIR-V or another intermediate language
+     * accepted by the device (clCreateProgramWithIL).
+     * @param il Intermediate language module.
+     * @param entry Kernel function run by execute().
+     */
+    bool compileIL(const std::vector<unsigned char> &il, const std::string &entry = "add");
+
+    /**
+     * @brief Load a previously compiled program binary.
+     * Falls back to compiling @p source, or @p il if there is no source, if
+     * the binary is rejected, e.g. after a driver upgrade.
+     * @param binary Program binary, as returned by binary().
+     * @param source Kernel source the binary was built from, if any.
+     * @param entry Kernel function run by execute().
+     * @param il Intermediate language the binary was built from, if any.
+     */
+    bool compileBinary(const std::vector<unsigned char> &binary, const std::string &source,
+                       const std::string &entry = "add",
+                       const std::vector<unsigned char> &il = {});
+
+    /**
+     * @brief Compiler output of the last compile, compileIL() or
+     * compileBinary(), including errors if it failed.
+     */
+    const std::string& buildLog() const {
+        return m_buildLog;
+    }
+
+    /**
+     * @brief Kernel function run by execute(), if not running a pipeline.
+     */
+    const std::string& entry() const {
+        return m_entry;
+    }
+
+    /**
+     * @brief Run several kernel functions of the program, in order, instead
+     * of a single entry point.
+     *
+     * Intermediate buffers stay on the device for the whole pipeline; only
+     * the outputs are read back. Stages are ordered by event dependencies on
+     * the buffers they share, so independent stages may run concurrently.
+     * Must be called after compile() and addOutputParams().
+     * @param stages Kernel launches.
+     * @param intermediates Sizes in bytes of the intermediate buffers.
+     */
+    bool setPipeline(const std::vector<PipelineStage> &stages,
+                     const std::vector<size_t> &intermediates);
+
+    const std::vector<PipelineStage>& pipeline() const {
+        return m_pipeline;
+    }
+
+    const std::vector<size_t>& intermediateSizes() const {
+        return m_intermediateSizes;
+    }
+
+    /**
+     * @brief Source code of the compiled kernel.
+     */
+    const std::string& source() const {
+        return m_source;
+    }
+
+    /**
+     * @brief Intermediate language the program was built from, if any.
+     */
+    const std::vector<unsigned char>& il() const {
+        return m_il;
+    }
+
+    /**
+     * @brief Device binary of the compiled program.
+     */
+    std::vector<unsigned char> binary() const;
+
+    /**
+     * @brief Add an input parameter, taking over its host copy.
+     * The data is not copied again; the transfer to the device starts right
+     * away.
+     * @param data Input data, e.g. parsed straight into the buffer.
+     * @param typeSize Size of one element in bytes.
+     */
+    void addInputData(StagingBuffer data, size_t typeSize);
+
+    /**
+     * @brief Replace input parameter @p index, taking over its host copy.
+     * @returns false if @p index is past the end of the inputs.
      */
-    bool compile(const std::string &kernel);
+    bool addInputData(const uint64_t index, StagingBuffer data, size_t typeSize);
 
     /**
      * @brief Add input parameters to the kernel.
@@ -31,57 +142,246 @@ public:
      * @param data An array of data to pass to the kernel.
      */
     template<typename T>
-    void addInputData(std::vector<T> data) {
-        const size_t size = data.size();
-        const size_t typeSize = sizeof(T);
-        const size_t totalSize = size * typeSize;
-        void* ptr = nullptr;
-    
-        ptr = new T*[totalSize];
-        memcpy(ptr, data.data(), totalSize);
+    void addInputData(const std::vector<T> &data) {
+        addInputData(stage(data), sizeof(T));
+    }
 
-        // create a memory buffer.
-        boost::compute::buffer buffer(m_context, size * typeSize);
-        const BufferInfo info = { buffer, ptr, size, typeSize };
-        m_input.push_back(info);
+    template<typename T>
+    bool addInputData(const uint64_t index, const std::vector<T> &data) {
+        return addInputData(index, stage(data), sizeof(T));
+    }
 
-        if (data.size() > m_work_size) {
-            m_work_size = data.size();
+    /**
+     * @brief Overwrite part of an input parameter.
+     *
+     * Only the changed range is transferred to the device, and the transfer
+     * starts right away instead of when the kernel is executed. Waits for
+     * the previous transfer of the input to finish reading the host copy
+     * before overwriting it.
+     * @param index Input parameter to update.
+     * @param offset First element to overwrite.
+     * @param data New values.
+     * @param count Number of values.
+     * @returns false if the range is outside the input, the element type
+     * does not match, or the input has no host copy (datasets).
+     */
+    template<typename T>
+    bool updateInputData(const uint64_t index, size_t offset, const T *data, size_t count) {
+        if (index >= m_input.size()) {
+            return false;
+        }
+        auto &info = m_input[index];
+        if (info.ptr == nullptr || info.shared || info.typeSize != sizeof(T) ||
+            offset > info.size || count > info.size - offset) {
+            return false;
+        }
+
+        if (info.upload.get()) {
+            info.upload.wait();
+        }
+        const size_t begin = offset * sizeof(T);
+        const size_t end = begin + count * sizeof(T);
+        memcpy(static_cast<char*>(info.ptr) + begin, data, end - begin);
+        markDirty(info, begin, end);
+        if (m_tileBudget == 0) {
+            upload(info);
         }
+        return true;
     }
 
     template<typename T>
-    void addInputData(const uint64_t index, std::vector<T> data) {
-        const size_t size = data.size();
-        const size_t typeSize = sizeof(T);
-        const size_t totalSize = size * typeSize;
-        void* ptr = nullptr;
-    
-        ptr = new T*[totalSize];
-        //memcpy(ptr, &data[0], totalSize);
-        memcpy(ptr, data.data(), totalSize);
-
-        // create a memory buffer.
-        boost::compute::buffer buffer(m_context, size * typeSize);
-        const BufferInfo info = { buffer, ptr, size, typeSize };
-        m_input[index] = info;
-
-        if (data.size() > m_work_size) {
-            m_work_size = data.size();
-        }
+    bool updateInputData(const uint64_t index, size_t offset, const std::vector<T> &data) {
+        return updateInputData(index, offset, data.data(), data.size());
+    }
+
+    /**
+     * @brief Add input parameters that live in memory owned by someone else.
+     * The data is not copied; it is only read when the kernel is executed.
+     * @param index Input parameter to replace.
+     * @param ptr Start of the input data.
+     * @param size Number of elements.
+     * @param typeSize Size of one element in bytes.
+     * @param mapping Keeps @p ptr valid for as long as the kernel uses it.
+     * @returns false if @p index is past the end of the inputs.
+     */
+    bool addMappedInputData(const uint64_t index, void* ptr, size_t size,
+                            size_t typeSize, std::shared_ptr<void> mapping);
+
+    /**
+     * @brief Use memory shared with a client, e.g. a memfd mapping, as an
+     * input parameter in place.
+     *
+     * The buffer wraps the memory (CL_MEM_USE_HOST_PTR), so CPU devices
+     * read it without copying. The memory must not change while the kernel
+     * runs; to use new contents, add it again. The input cannot be updated
+     * through updateInputData().
+     * @param index Input parameter to replace.
+     * @param ptr Start of the input data.
+     * @param size Number of elements.
+     * @param typeSize Size of one element in bytes.
+     * @param mapping Keeps @p ptr valid for as long as the kernel uses it.
+     * @returns false if @p index is past the end of the inputs.
+     */
+    bool addHostInput(const uint64_t index, void* ptr, size_t size,
+                      size_t typeSize, std::shared_ptr<void> mapping);
+
+    /**
+     * @brief Use an existing device buffer as an input parameter.
+     * The buffer is never written by the host, so nothing is transferred
+     * when the kernel is executed.
+     * @param index Input parameter to replace.
+     * @param buffer Device buffer, created in context().
+     * @param size Number of elements.
+     * @param typeSize Size of one element in bytes.
+     * @param dataset Name of the dataset the buffer was created from.
+     * @param offset Byte offset of the buffer within the dataset.
+     * @returns false if @p index is past the end of the inputs.
+     */
+    bool addBufferInput(const uint64_t index, boost::compute::buffer buffer,
+                        size_t size, size_t typeSize,
+                        const std::string &dataset, size_t offset);
+
+    /**
+     * @brief A read-only view of one input parameter.
+     * Inputs bound to a dataset have no host pointer.
+     */
+    struct InputView {
+        const void* ptr;
+        size_t size;
+        size_t typeSize;
+        std::string dataset;
+        size_t datasetOffset;
+    };
+
+    /**
+     * @brief Host-side views of all input parameters.
+     */
+    std::vector<InputView> inputs() const;
+
+    /**
+     * @brief Size in bytes of input parameter @p index, 0 if it isn't set.
+     */
+    size_t inputBytes(const uint64_t index) const {
+        return index < m_input.size() ? m_input[index].size * m_input[index].typeSize : 0;
     }
 
+    /**
+     * @brief Bytes of inputs, outputs and intermediate buffers, as charged
+     * to the session's tenant.
+     */
+    size_t memory() const;
+
     /**
      * @brief Add output parameters to a kernel.
      * @param params List of output sizes.
      */
     void addOutputParams(std::vector<size_t> params);
 
+    struct Invocation;
+
+    /**
+     * @brief One execution of the kernel, holding its outputs.
+     *
+     * Each execution has its own kernel objects, queues and output buffers,
+     * taken from a pool, and only reads the inputs, so several executions
+     * of the same kernel can run at once. When an execution ends, it waits
+     * for its commands, and its outputs become the kernel's outputs (see
+     * getOutput() and deviceBuffer()).
+     */
+    class Execution {
+    public:
+        Execution(Execution &&other) noexcept;
+        Execution(const Execution&) = delete;
+        Execution& operator=(const Execution&) = delete;
+        ~Execution();
+
+        /**
+         * @brief Read output @p index of this execution back as elements of
+         * type T. Empty if there is no such output.
+         */
+        template<typename T>
+        std::vector<T> getOutput(size_t index) {
+            return Kernel::readOutput<T>(*m_invocation, index);
+        }
+
+        /**
+         * @brief Size in bytes of output @p index, 0 if there is no such
+         * output.
+         */
+        size_t outputSize(size_t index) const {
+            return Kernel::outputSize(*m_invocation, index);
+        }
+
+        /**
+         * @brief Read up to @p bytes of output @p index into @p data, e.g.
+         * memory shared with the client.
+         * @returns the number of bytes read.
+         */
+        size_t readOutput(size_t index, void *data, size_t bytes) {
+            return Kernel::readOutput(*m_invocation, index, data, bytes);
+        }
+
+        /**
+         * @brief Time the device spent running this execution's kernels, in
+         * nanoseconds, from their profiling information. Waits for them.
+         */
+        uint64_t deviceTime() const;
+
+    private:
+        friend class Kernel;
+        Execution(Kernel &kernel, std::unique_ptr<Invocation> invocation);
+
+        Kernel *m_kernel;
+        std::unique_ptr<Invocation> m_invocation;
+    };
+
+    /**
+     * @brief Start an execution of the compiled kernel.
+     * May be called from several threads at once, as long as the inputs are
+     * not changed until the executions have ended.
+     */
+    Execution launch();
+
     /**
-     * @brief Execute the compiled kernel.
+     * @brief Execute the compiled kernel, and wait for it to finish.
      */
     void execute();
 
+    /**
+     * @brief Run the kernel in tiles that fit in @p budget bytes of device
+     * memory instead of in a single launch.
+     *
+     * Only valid for element-wise kernels: work item i may only access
+     * element i of every input and the i-th slice of every output. Tiles are
+     * rotated through several buffer sets so that uploading the next tile,
+     * computing the current one and reading back the previous one overlap.
+     * Inputs and outputs therefore do not need to fit on the device.
+     * @param budget Device memory for all tile buffers, in bytes. 0 runs the
+     * kernel in a single launch.
+     */
+    void setTileBudget(size_t budget) {
+        m_tileBudget = budget;
+    }
+
+    size_t tileBudget() const {
+        return m_tileBudget;
+    }
+
+    /**
+     * @brief Device buffer holding an input or output.
+     * Inputs that are not on the device yet are uploaded first. Returns a
+     * null buffer if the data only exists on the host, e.g. the outputs of
+     * a tiled execution.
+     */
+    boost::compute::buffer deviceBuffer(const PipelineArg &arg);
+
+    /**
+     * @brief Queue used for transfers to the inputs and for primitives.
+     */
+    boost::compute::command_queue& queue() {
+        return m_queue;
+    }
+
     /**
      * @brief Return output data from the kernel.
      * @param index Which output parameter to use.
@@ -91,39 +391,177 @@ public:
      */
     template<typename T>
     T* getOutputData(size_t index) {
-        const auto buffer = m_output[index];
-        const auto bufferSize = buffer.size();
-
-        size_t offset = 0;
-        // TODO: use loop to discover offset. for(buffers-1) offset += buffer.size()
-
-        T* result = new T[bufferSize];
-        m_queue.enqueue_read_buffer(buffer, 0, bufferSize, result);
-
+        const auto output = getOutput<T>(index);
+        T* result = new T[output.size()];
+        std::copy(output.begin(), output.end(), result);
         return result;
     }
 
+    /**
+     * @brief Read output @p index of the last execution back as elements of
+     * type T, e.g. the session's data type. Empty if there is no such
+     * output. Not to be called while executions are running.
+     */
+    template<typename T>
+    std::vector<T> getOutput(size_t index) {
+        if (!m_latest) {
+            return {};
+        }
+        return readOutput<T>(*m_latest, index);
+    }
+
     void setInputSize(const size_t size) {
         m_input.resize(size);
     }
 
+    const std::vector<size_t>& outputSizes() const {
+        return m_outputSizes;
+    }
+
+    /**
+     * @brief State of one execution, reused by later ones: kernel objects
+     * with their arguments, queues, and outputs.
+     */
+    struct Invocation {
+        boost::compute::command_queue queue;
+        boost::compute::command_queue uploadQueue;
+        boost::compute::command_queue downloadQueue;
+        boost::compute::command_queue pipelineQueue;
+        boost::compute::kernel kernel;
+        std::vector<boost::compute::kernel> stageKernels;
+        std::vector<boost::compute::buffer> intermediates;
+        std::vector<boost::compute::buffer> outputs;
+        // Outputs read back during tiled execution.
+        std::vector<std::vector<unsigned char>> outputData;
+        // Kernel launches of the current execution, for deviceTime().
+        std::vector<boost::compute::event> launches;
+    };
+
 private:
+    /**
+     * @brief Number of buffer sets tiles are rotated through: one uploading,
+     * one computing and one reading back.
+     */
+    static const size_t TileBufferSets = 3;
+
+    /**
+     * @brief Number of unused invocations kept for later executions.
+     */
+    static const size_t IdleInvocations = 4;
+
+    static size_t outputSize(const Invocation &invocation, size_t index);
+    static size_t readOutput(Invocation &invocation, size_t index, void *data, size_t bytes);
+
+    template<typename T>
+    static std::vector<T> readOutput(Invocation &invocation, size_t index) {
+        std::vector<T> result(outputSize(invocation, index) / sizeof(T));
+        readOutput(invocation, index, result.data(), result.size() * sizeof(T));
+        return result;
+    }
+
+    struct BufferInfo;
+
+    template<typename T>
+    static StagingBuffer stage(const std::vector<T> &data) {
+        StagingBuffer staging(data.size() * sizeof(T));
+        if (!data.empty()) {
+            memcpy(staging.data(), data.data(), staging.size());
+        }
+        return staging;
+    }
+
+    /**
+     * @brief Replace input @p index, or append it if @p index is the number
+     * of inputs.
+     * @returns false if @p index is past the end of the inputs.
+     */
+    bool setInput(const uint64_t index, BufferInfo info);
+
+    /**
+     * @brief Called when an input was replaced as a whole.
+     */
+    void replaced(BufferInfo &info);
+
+    /**
+     * @brief Record that bytes [begin, end) of an input changed on the host.
+     */
+    static void markDirty(BufferInfo &info, size_t begin, size_t end);
+
+    /**
+     * @brief Start transferring the dirty ranges of an input to the device.
+     */
+    void upload(BufferInfo &info);
+
+    /**
+     * @brief Build @p program and look up @p entry in it. Only replaces the
+     * current program if both succeed.
+     */
+    bool build(boost::compute::program program, const std::string &entry);
+
+    /**
+     * @brief Take an invocation from the pool, or create one.
+     */
+    std::unique_ptr<Invocation> acquire();
+
+    /**
+     * @brief Wait for an execution to finish, make its outputs the latest
+     * ones, and put the previous latest back in the pool.
+     */
+    void finish(std::unique_ptr<Invocation> invocation);
+
+    /**
+     * @brief Start uploading inputs that changed. Returns the last transfer
+     * of each input, which launches have to wait for.
+     */
+    std::vector<boost::compute::event> prepareInputs();
+
+    void executeSingle(Invocation &invocation);
+    bool executeTiled(Invocation &invocation);
+    void executePipeline(Invocation &invocation);
+    boost::compute::buffer& outputBuffer(Invocation &invocation, size_t index);
+
     struct BufferInfo {
+        // Keeps ptr valid if it is mapped. Declared before buffer, which may
+        // wrap it, so that the buffer is released first.
+        std::shared_ptr<void> mapping;
+        // Owns the memory ptr points to, unless it is mapped.
+        StagingBuffer staging;
         boost::compute::buffer buffer;
-        void* ptr;
-        size_t size;
-        size_t typeSize;
+        void* ptr = nullptr;
+        size_t size = 0;
+        size_t typeSize = 0;
+        std::string dataset;
+        size_t datasetOffset = 0;
+        // Byte ranges changed on the host but not yet sent to the device,
+        // sorted and non-overlapping.
+        std::vector<std::pair<size_t, size_t>> dirty;
+        // Last transfer to the device.
+        boost::compute::event upload;
+        // ptr is shared with a client and wrapped by buffer.
+        bool shared = false;
     };
 
     size_t m_work_size;
+    size_t m_tileBudget;
     boost::compute::device m_device;
     boost::compute::context m_context;
     boost::compute::command_queue m_queue;
     boost::compute::program m_program;
-    boost::compute::kernel m_kernel;
+    std::string m_source;
+    std::vector<unsigned char> m_il;
+    std::string m_entry;
+    std::string m_buildLog;
+    std::vector<PipelineStage> m_pipeline;
+    std::vector<size_t> m_intermediateSizes;
+    // Serializes uploads started by concurrent executions. The mutexes are
+    // on the heap so that kernels stay movable.
+    std::unique_ptr<std::mutex> m_inputMutex;
     std::vector<BufferInfo> m_input;
     std::vector<size_t> m_outputSizes;
-    std::vector<boost::compute::buffer> m_output;
+    // Guards the pool and the latest outputs.
+    std::unique_ptr<std::mutex> m_poolMutex;
+    std::vector<std::unique_ptr<Invocation>> m_idle;
+    std::unique_ptr<Invocation> m_latest;
 };
 
 #endif
@@ -0,0 +1,449 @@
+#include "local.h"
+#include "registry.h"
+#include "scheduler.h"
+#include "trace.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <system_error>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sends one message, with `fd` attached unless it is -1.
+static bool sendMessage(int socket, const void *data, size_t size, int fd) {
+    iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = size;
+
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == static_cast<ssize_t>(size);
+}
+
+// Receives one message of exactly `size` bytes. `fd` receives the attached
+// descriptor, or -1.
+static bool receiveMessage(int socket, void *data, size_t size, int &fd) {
+    fd = -1;
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do {
+        received = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        }
+    }
+    if (received != static_cast<ssize_t>(size) || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+static void fail(LocalReply &reply, const std::string &message) {
+    reply.success = 0;
+    snprintf(reply.message, sizeof(reply.message), "%s", message.c_str());
+}
+
+// Maps the first `size` bytes of a client's shared memory until the last
+// user drops the mapping. The memory must be sealed against shrinking, so
+// the client cannot take pages away while the server uses them.
+static std::shared_ptr<void> mapShared(int fd, size_t size, int protection, std::string &error) {
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        error = "Shared memory must be a memfd sealed against shrinking";
+        return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || static_cast<uint64_t>(info.st_size) < size) {
+        error = "Shared memory is smaller than the request";
+        return nullptr;
+    }
+
+    void *data = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        error = std::string("Cannot map shared memory: ") + std::strerror(errno);
+        return nullptr;
+    }
+    return std::shared_ptr<void>(data, [size](void *p) {
+        munmap(p, size);
+    });
+}
+
+// Sessions can only be used once their kernel is built.
+static bool isReady(const KernelItem &item, LocalReply &reply) {
+    switch (item.state) {
+        case KernelState::Pending:
+            fail(reply, "Kernel is still compiling");
+            return false;
+        case KernelState::Failed:
+            fail(reply, "Kernel failed to compile");
+            return false;
+        default:
+            return true;
+    }
+}
+
+LocalTransport::LocalTransport(KernelRegistry &kernels, Scheduler &scheduler)
+    : m_kernels(kernels)
+    , m_scheduler(scheduler)
+{
+}
+
+LocalTransport::~LocalTransport() {
+    stop();
+}
+
+bool LocalTransport::listen(const std::string &path, std::string &error) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        error = "Socket path is too long";
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    // Sequenced packets keep request boundaries, so every request is one
+    // read.
+    const int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        error = std::strerror(errno);
+        return false;
+    }
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+        ::listen(listener, SOMAXCONN) < 0) {
+        error = "Cannot listen on " + path + ": " + std::strerror(errno);
+        close(listener);
+        return false;
+    }
+
+    m_path = path;
+    m_listener = listener;
+    m_stopping = false;
+    m_acceptor = std::thread(&LocalTransport::acceptClients, this);
+    return true;
+}
+
+void LocalTransport::stop() {
+    if (m_listener < 0) {
+        return;
+    }
+    m_stopping = true;
+    if (m_acceptor.joinable()) {
+        m_acceptor.join();
+    }
+    close(m_listener);
+    m_listener = -1;
+    unlink(m_path.c_str());
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (const int client : m_clients) {
+        shutdown(client, SHUT_RDWR);
+    }
+    m_done.wait(lock, [this]() {
+        return m_active == 0;
+    });
+}
+
+void LocalTransport::acceptClients() {
+    while (!m_stopping) {
+        // Wake up now and then to notice stop().
+        pollfd listener = { m_listener, POLLIN, 0 };
+        if (poll(&listener, 1, 200) <= 0) {
+            continue;
+        }
+
+        const int client = accept4(m_listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                std::cerr << "Local: accept failed: " << std::strerror(errno) << "\n";
+            }
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_clients.insert(client);
+        m_active++;
+        std::thread(&LocalTransport::serve, this, client).detach();
+    }
+}
+
+void LocalTransport::serve(int client) {
+    LocalRequest request;
+    int fd;
+    while (receiveMessage(client, &request, sizeof(request), fd)) {
+        request.id[sizeof(request.id) - 1] = '\0';
+        LocalReply reply = {};
+        try {
+            switch (static_cast<LocalOp>(request.op)) {
+                case LocalOp::SetInput:
+                    setInput(request, fd, reply);
+                    break;
+                case LocalOp::Compute:
+                    compute(request, fd, reply);
+                    break;
+                default:
+                    fail(reply, "Unknown operation");
+                    break;
+            }
+        } catch (const std::exception &e) {
+            fail(reply, e.what());
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!sendMessage(client, &reply, sizeof(reply), -1)) {
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_clients.erase(client);
+    close(client);
+    m_active--;
+    m_done.notify_all();
+}
+
+void LocalTransport::setInput(const LocalRequest &request, int fd, LocalReply &reply) {
+    TraceRequest trace("LocalSetInput");
+    auto item = m_kernels.find(request.id);
+    if (item == nullptr) {
+        return fail(reply, "Kernel not found");
+    } else if (fd < 0 || request.size == 0) {
+        return fail(reply, "No shared memory attached");
+    }
+
+    const size_t typeSize = dataTypeSize(item->type);
+    if (typeSize == 0 || request.size % typeSize != 0) {
+        return fail(reply, "Size is not a multiple of the element size");
+    }
+
+    std::string error;
+    auto mapping = mapShared(fd, request.size, PROT_READ, error);
+    if (mapping == nullptr) {
+        return fail(reply, error);
+    }
+
+    const auto lock = tracedLock(item->mtx);
+    if (!isReady(*item, reply)) {
+        return;
+    }
+    // The input replaces whatever was at its index before.
+    const int64_t memory = static_cast<int64_t>(request.size) -
+                           item->kernel->inputBytes(request.index);
+    if (!m_scheduler.chargeMemory(item->tenant, memory, error)) {
+        return fail(reply, error);
+    }
+    if (!item->kernel->addHostInput(request.index, mapping.get(), request.size / typeSize,
+                                   typeSize, mapping)) {
+        std::string ignored;
+        m_scheduler.chargeMemory(item->tenant, -memory, ignored);
+        return fail(reply, "Index is past the end of the inputs");
+    }
+    reply.success = 1;
+}
+
+void LocalTransport::compute(const LocalRequest &request, int fd, LocalReply &reply) {
+    TraceRequest trace("LocalCompute");
+    auto item = m_kernels.find(request.id);
+    if (item == nullptr) {
+        return fail(reply, "Kernel not found");
+    }
+
+    std::string error;
+    std::shared_ptr<void> output;
+    if (fd >= 0 && request.size > 0) {
+        output = mapShared(fd, request.size, PROT_READ | PROT_WRITE, error);
+        if (output == nullptr) {
+            return fail(reply, error);
+        }
+    }
+
+    Scheduler::Ticket ticket;
+    if (!m_scheduler.acquire(item->tenant, Priority::Interactive, ticket, error)) {
+        return fail(reply, error);
+    }
+    // Executions of the same kernel run at once.
+    const auto lock = tracedSharedLock(item->mtx);
+    if (!isReady(*item, reply)) {
+        return;
+    }
+
+    auto execution = item->kernel->launch();
+    ticket.addDeviceTime(execution.deviceTime());
+    reply.size = output ? execution.readOutput(request.index, output.get(), request.size) : 0;
+    reply.success = 1;
+}
+
+SharedMemory::SharedMemory(size_t bytes)
+    : m_size(bytes)
+{
+    m_fd = memfd_create("compute", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (m_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "memfd_create");
+    }
+    // The server only maps memory that cannot shrink under it.
+    if (ftruncate(m_fd, bytes) < 0 || fcntl(m_fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+        const int error = errno;
+        close(m_fd);
+        throw std::system_error(error, std::generic_category(), "memfd");
+    }
+    m_data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (m_data == MAP_FAILED) {
+        const int error = errno;
+        close(m_fd);
+        throw std::system_error(error, std::generic_category(), "mmap");
+    }
+}
+
+SharedMemory::SharedMemory(SharedMemory &&other) noexcept
+    : m_fd(other.m_fd)
+    , m_data(other.m_data)
+    , m_size(other.m_size)
+{
+    other.m_fd = -1;
+    other.m_data = nullptr;
+    other.m_size = 0;
+}
+
+SharedMemory::~SharedMemory() {
+    if (m_data != nullptr) {
+        munmap(m_data, m_size);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+LocalClient::~LocalClient() {
+    if (m_socket >= 0) {
+        close(m_socket);
+    }
+}
+
+bool LocalClient::connect(const std::string &path, std::string &error) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        error = "Socket path is too long";
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    const int client = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (client < 0 ||
+        ::connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        error = "Cannot connect to " + path + ": " + std::strerror(errno);
+        if (client >= 0) {
+            close(client);
+        }
+        return false;
+    }
+    if (m_socket >= 0) {
+        close(m_socket);
+    }
+    m_socket = client;
+    return true;
+}
+
+static bool makeRequest(LocalOp op, const std::string &id, uint32_t index, uint64_t size,
+                        LocalRequest &request, std::string &error) {
+    if (id.size() >= sizeof(request.id)) {
+        error = "Invalid kernel id";
+        return false;
+    }
+    request = {};
+    request.op = static_cast<uint32_t>(op);
+    request.index = index;
+    request.size = size;
+    memcpy(request.id, id.c_str(), id.size() + 1);
+    return true;
+}
+
+bool LocalClient::setInput(const std::string &id, uint32_t index, const SharedMemory &memory,
+                           size_t bytes, std::string &error) {
+    LocalRequest request;
+    LocalReply reply;
+    if (bytes > memory.size()) {
+        error = "Input is larger than the shared memory";
+        return false;
+    }
+    return makeRequest(LocalOp::SetInput, id, index, bytes, request, error) &&
+           call(request, memory.fd(), reply, error);
+}
+
+bool LocalClient::compute(const std::string &id, uint32_t index, SharedMemory *memory,
+                          size_t &bytes, std::string &error) {
+    LocalRequest request;
+    LocalReply reply;
+    bytes = 0;
+    if (!makeRequest(LocalOp::Compute, id, index, memory ? memory->size() : 0, request, error) ||
+        !call(request, memory ? memory->fd() : -1, reply, error)) {
+        return false;
+    }
+    bytes = reply.size;
+    return true;
+}
+
+bool LocalClient::call(LocalRequest &request, int fd, LocalReply &reply, std::string &error) {
+    if (m_socket < 0) {
+        error = "Not connected";
+        return false;
+    }
+    int received = -1;
+    if (!sendMessage(m_socket, &request, sizeof(request), fd) ||
+        !receiveMessage(m_socket, &reply, sizeof(reply), received)) {
+        error = "Connection to the server lost";
+        return false;
+    }
+    if (received >= 0) {
+        close(received);
+    }
+    reply.message[sizeof(reply.message) - 1] = '\0';
+    if (!reply.success) {
+        error = reply.message;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,166 @@
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+class KernelRegistry;
+class Scheduler;
+
+/**
+ * @brief Operations of the local transport.
+ */
+enum class LocalOp : uint32_t {
+    /** Use the attached memory as input `index`, in place. */
+    SetInput = 1,
+    /** Run the kernel, and read output `index` into the attached memory,
+     * if any. */
+    Compute = 2,
+};
+
+/**
+ * @brief Request of the local transport. Sent as one message, with the
+ * file descriptor of the shared memory, if any, attached.
+ */
+struct LocalRequest {
+    uint32_t op;
+    uint32_t index;
+    /** Bytes of shared memory to use, from its start. */
+    uint64_t size;
+    /** Kernel id, NUL-terminated. */
+    char id[72];
+};
+
+struct LocalReply {
+    uint32_t success;
+    /** Compute: bytes of output written to the shared memory. */
+    uint64_t size;
+    char message[240];
+};
+
+/**
+ * @brief Transport for clients on the same host.
+ *
+ * Requests go over a Unix domain socket; data stays in shared memory, e.g.
+ * a memfd, whose file descriptor is passed along with them. Inputs are
+ * used by the kernel in place, and outputs are read back straight into
+ * the client's memory, so nothing is encoded or copied on the way. Uses
+ * the same sessions and scheduler as the HTTP or gRPC server it runs in.
+ */
+class LocalTransport {
+public:
+    LocalTransport(KernelRegistry &kernels, Scheduler &scheduler);
+    LocalTransport(const LocalTransport&) = delete;
+    LocalTransport& operator=(const LocalTransport&) = delete;
+    ~LocalTransport();
+
+    /**
+     * @brief Listen on the Unix domain socket @p path, replacing any
+     * socket file left there, and serve clients on background threads.
+     */
+    bool listen(const std::string &path, std::string &error);
+
+    /**
+     * @brief Disconnect all clients and stop listening.
+     */
+    void stop();
+
+private:
+    void acceptClients();
+    void serve(int client);
+    void setInput(const LocalRequest &request, int fd, LocalReply &reply);
+    void compute(const LocalRequest &request, int fd, LocalReply &reply);
+
+    KernelRegistry &m_kernels;
+    Scheduler &m_scheduler;
+    std::string m_path;
+    int m_listener = -1;
+    std::atomic<bool> m_stopping{false};
+    std::thread m_acceptor;
+    // Connected clients, each served by a detached thread.
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+    std::set<int> m_clients;
+    size_t m_active = 0;
+};
+
+/**
+ * @brief Anonymous shared memory (memfd) that can be passed to the server.
+ */
+class SharedMemory {
+public:
+    /**
+     * @brief Create and map @p bytes of shared memory.
+     * @throws std::system_error if that fails.
+     */
+    explicit SharedMemory(size_t bytes);
+
+    SharedMemory(SharedMemory &&other) noexcept;
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+    ~SharedMemory();
+
+    void* data() {
+        return m_data;
+    }
+
+    template<typename T>
+    T* as() {
+        return static_cast<T*>(m_data);
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    int fd() const {
+        return m_fd;
+    }
+
+private:
+    int m_fd = -1;
+    void* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+/**
+ * @brief Client of the local transport.
+ */
+class LocalClient {
+public:
+    LocalClient() = default;
+    LocalClient(const LocalClient&) = delete;
+    LocalClient& operator=(const LocalClient&) = delete;
+    ~LocalClient();
+
+    bool connect(const std::string &path, std::string &error);
+
+    /**
+     * @brief Use the first @p bytes of @p memory as input @p index of
+     * kernel @p id. The memory must not change while the kernel runs; call
+     * again after changing it.
+     */
+    bool setInput(const std::string &id, uint32_t index, const SharedMemory &memory,
+                  size_t bytes, std::string &error);
+
+    /**
+     * @brief Run kernel @p id and read output @p index into @p memory, if
+     * given.
+     * @param bytes Receives the number of bytes written to @p memory.
+     */
+    bool compute(const std::string &id, uint32_t index, SharedMemory *memory,
+                 size_t &bytes, std::string &error);
+
+private:
+    bool call(LocalRequest &request, int fd, LocalReply &reply, std::string &error);
+
+    int m_socket = -1;
+};
+
+#endif
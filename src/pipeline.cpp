@@ -0,0 +1,58 @@
+#include "pipeline.h"
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+
+static bool parseIndex(const std::string &text, size_t &index) {
+    if (text.empty() || !std::all_of(text.begin(), text.end(), ::isdigit)) {
+        return false;
+    }
+    index = std::strtoull(text.c_str(), nullptr, 10);
+    return true;
+}
+
+bool parsePipelineArg(const std::string &text, const std::vector<std::string> &buffers,
+                      PipelineArg &arg) {
+    const auto separator = text.find(':');
+    if (separator == std::string::npos) {
+        return false;
+    }
+
+    const auto kind = text.substr(0, separator);
+    const auto value = text.substr(separator + 1);
+
+    if (kind == "input") {
+        arg.kind = PipelineArg::Input;
+        return parseIndex(value, arg.index);
+    } else if (kind == "output") {
+        arg.kind = PipelineArg::Output;
+        return parseIndex(value, arg.index);
+    } else if (kind == "buffer") {
+        const auto it = std::find(buffers.begin(), buffers.end(), value);
+        if (it == buffers.end()) {
+            return false;
+        }
+        arg.kind = PipelineArg::Intermediate;
+        arg.index = it - buffers.begin();
+        return true;
+    }
+    return false;
+}
+
+bool validatePipeline(const std::vector<PipelineStage> &stages, size_t inputs, size_t outputs,
+                      size_t intermediates, std::string &error) {
+    for (size_t s = 0; s < stages.size(); s++) {
+        for (size_t a = 0; a < stages[s].args.size(); a++) {
+            const auto &arg = stages[s].args[a];
+            const size_t count = arg.kind == PipelineArg::Input ? inputs
+                               : arg.kind == PipelineArg::Output ? outputs
+                               : intermediates;
+            if (arg.index >= count) {
+                error = "Argument " + std::to_string(a) + " of pipeline stage " +
+                        std::to_string(s) + " refers to an undeclared buffer";
+                return false;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,63 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief A buffer passed to one stage of a pipeline.
+ */
+struct PipelineArg {
+    enum Kind {
+        Input,
+        Output,
+        Intermediate,
+    };
+
+    Kind kind = Input;
+    size_t index = 0;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int) {
+        ar & kind & index;
+    }
+};
+
+/**
+ * @brief One kernel launch in a pipeline.
+ */
+struct PipelineStage {
+    /** Name of the __kernel function to run. */
+    std::string entry;
+    /** Kernel arguments, in order. */
+    std::vector<PipelineArg> args;
+    /** Global work size. 0 uses the size of the largest input. */
+    size_t workSize = 0;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int) {
+        ar & entry & args & workSize;
+    }
+};
+
+/**
+ * @brief Parse a stage argument.
+ *
+ * Arguments are written as "input:<n>", "output:<n>" or "buffer:<name>",
+ * where <name> is one of the intermediate buffers declared for the pipeline.
+ * @param text Argument to parse.
+ * @param buffers Names of the intermediate buffers, in declaration order.
+ * @param arg Receives the parsed argument.
+ */
+bool parsePipelineArg(const std::string &text, const std::vector<std::string> &buffers,
+                      PipelineArg &arg);
+
+/**
+ * @brief Check that every stage argument refers to one of the declared
+ * inputs, outputs and intermediate buffers.
+ * @param error Receives the first argument that doesn't, if any.
+ */
+bool validatePipeline(const std::vector<PipelineStage> &stages, size_t inputs, size_t outputs,
+                      size_t intermediates, std::string &error);
+
+#endif
@@ -0,0 +1,282 @@
+#include "primitives.h"
+#include "registry.h"
+#include "trace.h"
+#include <boost/compute/algorithm/accumulate.hpp>
+#include <boost/compute/algorithm/copy.hpp>
+#include <boost/compute/algorithm/exclusive_scan.hpp>
+#include <boost/compute/algorithm/fill.hpp>
+#include <boost/compute/algorithm/inclusive_scan.hpp>
+#include <boost/compute/algorithm/minmax_element.hpp>
+#include <boost/compute/algorithm/reduce.hpp>
+#include <boost/compute/algorithm/sort.hpp>
+#include <boost/compute/algorithm/sort_by_key.hpp>
+#include <boost/compute/functional.hpp>
+#include <boost/compute/iterator/buffer_iterator.hpp>
+#include <boost/compute/type_traits/type_name.hpp>
+#include <boost/compute/utility/program_cache.hpp>
+#include <type_traits>
+
+namespace compute = boost::compute;
+
+bool parsePrimitive(const std::string &name, Primitive &primitive) {
+    static const std::pair<const char*, Primitive> names[] = {
+        { "sum", Primitive::Sum },
+        { "min", Primitive::Min },
+        { "max", Primitive::Max },
+        { "inclusive_scan", Primitive::InclusiveScan },
+        { "exclusive_scan", Primitive::ExclusiveScan },
+        { "sort", Primitive::Sort },
+        { "sort_by_key", Primitive::SortByKey },
+        { "histogram", Primitive::Histogram },
+    };
+    for (const auto &entry : names) {
+        if (name == entry.first) {
+            primitive = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Adds a value to the integer or real results, depending on its type.
+static void append(PrimitiveResult &result, uint64_t value) {
+    result.integers.push_back(value);
+}
+
+static void append(PrimitiveResult &result, int64_t value) {
+    result.signedIntegers.push_back(value);
+}
+
+static void append(PrimitiveResult &result, double value) {
+    result.reals.push_back(value);
+}
+
+// Integer sums overflow quickly, so they are accumulated in 64 bits on the
+// device; floating point sums in the data's own type.
+template<typename T, bool isFloat = DataTypeTraits<T>::isFloat,
+         bool isSigned = DataTypeTraits<T>::isSigned>
+struct Accumulator;
+
+template<typename T>
+struct Accumulator<T, false, false> {
+    typedef compute::ulong_ type;
+    typedef uint64_t result;
+};
+
+template<typename T>
+struct Accumulator<T, false, true> {
+    typedef compute::long_ type;
+    typedef int64_t result;
+};
+
+template<typename T>
+struct Accumulator<T, true, true> {
+    typedef T type;
+    typedef double result;
+};
+
+static const char HistogramSource[] = BOOST_COMPUTE_STRINGIZE_SOURCE(
+    __kernel void histogram(__global const T *data,
+                            const uint size,
+                            const float lo,
+                            const float scale,
+                            const uint bins,
+                            __global uint *counts)
+    {
+        const uint i = get_global_id(0);
+        if (i >= size) {
+            return;
+        }
+        const float value = (float) data[i];
+        if (value < lo) {
+            return;
+        }
+        const uint bin = (uint) ((value - lo) * scale);
+        if (bin < bins) {
+            atomic_inc(&counts[bin]);
+        } else if (bin == bins && scale > 0) {
+            // The upper bound belongs to the last bin.
+            atomic_inc(&counts[bins - 1]);
+        }
+    }
+);
+
+template<typename T>
+static bool histogram(compute::command_queue &queue, const compute::buffer &buffer, size_t size,
+                      const PrimitiveRequest &request, PrimitiveResult &result, std::string &error) {
+    if (request.bins == 0) {
+        error = "Histogram needs at least one bin";
+        return false;
+    }
+
+    const auto first = compute::make_buffer_iterator<T>(buffer, 0);
+    const auto last = compute::make_buffer_iterator<T>(buffer, size);
+
+    double lo = request.lo;
+    double hi = request.hi;
+    if (!request.hasRange) {
+        const auto range = compute::minmax_element(first, last, queue);
+        lo = static_cast<double>(range.first.read(queue));
+        hi = static_cast<double>(range.second.read(queue));
+    }
+    if (hi < lo) {
+        error = "Invalid histogram range";
+        return false;
+    }
+
+    const auto context = queue.get_context();
+    auto cache = compute::program_cache::get_global_cache(context);
+    const std::string options = std::string("-DT=") + compute::type_name<T>();
+    std::string source = HistogramSource;
+    if (std::is_same<T, double>::value) {
+        source = "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n" + source;
+    }
+    auto program = cache->get_or_build("computestream_histogram", options, source, context);
+
+    compute::buffer counts(context, request.bins * sizeof(compute::uint_));
+    compute::fill(compute::make_buffer_iterator<compute::uint_>(counts, 0),
+                  compute::make_buffer_iterator<compute::uint_>(counts, request.bins),
+                  compute::uint_(0), queue);
+
+    const float scale = hi > lo ? static_cast<float>(request.bins / (hi - lo)) : 0.0f;
+
+    compute::kernel kernel(program, "histogram");
+    kernel.set_arg(0, buffer);
+    kernel.set_arg(1, static_cast<compute::uint_>(size));
+    kernel.set_arg(2, static_cast<compute::float_>(lo));
+    kernel.set_arg(3, scale);
+    kernel.set_arg(4, static_cast<compute::uint_>(request.bins));
+    kernel.set_arg(5, counts);
+    queue.enqueue_1d_range_kernel(kernel, 0, size, 0);
+
+    std::vector<compute::uint_> host(request.bins);
+    queue.enqueue_read_buffer(counts, 0, request.bins * sizeof(compute::uint_), host.data());
+    result.integers.assign(host.begin(), host.end());
+    result.reals = { lo, hi };
+    return true;
+}
+
+// accumulate() only reduces integers in parallel; floating point sums
+// would run in a single work-item, so they go through reduce().
+template<typename T, typename Iterator>
+static typename Accumulator<T>::type sum(Iterator first, Iterator last,
+                                         compute::command_queue &queue, std::false_type) {
+    typedef typename Accumulator<T>::type Sum;
+    return compute::accumulate(first, last, Sum(0), compute::plus<Sum>(), queue);
+}
+
+template<typename T, typename Iterator>
+static T sum(Iterator first, Iterator last, compute::command_queue &queue, std::true_type) {
+    T value = 0;
+    if (first != last) {
+        compute::reduce(first, last, &value, compute::plus<T>(), queue);
+    }
+    return value;
+}
+
+template<typename T>
+static bool run(Kernel &kernel, const PrimitiveRequest &request,
+                PrimitiveResult &result, std::string &error) {
+    const auto buffer = kernel.deviceBuffer(request.target);
+    if (!buffer.get()) {
+        error = "Buffer is not on the device";
+        return false;
+    }
+
+    auto &queue = kernel.queue();
+    const size_t size = buffer.size() / sizeof(T);
+    const auto first = compute::make_buffer_iterator<T>(buffer, 0);
+    const auto last = compute::make_buffer_iterator<T>(buffer, size);
+
+    const bool inPlace = request.primitive == Primitive::InclusiveScan ||
+                         request.primitive == Primitive::ExclusiveScan ||
+                         request.primitive == Primitive::Sort ||
+                         request.primitive == Primitive::SortByKey;
+    if (inPlace && request.target.kind != PipelineArg::Output) {
+        error = "Scans and sorts only work on outputs";
+        return false;
+    }
+
+    switch (request.primitive) {
+        case Primitive::Sum: {
+            const auto total = sum<T>(first, last, queue,
+                                      std::integral_constant<bool, DataTypeTraits<T>::isFloat>());
+            append(result, static_cast<typename Accumulator<T>::result>(total));
+            return true;
+        }
+        case Primitive::Min:
+        case Primitive::Max: {
+            if (size == 0) {
+                error = "Buffer is empty";
+                return false;
+            }
+            T value;
+            if (request.primitive == Primitive::Min) {
+                compute::reduce(first, last, &value, compute::min<T>(), queue);
+            } else {
+                compute::reduce(first, last, &value, compute::max<T>(), queue);
+            }
+            append(result, static_cast<typename Accumulator<T>::result>(value));
+            return true;
+        }
+        case Primitive::InclusiveScan:
+            compute::inclusive_scan(first, last, first, queue);
+            break;
+        case Primitive::ExclusiveScan:
+            compute::exclusive_scan(first, last, first, queue);
+            break;
+        case Primitive::Sort:
+            compute::sort(first, last, queue);
+            break;
+        case Primitive::SortByKey: {
+            const auto values = kernel.deviceBuffer(request.values);
+            if (!values.get() || request.values.kind != PipelineArg::Output ||
+                values.get() == buffer.get() || values.size() / sizeof(T) < size) {
+                error = "Invalid values buffer";
+                return false;
+            }
+            compute::sort_by_key(first, last, compute::make_buffer_iterator<T>(values, 0), queue);
+            break;
+        }
+        case Primitive::Histogram:
+            return histogram<T>(queue, buffer, size, request, result, error);
+    }
+
+    // Scans and sorts stay on the device; only return what was asked for.
+    const size_t count = std::min(request.limit, size);
+    if (count > 0) {
+        std::vector<T> head(count);
+        compute::copy(first, first + count, head.begin(), queue);
+        for (const auto &value : head) {
+            append(result, static_cast<typename Accumulator<T>::result>(value));
+        }
+    }
+    queue.finish();
+    return true;
+}
+
+template<typename T>
+static bool run(TypeTag<T>, Kernel &kernel, const PrimitiveRequest &request,
+                PrimitiveResult &result, std::string &error) {
+    return run<T>(kernel, request, result, error);
+}
+
+static bool run(TypeTag<half_t>, Kernel&, const PrimitiveRequest&, PrimitiveResult&,
+                std::string &error) {
+    // Devices do no arithmetic on half without cl_khr_fp16.
+    error = "Primitives do not support half precision data";
+    return false;
+}
+
+bool runPrimitive(Kernel &kernel, unsigned int type, const PrimitiveRequest &request,
+                  PrimitiveResult &result, std::string &error) {
+    TraceSpan span("primitive");
+    try {
+        return visitDataType(type, [&](auto tag) {
+            return run(tag, kernel, request, result, error);
+        });
+    } catch (const std::exception &e) {
+        error = e.what();
+        return false;
+    }
+}
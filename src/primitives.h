@@ -0,0 +1,74 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "kernel.h"
+#include "pipeline.h"
+
+/**
+ * @brief Built-in data-parallel operations on a session's buffers.
+ */
+enum class Primitive {
+    Sum,
+    Min,
+    Max,
+    InclusiveScan,
+    ExclusiveScan,
+    Sort,
+    SortByKey,
+    Histogram,
+};
+
+/**
+ * @brief Parse a primitive name: "sum", "min", "max", "inclusive_scan",
+ * "exclusive_scan", "sort", "sort_by_key" or "histogram".
+ */
+bool parsePrimitive(const std::string &name, Primitive &primitive);
+
+struct PrimitiveRequest {
+    Primitive primitive = Primitive::Sum;
+    /** Buffer to operate on; the keys for sort_by_key. */
+    PipelineArg target;
+    /** Values for sort_by_key. */
+    PipelineArg values;
+    /** Number of histogram bins. */
+    size_t bins = 0;
+    /** Histogram range. Uses the data's min and max if not set. */
+    bool hasRange = false;
+    double lo = 0;
+    double hi = 0;
+    /** Number of elements of a scan or sort to return. */
+    size_t limit = 0;
+};
+
+/**
+ * @brief Result of a primitive: a reduced value, histogram counts, or the
+ * first elements of a scanned or sorted buffer. Unsigned integer data and
+ * counts are returned in integers, signed integer data in signedIntegers,
+ * floating point data in reals.
+ */
+struct PrimitiveResult {
+    std::vector<uint64_t> integers;
+    std::vector<int64_t> signedIntegers;
+    std::vector<double> reals;
+};
+
+/**
+ * @brief Run a primitive on the device, without copying the buffer to the
+ * host.
+ *
+ * Reductions and histograms work on inputs and outputs. Scans and sorts
+ * work in place, on outputs only, so that the host copy of the inputs
+ * stays authoritative.
+ * @param kernel Session whose buffers to use.
+ * @param type Element type of the session (DataType).
+ * @param request Operation to run.
+ * @param result Receives the result.
+ * @param error Receives a message on failure.
+ */
+bool runPrimitive(Kernel &kernel, unsigned int type, const PrimitiveRequest &request,
+                  PrimitiveResult &result, std::string &error);
+
+#endif
@@ -0,0 +1,423 @@
+#include "recorder.h"
+#include "config.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+
+// Log layout, little endian: the magic and the wall clock time the
+// recording started at (microseconds since the epoch), then records, each
+// prefixed with its size in bytes.
+static const char RecordMagic[8] = { 'C', 'S', 'R', 'E', 'C', '0', '0', '1' };
+
+static const uint64_t RecordFlagSuccess = 1;
+static const uint64_t RecordFlagPartial = 2;
+
+namespace {
+
+class RecordWriter {
+public:
+    explicit RecordWriter(std::string &out)
+        : m_out(out)
+    {
+    }
+
+    void u8(uint8_t value) {
+        m_out.push_back(static_cast<char>(value));
+    }
+
+    void u64(uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            m_out.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    void str(const std::string &value) {
+        u64(value.size());
+        m_out.append(value);
+    }
+
+private:
+    std::string &m_out;
+};
+
+class RecordReader {
+public:
+    RecordReader(const char *data, size_t size)
+        : m_data(data)
+        , m_size(size)
+    {
+    }
+
+    bool u8(uint8_t &value) {
+        if (m_size - m_pos < 1) {
+            return false;
+        }
+        value = static_cast<uint8_t>(m_data[m_pos++]);
+        return true;
+    }
+
+    bool u64(uint64_t &value) {
+        if (m_size - m_pos < 8) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 8; i++) {
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(m_data[m_pos++])) << (8 * i);
+        }
+        return true;
+    }
+
+    bool i64(int64_t &value) {
+        uint64_t bits;
+        if (!u64(bits)) {
+            return false;
+        }
+        value = static_cast<int64_t>(bits);
+        return true;
+    }
+
+    bool str(std::string &value) {
+        uint64_t size;
+        if (!u64(size) || size > m_size - m_pos) {
+            return false;
+        }
+        value.assign(m_data + m_pos, size);
+        m_pos += size;
+        return true;
+    }
+
+    bool done() const {
+        return m_pos == m_size;
+    }
+
+private:
+    const char *m_data;
+    size_t m_size;
+    size_t m_pos = 0;
+};
+
+} // namespace
+
+static void encodeRecord(const RecordedRequest &request, std::string &out) {
+    std::string body;
+    RecordWriter writer(body);
+    writer.u8(static_cast<uint8_t>(request.op));
+    writer.u64((request.success ? RecordFlagSuccess : 0) | (request.partial ? RecordFlagPartial : 0));
+    writer.u64(static_cast<uint64_t>(request.start));
+    writer.u64(static_cast<uint64_t>(request.duration));
+    writer.str(request.id);
+
+    if (request.op == RecordOp::Create) {
+        writer.u64(request.type);
+        writer.u8(static_cast<uint8_t>(request.programKind));
+        writer.u64(request.programHash);
+        writer.str(request.program);
+        writer.str(request.entry);
+        writer.u64(request.tileBudget);
+        writer.u64(request.outputs.size());
+        for (const auto size : request.outputs) {
+            writer.u64(size);
+        }
+    } else {
+        writer.u64(request.index);
+        writer.u64(request.offset);
+        writer.u64(request.bytes);
+        writer.u64(request.hash);
+        writer.str(request.payload);
+    }
+
+    RecordWriter(out).u64(body.size());
+    out.append(body);
+}
+
+static bool decodeRecord(RecordReader &reader, RecordedRequest &request) {
+    uint8_t op;
+    uint64_t flags;
+    if (!reader.u8(op) || !reader.u64(flags) || !reader.i64(request.start) ||
+        !reader.i64(request.duration) || !reader.str(request.id)) {
+        return false;
+    }
+    request.op = static_cast<RecordOp>(op);
+    request.success = (flags & RecordFlagSuccess) != 0;
+    request.partial = (flags & RecordFlagPartial) != 0;
+
+    if (request.op == RecordOp::Create) {
+        uint64_t type;
+        uint8_t kind;
+        uint64_t outputs;
+        if (!reader.u64(type) || !reader.u8(kind) || !reader.u64(request.programHash) ||
+            !reader.str(request.program) || !reader.str(request.entry) ||
+            !reader.u64(request.tileBudget) || !reader.u64(outputs)) {
+            return false;
+        }
+        request.type = static_cast<unsigned int>(type);
+        request.programKind = static_cast<ProgramKind>(kind);
+        for (uint64_t i = 0; i < outputs; i++) {
+            uint64_t size;
+            if (!reader.u64(size)) {
+                return false;
+            }
+            request.outputs.push_back(size);
+        }
+    } else if (request.op == RecordOp::SetInput || request.op == RecordOp::Compute) {
+        if (!reader.u64(request.index) || !reader.u64(request.offset) ||
+            !reader.u64(request.bytes) || !reader.u64(request.hash) ||
+            !reader.str(request.payload)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    return reader.done();
+}
+
+uint64_t recordHash(const void *data, size_t bytes) {
+    // Eight bytes at a time, murmur-style mixing and finalizer.
+    const auto *in = static_cast<const unsigned char*>(data);
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ (bytes * 0xff51afd7ed558ccdull);
+    size_t i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64_t word;
+        memcpy(&word, in + i, sizeof(word));
+        word *= 0x87c37b91114253d5ull;
+        word = (word << 31) | (word >> 33);
+        hash ^= word * 0x4cf5ad432745937full;
+        hash = ((hash << 27) | (hash >> 37)) * 5 + 0x52dce729;
+    }
+    uint64_t tail = 0;
+    for (size_t shift = 0; i < bytes; i++, shift += 8) {
+        tail |= static_cast<uint64_t>(in[i]) << shift;
+    }
+    hash ^= tail * 0x87c37b91114253d5ull;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Recorder& Recorder::instance() {
+    static Recorder recorder;
+    return recorder;
+}
+
+Recorder::Recorder()
+    : m_limit(getConfigUInt("COMPUTE_RECORD_BUFFER", 256 << 20))
+{
+}
+
+Recorder::~Recorder() {
+    close();
+}
+
+bool Recorder::open(const std::string &path, bool payloads, std::string &error) {
+    close();
+
+    m_file.open(path, std::ios::binary | std::ios::trunc);
+    if (!m_file) {
+        error = "Cannot open recording " + path;
+        return false;
+    }
+    const int64_t wallTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::string header(RecordMagic, sizeof(RecordMagic));
+    RecordWriter(header).u64(static_cast<uint64_t>(wallTime));
+    m_file.write(header.data(), header.size());
+
+    m_payloads = payloads;
+    m_origin = traceClock();
+    m_stopping = false;
+    m_writer = std::thread([this]() { writeLoop(); });
+    m_enabled = true;
+    return true;
+}
+
+void Recorder::close() {
+    if (!m_writer.joinable()) {
+        return;
+    }
+    m_enabled = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_ready.notify_one();
+    m_writer.join();
+    m_file.close();
+}
+
+int64_t Recorder::now() const {
+    return traceClock() - m_origin;
+}
+
+void Recorder::write(const RecordedRequest &request) {
+    std::string record;
+    encodeRecord(request, record);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_stopping || m_pending.size() + record.size() > m_limit) {
+        m_dropped++;
+        return;
+    }
+    m_pending.append(record);
+    m_ready.notify_one();
+}
+
+void Recorder::writeLoop() {
+    std::string batch;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_ready.wait(lock, [this]() { return m_stopping || !m_pending.empty(); });
+        if (m_pending.empty() && m_stopping) {
+            return;
+        }
+        batch.clear();
+        std::swap(batch, m_pending);
+
+        lock.unlock();
+        m_file.write(batch.data(), batch.size());
+        m_file.flush();
+        lock.lock();
+    }
+}
+
+bool readRecording(const std::string &path, std::vector<RecordedRequest> &requests,
+                   std::string &error) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        error = "Cannot open " + path;
+        return false;
+    }
+    const std::string contents((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+
+    if (contents.compare(0, sizeof(RecordMagic), RecordMagic, sizeof(RecordMagic)) != 0) {
+        error = path + " is not a recording";
+        return false;
+    }
+    uint64_t wallTime;
+    RecordReader header(contents.data() + sizeof(RecordMagic), contents.size() - sizeof(RecordMagic));
+    if (!header.u64(wallTime)) {
+        error = path + " is truncated";
+        return false;
+    }
+
+    size_t pos = sizeof(RecordMagic) + sizeof(wallTime);
+    while (pos < contents.size()) {
+        uint64_t size;
+        RecordReader prefix(contents.data() + pos, contents.size() - pos);
+        if (!prefix.u64(size) || size > contents.size() - pos - sizeof(size)) {
+            // The server stopped while writing the last record.
+            break;
+        }
+        pos += sizeof(size);
+        RecordReader body(contents.data() + pos, size);
+        RecordedRequest request;
+        if (!decodeRecord(body, request)) {
+            error = "Corrupt record at offset " + std::to_string(pos);
+            return false;
+        }
+        requests.push_back(std::move(request));
+        pos += size;
+    }
+
+    // Records are written as requests end.
+    std::stable_sort(requests.begin(), requests.end(),
+                     [](const RecordedRequest &a, const RecordedRequest &b) {
+                         return a.start < b.start;
+                     });
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Recording::Recording(RecordOp op, const std::string &id)
+    : m_active(Recorder::instance().enabled())
+{
+    if (!m_active) {
+        return;
+    }
+    m_request.op = op;
+    m_request.id = id;
+    m_request.start = Recorder::instance().now();
+}
+
+Recording::~Recording() {
+    if (!m_active) {
+        return;
+    }
+    auto &recorder = Recorder::instance();
+    m_request.duration = recorder.now() - m_request.start;
+    recorder.write(m_request);
+}
+
+void Recording::setId(const std::string &id) {
+    m_request.id = id;
+}
+
+void Recording::setKernel(unsigned int type, const std::string &entry,
+                          const std::vector<size_t> &outputs, uint64_t tileBudget) {
+    if (!m_active) {
+        return;
+    }
+    m_request.type = type;
+    m_request.entry = entry;
+    m_request.outputs.assign(outputs.begin(), outputs.end());
+    m_request.tileBudget = tileBudget;
+}
+
+void Recording::setProgram(const std::string &source, const std::vector<unsigned char> &il,
+                           const std::vector<unsigned char> &binary) {
+    if (!m_active) {
+        return;
+    }
+    if (!binary.empty()) {
+        m_request.programKind = ProgramKind::Binary;
+        m_request.program.assign(binary.begin(), binary.end());
+    } else if (!il.empty()) {
+        m_request.programKind = ProgramKind::IL;
+        m_request.program.assign(il.begin(), il.end());
+    } else {
+        m_request.programKind = ProgramKind::Source;
+        m_request.program = source;
+    }
+    m_request.programHash = recordHash(m_request.program.data(), m_request.program.size());
+}
+
+void Recording::setInput(uint64_t index, bool partial, uint64_t offset, const void *data,
+                         size_t bytes) {
+    if (!m_active) {
+        return;
+    }
+    m_request.index = index;
+    m_request.partial = partial;
+    m_request.offset = offset;
+    m_request.bytes = bytes;
+    m_request.hash = recordHash(data, bytes);
+    if (Recorder::instance().payloads()) {
+        m_request.payload.assign(static_cast<const char*>(data), bytes);
+    }
+}
+
+void Recording::setOutput(uint64_t index, const void *data, size_t bytes) {
+    if (!m_active) {
+        return;
+    }
+    m_request.index = index;
+    m_request.bytes = bytes;
+    m_request.hash = recordHash(data, bytes);
+}
+
+void Recording::succeed() {
+    m_request.success = true;
+}
+
+void Recording::discard() {
+    m_active = false;
+}
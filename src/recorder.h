@@ -0,0 +1,190 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Requests that are recorded.
+ */
+enum class RecordOp : uint8_t {
+    Create = 1,
+    SetInput = 2,
+    Compute = 3,
+};
+
+/**
+ * @brief What the program of a recorded kernel is.
+ */
+enum class ProgramKind : uint8_t {
+    Source = 0,
+    IL = 1,
+    Binary = 2,
+};
+
+/**
+ * @brief One recorded request, protocol independent.
+ */
+struct RecordedRequest {
+    RecordOp op = RecordOp::Create;
+    bool success = false;
+    /** Nanoseconds since the recording started. */
+    int64_t start = 0;
+    int64_t duration = 0;
+    std::string id;
+
+    // Create.
+    unsigned int type = 0;
+    ProgramKind programKind = ProgramKind::Source;
+    std::string program;
+    uint64_t programHash = 0;
+    std::string entry;
+    std::vector<uint64_t> outputs;
+    uint64_t tileBudget = 0;
+
+    // SetInput: the input's elements. Compute: the output that was read.
+    uint64_t index = 0;
+    bool partial = false;
+    /** First element overwritten by a partial update. */
+    uint64_t offset = 0;
+    uint64_t bytes = 0;
+    uint64_t hash = 0;
+    /** SetInput: the elements, packed in the kernel's type, unless only
+     * their hash is recorded. */
+    std::string payload;
+};
+
+/**
+ * @brief 64-bit hash of recorded programs, inputs and outputs.
+ */
+uint64_t recordHash(const void *data, size_t bytes);
+
+/**
+ * @brief Writes requests to a binary log, for compute_replay.
+ *
+ * The servers record to the file named by COMPUTE_RECORD, if set. Input
+ * data is recorded in full, or only hashed if COMPUTE_RECORD_INPUTS=hash.
+ * Records are encoded on the request's thread and written by a background
+ * thread; if more than COMPUTE_RECORD_BUFFER bytes (256 MiB by default) are
+ * waiting to be written, records are dropped rather than slowing requests
+ * down.
+ */
+class Recorder {
+public:
+    static Recorder& instance();
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+    ~Recorder();
+
+    /**
+     * @brief Start recording to @p path, replacing the file.
+     * @param payloads Record input data, not just its hash.
+     */
+    bool open(const std::string &path, bool payloads, std::string &error);
+
+    /**
+     * @brief Write what is buffered and stop recording.
+     */
+    void close();
+
+    bool enabled() const {
+        return m_enabled;
+    }
+
+    bool payloads() const {
+        return m_payloads;
+    }
+
+    /**
+     * @brief Time since the recording started, in nanoseconds.
+     */
+    int64_t now() const;
+
+    void write(const RecordedRequest &request);
+
+    /**
+     * @brief Records dropped because the writer fell behind.
+     */
+    uint64_t dropped() const {
+        return m_dropped;
+    }
+
+private:
+    Recorder();
+    void writeLoop();
+
+    std::atomic<bool> m_enabled{false};
+    bool m_payloads = true;
+    int64_t m_origin = 0;
+    size_t m_limit;
+    std::atomic<uint64_t> m_dropped{0};
+    std::ofstream m_file;
+    std::thread m_writer;
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::string m_pending;
+    bool m_stopping = false;
+};
+
+/**
+ * @brief Read a log written by the Recorder.
+ * @param requests Receives the requests in the order they started.
+ */
+bool readRecording(const std::string &path, std::vector<RecordedRequest> &requests,
+                   std::string &error);
+
+/**
+ * @brief Records one request, from construction to destruction, if the
+ * recorder is on. Does nothing otherwise.
+ *
+ * Requests are recorded as failed unless succeed() is called.
+ */
+class Recording {
+public:
+    Recording(RecordOp op, const std::string &id);
+    ~Recording();
+
+    Recording(const Recording&) = delete;
+    Recording& operator=(const Recording&) = delete;
+
+    bool active() const {
+        return m_active;
+    }
+
+    void setId(const std::string &id);
+
+    void setKernel(unsigned int type, const std::string &entry,
+                   const std::vector<size_t> &outputs, uint64_t tileBudget);
+
+    /**
+     * @brief Record the kernel's program, whichever of @p source, @p il or
+     * @p binary is given.
+     */
+    void setProgram(const std::string &source, const std::vector<unsigned char> &il,
+                    const std::vector<unsigned char> &binary);
+
+    void setInput(uint64_t index, bool partial, uint64_t offset, const void *data, size_t bytes);
+
+    void setOutput(uint64_t index, const void *data, size_t bytes);
+
+    void succeed();
+
+    /**
+     * @brief Don't record the request, e.g. because it can't be replayed.
+     */
+    void discard();
+
+private:
+    bool m_active;
+    RecordedRequest m_request;
+};
+
+#endif
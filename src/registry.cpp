@@ -0,0 +1,242 @@
+#include "registry.h"
+#include "config.h"
+#include "snapshot.h"
+#include "trace.h"
+#include <algorithm>
+#include <boost/asio/post.hpp>
+
+const char* kernelStateName(KernelState state) {
+    switch (state) {
+        case KernelState::Pending: return "pending";
+        case KernelState::Ready: return "ready";
+        case KernelState::Failed: return "failed";
+    }
+    return "unknown";
+}
+
+KernelRegistry::KernelRegistry()
+    : m_builds(std::max<size_t>(getConfigUInt("COMPUTE_BUILD_THREADS", 2), 1))
+{
+}
+
+std::shared_ptr<KernelItem> KernelRegistry::find(const std::string &id) {
+    TraceSpan span("lookup");
+    // It is possible that the item is being removed while another
+    // thread tries to look it up. The mutex here prevents that from
+    // happening.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_kernels.find(id);
+    if (it == m_kernels.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+bool KernelRegistry::add(const std::string &id, std::shared_ptr<KernelItem> item) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_kernels.emplace(id, std::move(item)).second;
+}
+
+bool KernelRegistry::addPending(const std::string &id, std::shared_ptr<KernelItem> item,
+                                std::function<bool(Kernel&, std::string&)> build) {
+    item->state = KernelState::Pending;
+    item->device = m_devices.place(item->tenant);
+    const auto device = m_devices.device(item->device);
+    if (!add(id, item)) {
+        m_devices.release(item->device);
+        return false;
+    }
+
+    const uint64_t trace = currentTrace();
+    boost::asio::post(m_builds, [this, item, build, trace, device]() {
+        TraceScope scope(trace);
+
+        // Compiled without holding the session's lock, so that requests for
+        // its state aren't held up by the compiler.
+        std::unique_ptr<Kernel> kernel(new Kernel(device));
+        std::string error;
+        bool built = false;
+        try {
+            TraceSpan span("compile");
+            built = build(*kernel, error);
+        } catch (const std::exception &e) {
+            error = e.what();
+        }
+
+        std::lock_guard<std::shared_timed_mutex> lock(item->mtx);
+        if (item->state != KernelState::Pending) {
+            // Removed while it was building.
+            return;
+        }
+        item->buildLog = kernel->buildLog();
+        if (!error.empty()) {
+            item->buildLog = error + "\n" + item->buildLog;
+        }
+        if (built) {
+            item->kernel = std::move(kernel);
+            item->state = KernelState::Ready;
+        } else {
+            // Failed sessions never run, so they don't occupy the device.
+            item->state = KernelState::Failed;
+            m_devices.release(item->device);
+        }
+    });
+    return true;
+}
+
+std::shared_ptr<KernelItem> KernelRegistry::remove(const std::string &id) {
+    std::shared_ptr<KernelItem> item;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_kernels.find(id);
+        if (it == m_kernels.end()) {
+            return nullptr;
+        }
+        item = std::move(it->second);
+        m_kernels.erase(it);
+    }
+
+    // Sessions that failed to build already released their place. Marking
+    // the session failed keeps a build still running from releasing it again.
+    std::lock_guard<std::shared_timed_mutex> lock(item->mtx);
+    if (item->state != KernelState::Failed) {
+        m_devices.release(item->device);
+        item->state = KernelState::Failed;
+    }
+    return item;
+}
+
+std::vector<std::string> KernelRegistry::ids() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::string> result;
+    result.reserve(m_kernels.size());
+    for (const auto &entry : m_kernels) {
+        result.push_back(entry.first);
+    }
+    return result;
+}
+
+bool KernelRegistry::saveSnapshot(const std::string &path) {
+    SnapshotWriter writer(path);
+
+    for (const auto &id : ids()) {
+        auto itemPtr = find(id);
+        if (itemPtr == nullptr) {
+            continue;
+        }
+
+        auto& item = *itemPtr;
+        std::shared_lock<std::shared_timed_mutex> lock(item.mtx);
+        if (item.state != KernelState::Ready) {
+            continue;
+        }
+
+        SnapshotSession session;
+        session.id = id;
+        session.type = item.type;
+        session.tenant = item.tenant;
+        session.source = item.kernel->source();
+        session.binary = item.kernel->binary();
+        session.il = item.kernel->il();
+        const auto &outputs = item.kernel->outputSizes();
+        session.outputs.assign(outputs.begin(), outputs.end());
+        session.tileBudget = item.kernel->tileBudget();
+        session.entry = item.kernel->entry();
+        session.pipeline = item.kernel->pipeline();
+        const auto &intermediates = item.kernel->intermediateSizes();
+        session.intermediates.assign(intermediates.begin(), intermediates.end());
+
+        writer.add(std::move(session), item.kernel->inputs());
+    }
+
+    return writer.commit();
+}
+
+size_t KernelRegistry::restoreSnapshot(const std::string &path, DatasetRegistry &datasets,
+                                       Scheduler &scheduler) {
+    SnapshotReader reader;
+    if (!reader.open(path)) {
+        return 0;
+    }
+
+    size_t restored = 0;
+    for (const auto &session : reader.sessions()) {
+        auto item = std::make_shared<KernelItem>();
+        item->type = session.type;
+        item->tenant = session.tenant;
+        item->device = m_devices.place(item->tenant);
+        item->kernel.reset(new Kernel(m_devices.device(item->device)));
+
+        if (!item->kernel->compileBinary(session.binary, session.source, session.entry,
+                                        session.il)) {
+            std::cerr << "Snapshot: failed to restore kernel " << session.id << "\n";
+            m_devices.release(item->device);
+            continue;
+        }
+        item->kernel->addOutputParams({ session.outputs.begin(), session.outputs.end() });
+        item->kernel->setTileBudget(session.tileBudget);
+        if (!session.pipeline.empty() &&
+            !item->kernel->setPipeline(session.pipeline, { session.intermediates.begin(),
+                                                          session.intermediates.end() })) {
+            std::cerr << "Snapshot: failed to restore pipeline of kernel " << session.id << "\n";
+            m_devices.release(item->device);
+            continue;
+        }
+
+        for (size_t i = 0; i < session.inputs.size(); i++) {
+            const auto &input = session.inputs[i];
+            if (!input.dataset.empty()) {
+                auto dataset = datasets.find(input.dataset);
+                const uint64_t length = input.size * input.typeSize;
+                if (dataset == nullptr || input.offset > dataset->size() ||
+                    length > dataset->size() - input.offset) {
+                    std::cerr << "Snapshot: dataset " << input.dataset
+                              << " of kernel " << session.id << " is missing\n";
+                    continue;
+                }
+                boost::compute::buffer buffer;
+                std::string error;
+                if (!dataset->buffer(item->kernel->context(), input.offset, length, buffer, error)) {
+                    std::cerr << "Snapshot: dataset " << input.dataset << " of kernel "
+                              << session.id << ": " << error << "\n";
+                    continue;
+                }
+                if (!item->kernel->addBufferInput(i, buffer, input.size, input.typeSize,
+                                                 input.dataset, input.offset)) {
+                    std::cerr << "Snapshot: input " << i << " of kernel " << session.id
+                              << " follows a missing input\n";
+                }
+                continue;
+            }
+
+            void* ptr = reader.data(input.offset);
+            if (ptr == nullptr) {
+                continue;
+            }
+            if (!item->kernel->addMappedInputData(i, ptr, input.size, input.typeSize,
+                                                 reader.mapping())) {
+                std::cerr << "Snapshot: input " << i << " of kernel " << session.id
+                          << " follows a missing input\n";
+            }
+        }
+
+        const int64_t memory = item->kernel->memory();
+        std::string error;
+        if (!scheduler.chargeMemory(item->tenant, memory, error)) {
+            std::cerr << "Snapshot: kernel " << session.id << ": " << error << "\n";
+            m_devices.release(item->device);
+            continue;
+        }
+
+        const size_t device = item->device;
+        const auto tenant = item->tenant;
+        if (add(session.id, std::move(item))) {
+            restored++;
+        } else {
+            scheduler.chargeMemory(tenant, -memory, error);
+            m_devices.release(device);
+        }
+    }
+
+    return restored;
+}
@@ -0,0 +1,131 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <boost/asio/thread_pool.hpp>
+#include "dataset.h"
+#include "devices.h"
+#include "dtype.h"
+#include "kernel.h"
+#include "scheduler.h"
+
+/**
+ * @brief Build state of a session's kernel.
+ */
+enum class KernelState {
+    Pending,
+    Ready,
+    Failed,
+};
+
+const char* kernelStateName(KernelState state);
+
+struct KernelItem
+{
+    unsigned int type;
+    std::string tenant;
+    KernelState state = KernelState::Ready;
+    /** Compiler output, once the build finished. */
+    std::string buildLog;
+    /** Index of the device in the registry's DevicePool. */
+    size_t device = 0;
+    /** Created on the session's device once it is placed; set once the
+     * session is Ready. */
+    std::unique_ptr<Kernel> kernel;
+    /** Held shared by executions, which may run at once, and exclusively
+     * by everything that changes the session. */
+    std::shared_timed_mutex mtx;
+};
+
+/**
+ * @brief Thread-safe map of kernel sessions, shared by the HTTP and gRPC
+ * servers.
+ */
+class KernelRegistry {
+public:
+    /**
+     * @brief Builds kernels on COMPUTE_BUILD_THREADS background threads.
+     */
+    KernelRegistry();
+
+    /**
+     * @brief Look up a session.
+     * @returns the session, or nullptr if @p id is unknown.
+     */
+    std::shared_ptr<KernelItem> find(const std::string &id);
+
+    /**
+     * @brief Register a new session.
+     * @returns false if @p id is already in use.
+     */
+    bool add(const std::string &id, std::shared_ptr<KernelItem> item);
+
+    /**
+     * @brief Register a new session whose kernel is built in the background.
+     *
+     * The session is placed on one of devices(), and is Pending until
+     * @p build, run on a build thread with a fresh kernel on that device,
+     * returns. Its kernel is then replaced by the built one and
+     * it becomes Ready, or Failed, with the build log.
+     * @param build Compiles the kernel. May set its second argument to an
+     * error to report in addition to the compiler output.
+     * @returns false if @p id is already in use. The session is then not
+     * built.
+     */
+    bool addPending(const std::string &id, std::shared_ptr<KernelItem> item,
+                    std::function<bool(Kernel&, std::string&)> build);
+
+    /**
+     * @brief Unregister a session and release its place on its device.
+     * Executions still holding the session finish normally.
+     * @returns the removed session, or nullptr if @p id is unknown.
+     */
+    std::shared_ptr<KernelItem> remove(const std::string &id);
+
+    /**
+     * @brief Devices that sessions are placed on.
+     */
+    DevicePool& devices() {
+        return m_devices;
+    }
+
+    /**
+     * @brief Ids of all registered sessions.
+     */
+    std::vector<std::string> ids();
+
+    /**
+     * @brief Write every session to a snapshot file. Sessions that are not
+     * built yet, or failed to build, are left out.
+     * @param path Snapshot file. It is replaced atomically.
+     */
+    bool saveSnapshot(const std::string &path);
+
+    /**
+     * @brief Restore the sessions stored in a snapshot file.
+     *
+     * Input data is not read: the kernels reference the memory-mapped file
+     * directly, and pages are faulted in the first time they are executed.
+     * @param path Snapshot file written by saveSnapshot().
+     * @param datasets Datasets that restored inputs may be bound to.
+     * @param scheduler Charged for the memory of the restored sessions.
+     * Sessions over their tenant's limit are left out.
+     * @returns the number of sessions restored.
+     */
+    size_t restoreSnapshot(const std::string &path, DatasetRegistry &datasets,
+                           Scheduler &scheduler);
+
+private:
+    std::map<std::string, std::shared_ptr<KernelItem>> m_kernels;
+    std::mutex m_mutex;
+    DevicePool m_devices;
+    boost::asio::thread_pool m_builds;
+};
+
+#endif
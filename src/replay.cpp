@@ -0,0 +1,557 @@
+/*
+Replays requests recorded with COMPUTE_RECORD against a local server.
+
+  compute_replay --log=requests.rec --grpc=localhost:50051 --speed=1
+  compute_replay --log=requests.rec --http=http://127.0.0.1:8848 --speed=4
+
+Requests are sent at the times they were recorded, divided by --speed (0
+sends them as fast as possible). Requests of a session are sent in order,
+each session from its own thread, and sessions are created afresh. Prints
+the recorded and replayed latencies of each kind of request, and compares
+outputs with the recorded ones where the inputs were recorded in full. Exits
+with 1 if a request fails, an output differs or the replayed p99 exceeds the
+recorded one by more than --max-p99-ratio.
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <drogon/drogon.h>
+#include <grpcpp/grpcpp.h>
+
+#include "compute_kernel.grpc.pb.h"
+#include "recorder.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Settings {
+  std::string log;
+  std::string grpc;
+  std::string http;
+  double speed = 1;
+  double maxP99Ratio = 0;
+};
+
+static bool parseOptions(int argc, char **argv, Settings &options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const auto equals = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || equals == std::string::npos) {
+      std::cerr << "Unrecognized argument " << arg << std::endl;
+      return false;
+    }
+    const auto name = arg.substr(2, equals - 2);
+    const auto value = arg.substr(equals + 1);
+    try {
+      if (name == "log") {
+        options.log = value;
+      } else if (name == "grpc") {
+        options.grpc = value;
+      } else if (name == "http") {
+        options.http = value;
+      } else if (name == "speed") {
+        options.speed = std::max(std::stod(value), 0.0);
+      } else if (name == "max-p99-ratio") {
+        options.maxP99Ratio = std::stod(value);
+      } else {
+        std::cerr << "Unrecognized option " << name << std::endl;
+        return false;
+      }
+    } catch (const std::logic_error&) {
+      std::cerr << "Invalid value for " << name << std::endl;
+      return false;
+    }
+  }
+  if (options.log.empty() || options.grpc.empty() == options.http.empty()) {
+    std::cerr << "Usage: compute_replay --log=<file> (--grpc=<host:port> | --http=<url>)"
+              << " [--speed=<n>] [--max-p99-ratio=<n>]" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// A server to replay requests against.
+class Target {
+public:
+  virtual ~Target() = default;
+
+  virtual bool create(const RecordedRequest &request, std::string &id, std::string &error) = 0;
+
+  // Sets `done` once the kernel is built; fails if the build failed.
+  virtual bool ready(const std::string &id, bool &done, std::string &error) = 0;
+
+  virtual bool setInput(const std::string &id, const RecordedRequest &request,
+                        const std::string &payload, std::string &error) = 0;
+
+  // Whether compute() can return output `index`.
+  virtual bool returnsOutput(uint64_t index) const = 0;
+
+  // Runs the kernel and returns output `index` packed, if asked to.
+  virtual bool compute(const std::string &id, uint64_t index, std::string *output,
+                       std::string &error) = 0;
+};
+
+class GrpcTarget : public Target {
+public:
+  explicit GrpcTarget(const std::string &address)
+      : m_stub(compute::Compute::NewStub(
+            grpc::CreateChannel(address, grpc::InsecureChannelCredentials()))) {}
+
+  bool create(const RecordedRequest &recorded, std::string &id, std::string &error) override {
+    compute::ComputeKernel request;
+    compute::ComputeKernelID reply;
+    grpc::ClientContext context;
+    request.set_type(static_cast<compute::DataType>(recorded.type));
+    request.set_entry(recorded.entry);
+    request.set_tile_budget(recorded.tileBudget);
+    for (const auto size : recorded.outputs) {
+      request.add_outputs(size);
+    }
+    switch (recorded.programKind) {
+      case ProgramKind::IL:
+        request.set_il(recorded.program);
+        break;
+      case ProgramKind::Binary:
+        request.set_binary(recorded.program);
+        break;
+      default:
+        request.set_source(recorded.program);
+        break;
+    }
+    const auto status = m_stub->CreateKernel(&context, request, &reply);
+    id = reply.uuid();
+    return check(status, error);
+  }
+
+  bool ready(const std::string &id, bool &done, std::string &error) override {
+    compute::ComputeKernelID request;
+    compute::ComputeKernelInfo reply;
+    grpc::ClientContext context;
+    request.set_uuid(id);
+    if (!check(m_stub->KernelInfo(&context, request, &reply), error)) {
+      return false;
+    } else if (reply.state() == compute::FAILED) {
+      error = "Build failed: " + reply.build_log();
+      return false;
+    }
+    done = reply.state() == compute::READY;
+    return true;
+  }
+
+  bool setInput(const std::string &id, const RecordedRequest &recorded,
+                const std::string &payload, std::string &error) override {
+    compute::ComputeInputData request;
+    compute::ComputeStatus reply;
+    grpc::ClientContext context;
+    request.set_uuid(id);
+    request.set_index(recorded.index);
+    request.set_partial(recorded.partial);
+    request.set_offset(recorded.offset);
+    request.set_raw(payload);
+    return check(m_stub->SetInputData(&context, request, &reply), error);
+  }
+
+  // Compute returns output 0 only.
+  bool returnsOutput(uint64_t index) const override {
+    return index == 0;
+  }
+
+  bool compute(const std::string &id, uint64_t, std::string *output,
+               std::string &error) override {
+    compute::ComputeKernelID request;
+    compute::ComputeStatus reply;
+    grpc::ClientContext context;
+    request.set_uuid(id);
+    if (!check(m_stub->Compute(&context, request, &reply), error)) {
+      return false;
+    }
+    if (output != nullptr) {
+      *output = reply.output();
+    }
+    return true;
+  }
+
+private:
+  static bool check(const grpc::Status &status, std::string &error) {
+    if (!status.ok()) {
+      error = status.error_message();
+    }
+    return status.ok();
+  }
+
+  std::unique_ptr<compute::Compute::Stub> m_stub;
+};
+
+class HttpTarget : public Target {
+public:
+  HttpTarget(const std::string &url, trantor::EventLoop *loop)
+      : m_client(drogon::HttpClient::newHttpClient(url, loop)) {}
+
+  bool create(const RecordedRequest &recorded, std::string &id, std::string &error) override {
+    Json::Value json;
+    json["type"] = recorded.type;
+    json["entry"] = recorded.entry;
+    json["tile_budget"] = static_cast<Json::UInt64>(recorded.tileBudget);
+    json["outputs"] = Json::Value(Json::arrayValue);
+    for (const auto size : recorded.outputs) {
+      json["outputs"].append(static_cast<Json::UInt64>(size));
+    }
+    switch (recorded.programKind) {
+      case ProgramKind::IL:
+        json["il"] = base64(recorded.program);
+        break;
+      case ProgramKind::Binary:
+        json["binary"] = base64(recorded.program);
+        break;
+      default:
+        json["source"] = recorded.program;
+        break;
+    }
+    auto req = drogon::HttpRequest::newHttpJsonRequest(json);
+    req->setPath("/create");
+    req->setMethod(drogon::Post);
+    Json::Value reply;
+    if (!send(req, reply, error)) {
+      return false;
+    }
+    id = reply["uuid"].asString();
+    return true;
+  }
+
+  bool ready(const std::string &id, bool &done, std::string &error) override {
+    auto req = drogon::HttpRequest::newHttpRequest();
+    req->setPath("/" + id);
+    req->setMethod(drogon::Get);
+    Json::Value reply;
+    if (!send(req, reply, error)) {
+      return false;
+    }
+    const auto state = reply["state"].asString();
+    if (state == "failed") {
+      error = "Build failed: " + reply["build_log"].asString();
+      return false;
+    }
+    done = state == "ready";
+    return true;
+  }
+
+  bool setInput(const std::string &id, const RecordedRequest &recorded,
+                const std::string &payload, std::string &error) override {
+    Json::Value json;
+    json["update"] = "input";
+    json["index"] = static_cast<Json::UInt64>(recorded.index);
+    if (recorded.partial) {
+      json["offset"] = static_cast<Json::UInt64>(recorded.offset);
+    }
+    json["encoding"] = "plain";
+    json["data"] = base64(payload);
+    auto req = drogon::HttpRequest::newHttpJsonRequest(json);
+    req->setPath("/update/" + id);
+    req->setMethod(drogon::Put);
+    Json::Value reply;
+    return send(req, reply, error);
+  }
+
+  bool returnsOutput(uint64_t) const override {
+    return true;
+  }
+
+  bool compute(const std::string &id, uint64_t index, std::string *output,
+               std::string &error) override {
+    auto req = drogon::HttpRequest::newHttpRequest();
+    req->setPath("/compute/" + id);
+    req->setMethod(drogon::Get);
+    if (output != nullptr) {
+      req->setParameter("output", std::to_string(index));
+      req->setParameter("encoding", "plain");
+    }
+    Json::Value reply;
+    if (!send(req, reply, error)) {
+      return false;
+    }
+    if (output != nullptr) {
+      *output = drogon::utils::base64Decode(reply["output"].asString());
+    }
+    return true;
+  }
+
+private:
+  static std::string base64(const std::string &data) {
+    return drogon::utils::base64Encode(reinterpret_cast<const unsigned char*>(data.data()),
+                                       data.size());
+  }
+
+  bool send(const drogon::HttpRequestPtr &req, Json::Value &reply, std::string &error) {
+    std::mutex mutex;
+    std::condition_variable done;
+    bool finished = false;
+    m_client->sendRequest(req, [&](drogon::ReqResult result, const drogon::HttpResponsePtr &resp) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (result != drogon::ReqResult::Ok) {
+        error = "Request failed";
+      } else if (resp->getJsonObject() == nullptr) {
+        error = "Invalid response";
+      } else {
+        reply = *resp->getJsonObject();
+        if (resp->getStatusCode() >= 300) {
+          error = reply["data"].asString();
+        }
+      }
+      finished = true;
+      done.notify_all();
+    }, 60);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return finished; });
+    return error.empty();
+  }
+
+  drogon::HttpClientPtr m_client;
+};
+
+static const char* OpNames[] = { "", "create", "input", "compute" };
+
+struct Stats {
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+  std::vector<double> recorded; // Milliseconds
+  std::vector<double> replayed;
+};
+
+static double percentile(std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+  return sorted[index];
+}
+
+class Replayer {
+public:
+  Replayer(const Settings &options, Target &target) : m_options(options), m_target(target) {}
+
+  // Replays `requests`, which are in the order they started.
+  void run(const std::vector<RecordedRequest> &requests) {
+    std::map<std::string, std::vector<const RecordedRequest*>> sessions;
+    for (const auto &request : requests) {
+      if (!request.success) {
+        // Failed requests are kept for reference, not replayed.
+        m_failedRecorded++;
+      } else if (request.op == RecordOp::Create) {
+        sessions[request.id].push_back(&request);
+      } else if (sessions.count(request.id) == 0) {
+        // Its session was created before the recording started.
+        m_skipped++;
+      } else {
+        sessions[request.id].push_back(&request);
+      }
+    }
+
+    m_start = Clock::now();
+    std::vector<std::thread> threads;
+    for (const auto &session : sessions) {
+      threads.emplace_back([this, &session]() { replaySession(session.second); });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    m_elapsed = std::chrono::duration<double>(Clock::now() - m_start).count();
+  }
+
+  // Prints the results; returns whether the replay passed.
+  bool report() {
+    std::cout << "Replayed in " << m_elapsed << "s, " << m_skipped << " requests skipped, "
+              << m_failedRecorded << " recorded failures not replayed" << std::endl;
+
+    bool passed = true;
+    for (auto &entry : m_stats) {
+      auto &stats = entry.second;
+      std::sort(stats.recorded.begin(), stats.recorded.end());
+      std::sort(stats.replayed.begin(), stats.replayed.end());
+      const double recordedP99 = percentile(stats.recorded, 0.99);
+      const double replayedP99 = percentile(stats.replayed, 0.99);
+      char line[256];
+      std::snprintf(line, sizeof(line),
+                    "%-8s %7llu req  errors %5llu  p50 %8.2f -> %8.2f  p99 %8.2f -> %8.2f ms",
+                    OpNames[entry.first], static_cast<unsigned long long>(stats.requests),
+                    static_cast<unsigned long long>(stats.errors),
+                    percentile(stats.recorded, 0.5), percentile(stats.replayed, 0.5),
+                    recordedP99, replayedP99);
+      std::cout << line << std::endl;
+
+      if (stats.errors > 0) {
+        passed = false;
+      }
+      if (m_options.maxP99Ratio > 0 && recordedP99 > 0 &&
+          replayedP99 > recordedP99 * m_options.maxP99Ratio) {
+        std::cout << "FAIL: " << OpNames[entry.first] << " p99 " << replayedP99 << " ms > "
+                  << m_options.maxP99Ratio << " x " << recordedP99 << " ms" << std::endl;
+        passed = false;
+      }
+    }
+
+    std::cout << "Outputs: " << m_matches << " match, " << m_mismatches << " differ, "
+              << m_unchecked << " not compared" << std::endl;
+    for (const auto &error : m_errors) {
+      std::cout << error << std::endl;
+    }
+    return passed && m_mismatches == 0;
+  }
+
+private:
+  void replaySession(const std::vector<const RecordedRequest*> &requests) {
+    std::string id;
+    // Outputs can only be compared if every input was recorded in full.
+    bool comparable = true;
+
+    for (const auto *request : requests) {
+      if (m_options.speed > 0) {
+        const auto due = std::chrono::duration<double>(request->start / 1e9 / m_options.speed);
+        std::this_thread::sleep_until(m_start + std::chrono::duration_cast<Clock::duration>(due));
+      }
+
+      std::string error;
+      std::string payload;
+      std::string output;
+      bool ok = false;
+      bool compare = false;
+      const auto sent = Clock::now();
+      switch (request->op) {
+        case RecordOp::Create:
+          ok = m_target.create(*request, id, error);
+          break;
+        case RecordOp::SetInput:
+          payload = request->payload;
+          if (payload.size() != request->bytes) {
+            payload = synthesize(*request);
+            comparable = false;
+          }
+          ok = m_target.setInput(id, *request, payload, error);
+          break;
+        case RecordOp::Compute:
+          compare = comparable && m_target.returnsOutput(request->index);
+          ok = m_target.compute(id, request->index, compare ? &output : nullptr, error);
+          break;
+      }
+      const double latency = std::chrono::duration<double, std::milli>(Clock::now() - sent).count();
+
+      record(*request, latency, ok, error, compare, output);
+      if (request->op == RecordOp::Create && (!ok || !waitUntilReady(id))) {
+        // Nothing else in the session can succeed.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_skipped += requests.size() - 1;
+        return;
+      }
+    }
+  }
+
+  // Kernels build in the background; the recorded client waited for that
+  // too before using the session.
+  bool waitUntilReady(const std::string &id) {
+    for (;;) {
+      bool done = false;
+      std::string error;
+      if (!m_target.ready(id, done, error)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_errors.push_back(id + ": " + error);
+        return false;
+      } else if (done) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  // Stands in for input data of which only the hash was recorded.
+  static std::string synthesize(const RecordedRequest &request) {
+    std::string data(request.bytes, '\0');
+    std::mt19937_64 random(request.hash);
+    for (auto &byte : data) {
+      byte = static_cast<char>(random() & 0x7f);
+    }
+    return data;
+  }
+
+  void record(const RecordedRequest &request, double latency, bool ok, const std::string &error,
+              bool compare, const std::string &output) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto &stats = m_stats[static_cast<int>(request.op)];
+    stats.requests++;
+    stats.recorded.push_back(request.duration / 1e6);
+    stats.replayed.push_back(latency);
+    if (!ok) {
+      stats.errors++;
+      if (m_errors.size() < 20) {
+        m_errors.push_back(std::string(OpNames[static_cast<int>(request.op)]) + " " +
+                           request.id + ": " + error);
+      }
+      return;
+    }
+
+    if (request.op != RecordOp::Compute) {
+      return;
+    } else if (!compare) {
+      m_unchecked++;
+    } else if (output.size() == request.bytes &&
+               recordHash(output.data(), output.size()) == request.hash) {
+      m_matches++;
+    } else {
+      m_mismatches++;
+    }
+  }
+
+  const Settings &m_options;
+  Target &m_target;
+  Clock::time_point m_start;
+  double m_elapsed = 0;
+  std::mutex m_mutex;
+  std::map<int, Stats> m_stats;
+  std::vector<std::string> m_errors;
+  uint64_t m_skipped = 0;
+  uint64_t m_failedRecorded = 0;
+  uint64_t m_matches = 0;
+  uint64_t m_mismatches = 0;
+  uint64_t m_unchecked = 0;
+};
+
+int main(int argc, char **argv) {
+  Settings options;
+  if (!parseOptions(argc, argv, options)) {
+    return 2;
+  }
+
+  std::vector<RecordedRequest> requests;
+  std::string error;
+  if (!readRecording(options.log, requests, error)) {
+    std::cerr << error << std::endl;
+    return 2;
+  }
+  std::cout << "Replaying " << requests.size() << " requests from " << options.log << std::endl;
+
+  trantor::EventLoopThread loopThread("replay");
+  std::unique_ptr<Target> target;
+  if (!options.grpc.empty()) {
+    target.reset(new GrpcTarget(options.grpc));
+  } else {
+    loopThread.run();
+    target.reset(new HttpTarget(options.http, loopThread.getLoop()));
+  }
+
+  Replayer replayer(options, *target);
+  replayer.run(requests);
+  const bool passed = replayer.report();
+
+  if (options.grpc.empty()) {
+    loopThread.getLoop()->quit();
+  }
+  return passed ? 0 : 1;
+}
@@ -16,6 +16,7 @@
 using compute::Compute;
 using compute::ComputeKernel;
 using compute::ComputeKernelID;
+using compute::ComputeKernelInfo;
 using compute::ComputeStatus;
 using compute::ComputeInputData;
 using compute::DataType;
@@ -56,6 +57,29 @@ public:
     return reply.uuid();
   }
 
+  // Kernels are compiled in the background after CreateKernel returns.
+  bool WaitUntilBuilt(const std::string &uuid) {
+    ComputeKernelID request;
+    request.set_uuid(uuid);
+
+    for (;;) {
+      ComputeKernelInfo reply;
+      ClientContext context;
+      Status status = m_stub->KernelInfo(&context, request, &reply);
+      if (!status.ok()) {
+        std::cout << "Error: " << status.error_message() << std::endl;
+        return false;
+      }
+      if (reply.state() == compute::FAILED) {
+        std::cout << "Build failed: " << reply.build_log() << std::endl;
+        return false;
+      } else if (reply.state() == compute::READY) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
   std::string SetInputData(std::string uuid, uint64_t index, std::vector<uint32_t> data) {
     ComputeInputData request;
     ComputeStatus reply;
@@ -120,6 +144,9 @@ int main(int argc, char **argv) {
 
   const auto id = client.CreateKernel(source, inputs, outputs);
   std::cout << "Kernel created: " << id << std::endl;
+  if (!client.WaitUntilBuilt(id)) {
+    return 1;
+  }
 
   client.SetInputData(id, 0, a);
   client.SetInputData(id, 0, b);
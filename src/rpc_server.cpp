@@ -1,7 +1,13 @@
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <grpcpp/grpcpp.h>
@@ -11,62 +17,331 @@
 #include <boost/uuid/uuid_generators.hpp>
 #include <boost/uuid/uuid_io.hpp>
 
+#include "codec.h"
 #include "compute_kernel.grpc.pb.h"
+#include "config.h"
 #include "kernel.h"
+#include "local.h"
+#include "primitives.h"
+#include "recorder.h"
+#include "registry.h"
+#include "scheduler.h"
+#include "trace.h"
 
 using compute::Compute;
+using compute::ComputeDatasetBinding;
 using compute::ComputeInputData;
 using compute::ComputeKernel;
 using compute::ComputeKernelID;
+using compute::ComputeKernelInfo;
+using compute::ComputePrimitive;
+using compute::ComputePrimitiveResult;
 using compute::ComputeStatus;
+using compute::ComputeTrace;
+using compute::ComputeTraceRequest;
+using compute::ComputeUsage;
+using compute::ComputeUsageRequest;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::Status;
 using grpc::StatusCode;
 
+// Clients identify themselves with the x-tenant metadata key and pick a
+// scheduling class with x-priority ("interactive" or "batch").
+static std::string metadata(const ServerContext *context, const std::string &key) {
+  const auto &entries = context->client_metadata();
+  const auto it = entries.find(key);
+  if (it == entries.end()) {
+    return "";
+  }
+  return std::string(it->second.data(), it->second.size());
+}
+
+static std::string tenantOf(const ServerContext *context) {
+  const auto tenant = metadata(context, "x-tenant");
+  return tenant.empty() ? "default" : tenant;
+}
+
+// Sessions can only be used once their kernel is built.
+static Status checkReady(const KernelItem &item) {
+  switch (item.state) {
+    case KernelState::Pending:
+      return Status(StatusCode::UNAVAILABLE, "Kernel is still compiling");
+    case KernelState::Failed:
+      return Status(StatusCode::FAILED_PRECONDITION, "Kernel failed to compile");
+    default:
+      return Status::OK;
+  }
+}
+
+// Converts an integer value of a request to the kernel's type T, if it is
+// representable.
+template<typename T>
+static bool toElement(uint32_t value, T &out) {
+  typedef DataTypeTraits<T> Traits;
+  const auto wide = static_cast<typename Traits::Wide>(value);
+  if (!Traits::fits(wide)) {
+    return false;
+  }
+  out = Traits::fromWide(wide);
+  return true;
+}
+
+// Converts a real value of a request to the kernel's type T. Integer types
+// only take whole numbers in their range.
+template<typename T>
+static bool toElement(double value, T &out) {
+  typedef DataTypeTraits<T> Traits;
+  typedef typename Traits::Wide Wide;
+  if (!Traits::isFloat &&
+      (value != std::floor(value) ||
+       value < static_cast<double>(std::numeric_limits<Wide>::min()) ||
+       value >= static_cast<double>(std::numeric_limits<Wide>::max()))) {
+    return false;
+  }
+  const auto wide = static_cast<Wide>(value);
+  if (!Traits::fits(wide)) {
+    return false;
+  }
+  out = Traits::fromWide(wide);
+  return true;
+}
+
+template<typename T, typename V>
+static bool convertAll(const V *values, size_t count, T *out) {
+  for (size_t i = 0; i < count; i++) {
+    if (!toElement(values[i], out[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // Logic and data behind the server's behavior.
 class ComputeService final : public Compute::Service {
 public:
-  ComputeService() : m_kernels() {}
+  ComputeService()
+      : m_kernels(), m_scheduler(getConfigUInt("COMPUTE_DEVICE_SLOTS", 2)),
+        m_local(m_kernels, m_scheduler) {
+    m_scheduler.configure(getConfig("COMPUTE_TENANT_LIMITS"));
+
+    const auto localSocket = getConfig("COMPUTE_LOCAL_SOCKET");
+    std::string error;
+    if (!localSocket.empty() && !m_local.listen(localSocket, error)) {
+      std::cout << error << std::endl;
+    } else if (!localSocket.empty()) {
+      std::cout << "Serving local clients on " << localSocket << std::endl;
+    }
+
+    const auto recording = getConfig("COMPUTE_RECORD");
+    const bool payloads = getConfig("COMPUTE_RECORD_INPUTS") != "hash";
+    if (!recording.empty() && !Recorder::instance().open(recording, payloads, error)) {
+      std::cout << error << std::endl;
+    } else if (!recording.empty()) {
+      std::cout << "Recording requests to " << recording << std::endl;
+    }
+  }
 
   Status CreateKernel(ServerContext *context, const ComputeKernel *request,
                       ComputeKernelID *reply) override {
+    TraceRequest trace("CreateKernel");
+    Recording recording(RecordOp::Create, "");
     const auto source = request->source();
     const auto inputs = request->inputs();
     const auto outputs = request->outputs();
     const std::vector<size_t> data{outputs.begin(), outputs.end()};
+    if (!isValidDataType(request->type())) {
+      return Status(StatusCode::INVALID_ARGUMENT, "Unrecognized data type");
+    }
 
-    Kernel* kernel = new Kernel();
+    auto item = std::make_shared<KernelItem>();
+    item->type = request->type();
+    item->tenant = tenantOf(context);
 
     boost::uuids::uuid random = boost::uuids::random_generator()();
     const auto uuid = boost::uuids::to_string(random);
 
-    kernel->compile(source);
-    kernel->addOutputParams(data);
+    std::vector<std::string> names;
+    std::vector<size_t> intermediates;
+    for (const auto &buffer : request->buffers()) {
+      names.push_back(buffer.first);
+      intermediates.push_back(buffer.second);
+    }
+
+    std::vector<PipelineStage> stages;
+    for (const auto &description : request->pipeline()) {
+      PipelineStage stage;
+      stage.entry = description.kernel();
+      stage.workSize = description.work_size();
+      for (const auto &text : description.args()) {
+        PipelineArg arg;
+        if (!parsePipelineArg(text, names, arg)) {
+          return Status(StatusCode::INVALID_ARGUMENT, "Invalid pipeline argument " + text);
+        }
+        stage.args.push_back(arg);
+      }
+      stages.push_back(std::move(stage));
+    }
+
+    std::string error;
+    if (!validatePipeline(stages, inputs, data.size(), intermediates.size(), error)) {
+      return Status(StatusCode::INVALID_ARGUMENT, error);
+    }
+
+    // Pipelines name their entry points per stage.
+    std::string entry = request->entry().empty() ? "add" : request->entry();
+    if (!stages.empty()) {
+      entry.clear();
+    }
+
+    const int given = !source.empty() + !request->il().empty() + !request->binary().empty();
+    if (given != 1) {
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "Exactly one of source, il or binary is required");
+    }
+    const std::vector<unsigned char> il{request->il().begin(), request->il().end()};
+    const std::vector<unsigned char> binary{request->binary().begin(), request->binary().end()};
+
+    int64_t memory = 0;
+    for (const auto size : data) {
+      memory += size;
+    }
+    for (const auto size : intermediates) {
+      memory += size;
+    }
+    if (!m_scheduler.chargeMemory(item->tenant, memory, error)) {
+      return Status(StatusCode::RESOURCE_EXHAUSTED, error);
+    }
+
+    const auto tenant = item->tenant;
+    const size_t tileBudget = request->tile_budget();
+
+    // Pipelines aren't replayed.
+    if (!stages.empty()) {
+      recording.discard();
+    }
+    recording.setId(uuid);
+    recording.setKernel(request->type(), entry, data, tileBudget);
+    recording.setProgram(source, il, binary);
+    const bool added = m_kernels.addPending(uuid, std::move(item), [=](Kernel &kernel, std::string &error) {
+      bool ret;
+      if (!binary.empty()) {
+        ret = kernel.compileBinary(binary, "", entry);
+      } else if (!il.empty()) {
+        ret = kernel.compileIL(il, entry);
+      } else {
+        ret = kernel.compile(source, entry);
+      }
+      if (ret) {
+        kernel.addOutputParams(data);
+        kernel.setTileBudget(tileBudget);
+        if (!stages.empty() && !kernel.setPipeline(stages, intermediates)) {
+          error = "Pipeline references an unknown kernel, or passes it the wrong number of arguments";
+          ret = false;
+        }
+      }
+      if (!ret) {
+        std::string ignored;
+        m_scheduler.chargeMemory(tenant, -memory, ignored);
+      }
+      return ret;
+    });
+    if (!added) {
+      std::string ignored;
+      m_scheduler.chargeMemory(tenant, -memory, ignored);
+      recording.discard();
+      return Status(StatusCode::ALREADY_EXISTS, "Kernel id is already in use");
+    }
 
     reply->set_uuid(uuid);
+    recording.succeed();
+
+    return Status::OK;
+  }
 
-    m_kernels.emplace(uuid, kernel);
+  Status KernelInfo(ServerContext *context, const ComputeKernelID *request,
+                    ComputeKernelInfo *reply) override {
+    TraceRequest trace("KernelInfo");
+    auto item = m_kernels.find(request->uuid());
+    if (item == nullptr) {
+      return Status(StatusCode::INVALID_ARGUMENT, "UUID not found");
+    }
+    const auto lock = tracedLock(item->mtx);
+
+    switch (item->state) {
+      case KernelState::Pending:
+        reply->set_state(compute::PENDING);
+        break;
+      case KernelState::Ready:
+        reply->set_state(compute::READY);
+        break;
+      case KernelState::Failed:
+        reply->set_state(compute::FAILED);
+        break;
+    }
+    reply->set_build_log(item->buildLog);
+    reply->set_device(item->device);
 
     return Status::OK;
   }
 
+  Status DeleteKernel(ServerContext *context, const ComputeKernelID *request,
+                      ComputeStatus *reply) override {
+    TraceRequest trace("DeleteKernel");
+    auto item = m_kernels.find(request->uuid());
+    if (item == nullptr) {
+      return Status(StatusCode::INVALID_ARGUMENT, "UUID not found");
+    }
+
+    {
+      // The build still accounts for the kernel's memory.
+      const auto lock = tracedLock(item->mtx);
+      if (item->state == KernelState::Pending) {
+        return Status(StatusCode::UNAVAILABLE, "Kernel is still compiling");
+      }
+    }
+
+    const auto removed = m_kernels.remove(request->uuid());
+    if (removed == nullptr) {
+      return Status(StatusCode::INVALID_ARGUMENT, "UUID not found");
+    }
+    {
+      const auto lock = tracedSharedLock(removed->mtx);
+      std::string ignored;
+      const size_t memory = removed->kernel ? removed->kernel->memory() : 0;
+      m_scheduler.chargeMemory(removed->tenant, -static_cast<int64_t>(memory), ignored);
+    }
+
+    reply->set_success(true);
+    reply->set_message("Kernel deleted");
+    return Status::OK;
+  }
+
   Status SetInputData(ServerContext *context, const ComputeInputData *request,
                       ComputeStatus *reply) override {
+    TraceRequest trace("SetInputData");
     const auto size = request->size();
     const auto uuid = request->uuid();
-    const auto index = request->index();
-    const auto bytes = request->data();
+    Recording recording(RecordOp::SetInput, uuid);
 
-    if (m_kernels.count(uuid) == 0) {
+    auto item = m_kernels.find(uuid);
+    if (item == nullptr) {
       return Status(StatusCode::INVALID_ARGUMENT, "UUID not found");
     }
-    Kernel *kernel = m_kernels[uuid];
-
-    std::vector<uint32_t> data{bytes.begin(), bytes.end()};
+    const auto lock = tracedLock(item->mtx);
+    const auto ready = checkReady(*item);
+    if (!ready.ok()) {
+      return ready;
+    }
 
-    kernel->addInputData<uint32_t>(data);
+    const auto status = visitDataType(item->type, [&](auto tag) {
+      return this->setInput<typename decltype(tag)::type>(*item, *request, recording);
+    });
+    if (!status.ok()) {
+      return status;
+    }
+    recording.succeed();
 
     reply->set_success(true);
     reply->set_message("It worked (I think)");
@@ -76,31 +351,277 @@ public:
 
   Status Compute(ServerContext *context, const ComputeKernelID *request,
                  ComputeStatus *reply) override {
+    TraceRequest trace("Compute");
     const auto uuid = request->uuid();
+    Recording recording(RecordOp::Compute, uuid);
 
-    if (m_kernels.count(uuid) == 0) {
+    auto item = m_kernels.find(uuid);
+    if (item == nullptr) {
       return Status(StatusCode::INVALID_ARGUMENT, "UUID not found");
     }
-    Kernel* kernel = m_kernels[uuid];
 
-    kernel->execute();
+    Scheduler::Ticket ticket;
+    std::string error;
+    if (!m_scheduler.acquire(item->tenant, parsePriority(metadata(context, "x-priority")),
+                             ticket, error)) {
+      return Status(StatusCode::RESOURCE_EXHAUSTED, error);
+    }
+    Encoding encoding = Encoding::Plain;
+    if (!parseEncoding(request->output_encoding(), encoding)) {
+      return Status(StatusCode::INVALID_ARGUMENT, "Unknown encoding");
+    }
+    // Executions of the same kernel run at once.
+    const auto lock = tracedSharedLock(item->mtx);
+    const auto ready = checkReady(*item);
+    if (!ready.ok()) {
+      return ready;
+    }
+
+    auto execution = item->kernel->launch();
+    ticket.addDeviceTime(execution.deviceTime());
 
-    // get the output data.
-    uint32_t *c = kernel->getOutputData<uint32_t>(0);
-    // print out results in 'c'
-    std::cout << "c: [" << c[0] << ", " << c[1] << ", " << c[2] << ", " << c[3]
-              << "]" << std::endl;
+    // Output 0, packed in the kernel's data type.
+    const auto output = execution.getOutput<unsigned char>(0);
+    recording.setOutput(0, output.data(), output.size());
 
+    if (encoding == Encoding::Plain) {
+      reply->set_output(output.data(), output.size());
+    } else if (!encode(encoding, item->type, output.data(), output.size(),
+                       *reply->mutable_output(), error)) {
+      return Status(StatusCode::INVALID_ARGUMENT, error);
+    }
     reply->set_success(true);
     reply->set_message("Let's see if it worked (fingers crossed)");
+    recording.succeed();
+
+    return Status::OK;
+  }
+
+  Status BindDataset(ServerContext *context, const ComputeDatasetBinding *request,
+                     ComputeStatus *reply) override {
+    TraceRequest trace("BindDataset");
+    auto dataset = m_datasets.find(request->name());
+    if (dataset == nullptr) {
+      return Status(StatusCode::NOT_FOUND, "Dataset not found");
+    }
+
+    const uint64_t offset = request->offset();
+    if (offset > dataset->size()) {
+      return Status(StatusCode::OUT_OF_RANGE, "Offset is past the end of the dataset");
+    }
+    const uint64_t length = request->length() != 0 ? request->length()
+                                                   : dataset->size() - offset;
+    if (length == 0 || length > dataset->size() - offset) {
+      return Status(StatusCode::OUT_OF_RANGE, "Invalid dataset range");
+    }
+
+    auto item = m_kernels.find(request->uuid());
+    if (item == nullptr) {
+      return Status(StatusCode::INVALID_ARGUMENT, "UUID not found");
+    }
+    const auto lock = tracedLock(item->mtx);
+    const auto ready = checkReady(*item);
+    if (!ready.ok()) {
+      return ready;
+    }
+
+    const size_t typeSize = dataTypeSize(item->type);
+    if (typeSize == 0 || length % typeSize != 0) {
+      return Status(StatusCode::INVALID_ARGUMENT,
+                    "Length is not a multiple of the element size");
+    }
+
+    // Bound ranges count as the tenant's memory, instead of the input they
+    // replace.
+    const int64_t memory = static_cast<int64_t>(length) - item->kernel->inputBytes(request->index());
+    std::string error;
+    if (!m_scheduler.chargeMemory(item->tenant, memory, error)) {
+      return Status(StatusCode::RESOURCE_EXHAUSTED, error);
+    }
+
+    boost::compute::buffer buffer;
+    if (!dataset->buffer(item->kernel->context(), offset, length, buffer, error)) {
+      std::string ignored;
+      m_scheduler.chargeMemory(item->tenant, -memory, ignored);
+      return Status(StatusCode::RESOURCE_EXHAUSTED, error);
+    }
+    if (!item->kernel->addBufferInput(request->index(), buffer, length / typeSize,
+                                     typeSize, dataset->name(), offset)) {
+      std::string ignored;
+      m_scheduler.chargeMemory(item->tenant, -memory, ignored);
+      return Status(StatusCode::OUT_OF_RANGE, "Index is past the end of the inputs");
+    }
+
+    reply->set_success(true);
+    reply->set_message("Dataset bound successfully");
+
+    return Status::OK;
+  }
+
+  Status Primitive(ServerContext *context, const ComputePrimitive *request,
+                   ComputePrimitiveResult *reply) override {
+    TraceRequest trace("Primitive");
+    PrimitiveRequest primitive;
+    if (!parsePrimitive(request->op(), primitive.primitive)) {
+      return Status(StatusCode::INVALID_ARGUMENT, "Unrecognized operation");
+    } else if (!parsePipelineArg(request->target(), {}, primitive.target)) {
+      return Status(StatusCode::INVALID_ARGUMENT, "Invalid target buffer");
+    } else if (primitive.primitive == ::Primitive::SortByKey &&
+               !parsePipelineArg(request->values(), {}, primitive.values)) {
+      return Status(StatusCode::INVALID_ARGUMENT, "Invalid values buffer");
+    }
+    primitive.bins = request->bins();
+    primitive.hasRange = request->has_range();
+    primitive.lo = request->min();
+    primitive.hi = request->max();
+    primitive.limit = request->limit();
+
+    auto item = m_kernels.find(request->uuid());
+    if (item == nullptr) {
+      return Status(StatusCode::INVALID_ARGUMENT, "UUID not found");
+    }
+
+    Scheduler::Ticket ticket;
+    std::string error;
+    if (!m_scheduler.acquire(item->tenant, parsePriority(metadata(context, "x-priority")),
+                             ticket, error)) {
+      return Status(StatusCode::RESOURCE_EXHAUSTED, error);
+    }
+    const auto lock = tracedLock(item->mtx);
+    const auto ready = checkReady(*item);
+    if (!ready.ok()) {
+      return ready;
+    }
+
+    PrimitiveResult result;
+    if (!runPrimitive(*item->kernel, item->type, primitive, result, error)) {
+      return Status(StatusCode::FAILED_PRECONDITION, error);
+    }
+
+    reply->set_success(true);
+    reply->mutable_integers()->Add(result.integers.begin(), result.integers.end());
+    reply->mutable_signed_integers()->Add(result.signedIntegers.begin(),
+                                          result.signedIntegers.end());
+    reply->mutable_reals()->Add(result.reals.begin(), result.reals.end());
 
     return Status::OK;
   }
 
+  Status Usage(ServerContext *context, const ComputeUsageRequest *request,
+               ComputeUsage *reply) override {
+    for (const auto &entry : m_scheduler.usage()) {
+      auto *tenant = reply->add_tenants();
+      tenant->set_tenant(entry.first);
+      tenant->set_jobs(entry.second.jobs);
+      tenant->set_running(entry.second.running);
+      tenant->set_waiting(entry.second.waiting);
+      tenant->set_rejected(entry.second.rejected);
+      tenant->set_memory(entry.second.memory);
+      tenant->set_device_time_ns(entry.second.deviceTime);
+    }
+    return Status::OK;
+  }
+
+  Status Trace(ServerContext *context, const ComputeTraceRequest *request,
+               ComputeTrace *reply) override {
+    auto &tracer = Tracer::instance();
+    reply->set_chrome_trace(tracer.chromeTrace());
+    if (request->set_sample()) {
+      tracer.setSampling(request->sample());
+    }
+    if (request->clear()) {
+      tracer.clear();
+    }
+    reply->set_sample(tracer.sampling());
+    return Status::OK;
+  }
+
+  KernelRegistry& kernels() { return m_kernels; }
+  DatasetRegistry& datasets() { return m_datasets; }
+  Scheduler& scheduler() { return m_scheduler; }
+
 private:
-  std::map<std::string, Kernel *> m_kernels;
+  // Adds or partially overwrites an input from a request, in the kernel's
+  // element type T. Packed elements already have the kernel's layout and
+  // are copied once, or decoded in place if they are encoded; values are
+  // converted on the way.
+  template<typename T>
+  Status setInput(KernelItem &item, const ComputeInputData &request, Recording &recording) {
+    const auto &raw = request.raw();
+    Encoding encoding = Encoding::Plain;
+    if (!parseEncoding(request.encoding(), encoding)) {
+      return Status(StatusCode::INVALID_ARGUMENT, "Unknown encoding");
+    }
+    size_t bytes = 0;
+    std::string error;
+    if (!raw.empty() && !decodedSize(encoding, item.type, raw.data(), raw.size(), bytes, error)) {
+      return Status(StatusCode::INVALID_ARGUMENT, error);
+    }
+    const size_t count = !raw.empty() ? bytes / sizeof(T)
+                       : request.reals_size() > 0 ? request.reals_size()
+                       : request.data_size();
+    const auto unpack = [&](T *out) {
+      if (!raw.empty()) {
+        return decode(encoding, item.type, raw.data(), raw.size(), out, bytes, error);
+      }
+      error = "Input data does not fit the kernel's data type";
+      if (request.reals_size() > 0) {
+        return convertAll(request.reals().data(), count, out);
+      }
+      return convertAll(request.data().data(), count, out);
+    };
+
+    if (request.partial()) {
+      Arena::Scope scope;
+      T *elements = Arena::local().allocate<T>(count);
+      if (!unpack(elements)) {
+        return Status(StatusCode::INVALID_ARGUMENT, error);
+      }
+      recording.setInput(request.index(), true, request.offset(), elements, count * sizeof(T));
+      if (!item.kernel->updateInputData<T>(request.index(), request.offset(), elements, count)) {
+        return Status(StatusCode::OUT_OF_RANGE, "Range is outside of the input");
+      }
+      return Status::OK;
+    }
+
+    StagingBuffer staging(count * sizeof(T));
+    if (!unpack(staging.as<T>())) {
+      return Status(StatusCode::INVALID_ARGUMENT, error);
+    }
+    if (!m_scheduler.chargeMemory(item.tenant, staging.size(), error)) {
+      return Status(StatusCode::RESOURCE_EXHAUSTED, error);
+    }
+    recording.setInput(request.index(), false, 0, staging.data(), staging.size());
+    item.kernel->addInputData(std::move(staging), sizeof(T));
+    return Status::OK;
+  }
+
+  KernelRegistry m_kernels;
+  DatasetRegistry m_datasets;
+  Scheduler m_scheduler;
+  LocalTransport m_local;
 };
 
+static sigset_t shutdownSignals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  return signals;
+}
+
+// SIGINT/SIGTERM are blocked before any gRPC thread is started and then
+// handled by a dedicated thread, so that main() can take a final snapshot
+// after Wait() returns.
+static std::thread shutdownOnSignal(Server *server) {
+  return std::thread([server]() {
+    const sigset_t signals = shutdownSignals();
+    int signal = 0;
+    sigwait(&signals, &signal);
+    server->Shutdown();
+  });
+}
+
 int main(int argc, char **argv) {
 #if 0
     Kernel kernel;
@@ -143,18 +664,67 @@ int main(int argc, char **argv) {
   ComputeService service;
   ServerBuilder builder;
 
+  const auto dataDir = getConfig("COMPUTE_DATA_DIR");
+  if (!dataDir.empty()) {
+    const auto count = service.datasets().scan(dataDir);
+    std::cout << "Mapped " << count << " datasets from " << dataDir << std::endl;
+  }
+
+  const auto snapshotPath = getConfig("COMPUTE_SNAPSHOT");
+  const auto snapshotInterval = getConfigUInt("COMPUTE_SNAPSHOT_INTERVAL", 0);
+  if (!snapshotPath.empty()) {
+    const auto restored = service.kernels().restoreSnapshot(snapshotPath, service.datasets(),
+                                                            service.scheduler());
+    std::cout << "Restored " << restored << " kernels from " << snapshotPath
+              << std::endl;
+  }
+
   // Listen on the given address without any authentication mechanism.
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
   // Register "service" as the instance through which we'll communicate with
   // clients. In this case it corresponds to an *synchronous* service.
   builder.RegisterService(&service);
   // Finally assemble the server.
+  const sigset_t signals = shutdownSignals();
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
   std::unique_ptr<Server> server(builder.BuildAndStart());
+  std::thread signalThread = shutdownOnSignal(server.get());
   std::cout << "Server listening on " << server_address << std::endl;
 
-  // Wait for the server to shutdown. Note that some other thread must be
-  // responsible for shutting down the server for this call to ever return.
+  std::mutex snapshotMutex;
+  std::condition_variable snapshotCv;
+  bool stopping = false;
+  std::thread snapshotThread;
+  if (!snapshotPath.empty() && snapshotInterval > 0) {
+    snapshotThread = std::thread([&]() {
+      std::unique_lock<std::mutex> lock(snapshotMutex);
+      while (!snapshotCv.wait_for(lock, std::chrono::seconds(snapshotInterval),
+                                  [&]() { return stopping; })) {
+        if (!service.kernels().saveSnapshot(snapshotPath)) {
+          std::cout << "Failed to write snapshot " << snapshotPath << std::endl;
+        }
+      }
+    });
+  }
+
+  // Wait for the server to shutdown. The signal thread is responsible for
+  // shutting down the server for this call to return.
   server->Wait();
+
+  {
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    stopping = true;
+  }
+  snapshotCv.notify_all();
+  if (snapshotThread.joinable()) {
+    snapshotThread.join();
+  }
+  if (!snapshotPath.empty() && !service.kernels().saveSnapshot(snapshotPath)) {
+    std::cout << "Failed to write snapshot " << snapshotPath << std::endl;
+  }
+  Recorder::instance().close();
+  signalThread.join();
   return 0;
 #endif
 }
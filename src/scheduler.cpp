@@ -0,0 +1,274 @@
+#include "scheduler.h"
+#include "trace.h"
+#include <algorithm>
+#include <condition_variable>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+using Clock = std::chrono::steady_clock;
+
+static const auto QuotaWindow = std::chrono::minutes(1);
+
+Priority parsePriority(const std::string &name) {
+    return name == "batch" ? Priority::Batch : Priority::Interactive;
+}
+
+Scheduler::Ticket::Ticket(Ticket &&other) noexcept
+    : m_scheduler(other.m_scheduler)
+    , m_tenant(std::move(other.m_tenant))
+    , m_start(other.m_start)
+    , m_deviceTime(other.m_deviceTime)
+    , m_profiled(other.m_profiled)
+{
+    other.m_scheduler = nullptr;
+}
+
+Scheduler::Ticket& Scheduler::Ticket::operator=(Ticket &&other) {
+    if (this != &other) {
+        release();
+        m_scheduler = other.m_scheduler;
+        m_tenant = std::move(other.m_tenant);
+        m_start = other.m_start;
+        m_deviceTime = other.m_deviceTime;
+        m_profiled = other.m_profiled;
+        other.m_scheduler = nullptr;
+    }
+    return *this;
+}
+
+Scheduler::Ticket::~Ticket() {
+    release();
+}
+
+void Scheduler::Ticket::release() {
+    if (m_scheduler != nullptr) {
+        m_scheduler->release(*this);
+        m_scheduler = nullptr;
+    }
+}
+
+void Scheduler::Ticket::addDeviceTime(uint64_t nanoseconds) {
+    m_deviceTime += nanoseconds;
+    m_profiled = true;
+}
+
+Scheduler::Scheduler(size_t slots)
+    : m_slots(std::max<size_t>(slots, 1))
+    , m_running(0)
+    , m_virtualTime(0)
+    , m_sequence(0)
+{
+}
+
+void Scheduler::configure(const std::string &spec) {
+    std::istringstream tenants(spec);
+    std::string entry;
+    while (std::getline(tenants, entry, ';')) {
+        const auto colon = entry.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+
+        TenantLimits limits;
+        std::istringstream settings(entry.substr(colon + 1));
+        std::string setting;
+        while (std::getline(settings, setting, ',')) {
+            const auto equals = setting.find('=');
+            if (equals == std::string::npos) {
+                continue;
+            }
+            const auto key = setting.substr(0, equals);
+            const auto value = setting.substr(equals + 1);
+            try {
+                if (key == "weight") {
+                    limits.weight = std::max(std::stod(value), 0.001);
+                } else if (key == "jobs") {
+                    limits.maxJobs = std::stoull(value);
+                } else if (key == "memory") {
+                    limits.maxMemory = std::stoull(value);
+                } else if (key == "time") {
+                    limits.maxDeviceTime = std::stoull(value);
+                }
+            } catch (const std::logic_error&) {
+                // Ignore malformed values.
+            }
+        }
+
+        setLimits(entry.substr(0, colon), limits);
+    }
+}
+
+void Scheduler::setLimits(const std::string &tenant, const TenantLimits &limits) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (tenant == "*") {
+        m_defaultLimits = limits;
+    } else {
+        this->tenant(tenant).limits = limits;
+    }
+}
+
+Scheduler::Tenant& Scheduler::tenant(const std::string &name) {
+    auto it = m_tenants.find(name);
+    if (it == m_tenants.end()) {
+        it = m_tenants.emplace(name, Tenant()).first;
+        it->second.limits = m_defaultLimits;
+        it->second.windowStart = Clock::now();
+    }
+    return it->second;
+}
+
+std::list<Scheduler::Waiter>::iterator Scheduler::next() {
+    auto best = m_waiting.end();
+    for (auto waiter = m_waiting.begin(); waiter != m_waiting.end(); ++waiter) {
+        const auto &limits = m_tenants[waiter->tenant].limits;
+        if (limits.maxJobs > 0 && m_tenants[waiter->tenant].usage.running >= limits.maxJobs) {
+            continue;
+        }
+        if (best == m_waiting.end() ||
+            std::tie(waiter->priority, waiter->start, waiter->sequence) <
+            std::tie(best->priority, best->start, best->sequence)) {
+            best = waiter;
+        }
+    }
+    return best;
+}
+
+void Scheduler::dispatch(Granted &granted) {
+    while (m_running < m_slots) {
+        const auto waiter = next();
+        if (waiter == m_waiting.end()) {
+            return;
+        }
+
+        auto &state = m_tenants[waiter->tenant];
+        m_virtualTime = std::max(m_virtualTime, waiter->start);
+        m_running++;
+        state.usage.waiting--;
+        state.usage.running++;
+        state.usage.jobs++;
+
+        Ticket ticket;
+        ticket.m_scheduler = this;
+        ticket.m_tenant = waiter->tenant;
+        ticket.m_start = Clock::now();
+        granted.emplace_back(std::move(waiter->grant), std::move(ticket));
+        m_waiting.erase(waiter);
+    }
+}
+
+bool Scheduler::acquire(const std::string &name, Priority priority, Ticket &ticket,
+                        std::string &error) {
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool granted = false;
+    const auto grant = [&](Ticket slot) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ticket = std::move(slot);
+        granted = true;
+        ready.notify_one();
+    };
+    if (!submit(name, priority, grant, error)) {
+        return false;
+    }
+
+    TraceSpan span("queue");
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [&]() { return granted; });
+    return true;
+}
+
+bool Scheduler::submit(const std::string &name, Priority priority, Grant grant,
+                       std::string &error) {
+    // Grants run after the lock is released, since they may take it again.
+    Granted granted;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto &state = tenant(name);
+
+        const auto now = Clock::now();
+        if (now - state.windowStart >= QuotaWindow) {
+            state.windowStart = now;
+            state.windowTime = 0;
+        }
+        if (state.limits.maxDeviceTime > 0 &&
+            state.windowTime >= state.limits.maxDeviceTime * 1000000) {
+            state.usage.rejected++;
+            error = "Device time quota exceeded";
+            return false;
+        }
+
+        // Start-time fair queueing: a job's start tag is where the tenant's
+        // previous job finished, but never earlier than the current virtual
+        // time, so idle tenants can't bank credit.
+        const double start = std::max(m_virtualTime, state.finish);
+        state.finish = start + state.estimate / state.limits.weight;
+
+        m_waiting.push_back({ name, priority, start, m_sequence++, std::move(grant) });
+        state.usage.waiting++;
+        dispatch(granted);
+    }
+
+    for (auto &job : granted) {
+        job.first(std::move(job.second));
+    }
+    return true;
+}
+
+void Scheduler::release(Ticket &ticket) {
+    const auto elapsed = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - ticket.m_start).count());
+    // Quotas are charged the kernels' profiled time. Jobs without kernel
+    // launches of their own (primitives) are charged the wall time they
+    // held the slot instead.
+    const uint64_t deviceTime = ticket.m_profiled ? ticket.m_deviceTime : elapsed;
+
+    Granted granted;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto &state = tenant(ticket.m_tenant);
+
+        m_running--;
+        state.usage.running--;
+        state.usage.deviceTime += deviceTime;
+        state.windowTime += deviceTime;
+
+        // Fair queueing shares the slots, so it works on how long the job
+        // held one. Correct the finish tag for the difference between the
+        // estimated and the actual duration, and update the estimate.
+        state.finish += (elapsed - state.estimate) / state.limits.weight;
+        state.estimate = 0.8 * state.estimate + 0.2 * elapsed;
+
+        dispatch(granted);
+    }
+
+    for (auto &job : granted) {
+        job.first(std::move(job.second));
+    }
+}
+
+bool Scheduler::chargeMemory(const std::string &name, int64_t bytes, std::string &error) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto &state = tenant(name);
+
+    if (bytes < 0) {
+        state.usage.memory -= std::min<uint64_t>(state.usage.memory, -bytes);
+        return true;
+    }
+    if (state.limits.maxMemory > 0 && state.usage.memory + bytes > state.limits.maxMemory) {
+        state.usage.rejected++;
+        error = "Device memory quota exceeded";
+        return false;
+    }
+    state.usage.memory += bytes;
+    return true;
+}
+
+std::map<std::string, TenantUsage> Scheduler::usage() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, TenantUsage> result;
+    for (const auto &entry : m_tenants) {
+        result.emplace(entry.first, entry.second.usage);
+    }
+    return result;
+}
@@ -0,0 +1,177 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Scheduling class of a job. Interactive jobs always run before
+ * batch jobs that are waiting at the same time.
+ */
+enum class Priority {
+    Interactive,
+    Batch,
+};
+
+/**
+ * @brief Parse "interactive" or "batch". Anything else is interactive.
+ */
+Priority parsePriority(const std::string &name);
+
+/**
+ * @brief Per-tenant limits. 0 means unlimited.
+ */
+struct TenantLimits {
+    /** Share of the device relative to other tenants. */
+    double weight = 1.0;
+    /** Jobs running at the same time. */
+    size_t maxJobs = 0;
+    /** Bytes of device memory held by the tenant's sessions. */
+    uint64_t maxMemory = 0;
+    /** Milliseconds of device time per minute. */
+    uint64_t maxDeviceTime = 0;
+};
+
+struct TenantUsage {
+    uint64_t jobs = 0;
+    uint64_t running = 0;
+    uint64_t waiting = 0;
+    uint64_t rejected = 0;
+    uint64_t memory = 0;
+    /** Total device time, in nanoseconds, as profiled by the device. */
+    uint64_t deviceTime = 0;
+};
+
+/**
+ * @brief Decides which tenant's job runs next on the device.
+ *
+ * Jobs wait until one of a fixed number of device slots is free. Among the
+ * waiting jobs, interactive ones go first; within a class, tenants are
+ * served by start-time fair queueing, so each one gets device time in
+ * proportion to its weight no matter how many or how large jobs it submits.
+ */
+class Scheduler {
+public:
+    /**
+     * @brief A device slot. Released when destroyed.
+     */
+    class Ticket {
+    public:
+        Ticket() = default;
+        Ticket(Ticket &&other) noexcept;
+        Ticket& operator=(Ticket &&other);
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+        ~Ticket();
+
+        void release();
+
+        /**
+         * @brief Report time the device spent on the job's kernels, in
+         * nanoseconds, to be charged to the tenant when the slot is
+         * released. Jobs that report none are charged the time they held
+         * the slot.
+         */
+        void addDeviceTime(uint64_t nanoseconds);
+
+    private:
+        friend class Scheduler;
+
+        Scheduler* m_scheduler = nullptr;
+        std::string m_tenant;
+        std::chrono::steady_clock::time_point m_start;
+        uint64_t m_deviceTime = 0;
+        bool m_profiled = false;
+    };
+
+    /**
+     * @param slots Jobs allowed on the device at the same time.
+     */
+    explicit Scheduler(size_t slots = 1);
+
+    /**
+     * @brief Set limits from a specification such as
+     * "alice:weight=4,jobs=2;bob:memory=1073741824,time=30000".
+     * The tenant "*" sets the limits of tenants not listed.
+     */
+    void configure(const std::string &spec);
+
+    void setLimits(const std::string &tenant, const TenantLimits &limits);
+
+    /**
+     * @brief Called with the slot once a job's turn comes.
+     */
+    typedef std::function<void(Ticket)> Grant;
+
+    /**
+     * @brief Wait for a device slot.
+     * @returns false, without waiting, if the tenant used up its device time.
+     */
+    bool acquire(const std::string &tenant, Priority priority, Ticket &ticket,
+                 std::string &error);
+
+    /**
+     * @brief Queue a job for a device slot without waiting for it.
+     *
+     * @p grant is called right away if a slot is free, and otherwise on the
+     * thread that frees one, so it should hand the job to a worker rather
+     * than run it.
+     * @returns false, without queueing, if the tenant used up its device time.
+     */
+    bool submit(const std::string &tenant, Priority priority, Grant grant,
+                std::string &error);
+
+    /**
+     * @brief Account for device memory allocated (or freed, if negative)
+     * by a tenant's sessions.
+     * @returns false, without charging anything, if it exceeds the limit.
+     */
+    bool chargeMemory(const std::string &tenant, int64_t bytes, std::string &error);
+
+    std::map<std::string, TenantUsage> usage();
+
+private:
+    struct Tenant {
+        TenantLimits limits;
+        TenantUsage usage;
+        // Finish tag of the tenant's last job, in virtual time.
+        double finish = 0;
+        // Expected duration of the next job, in nanoseconds.
+        double estimate = 1e6;
+        std::chrono::steady_clock::time_point windowStart;
+        uint64_t windowTime = 0;
+    };
+
+    struct Waiter {
+        std::string tenant;
+        Priority priority;
+        double start;
+        uint64_t sequence;
+        Grant grant;
+    };
+
+    typedef std::vector<std::pair<Grant, Ticket>> Granted;
+
+    Tenant& tenant(const std::string &name);
+    std::list<Waiter>::iterator next();
+    void dispatch(Granted &granted);
+    void release(Ticket &ticket);
+
+    std::mutex m_mutex;
+    size_t m_slots;
+    size_t m_running;
+    double m_virtualTime;
+    uint64_t m_sequence;
+    TenantLimits m_defaultLimits;
+    std::map<std::string, Tenant> m_tenants;
+    std::list<Waiter> m_waiting;
+};
+
+#endif
@@ -1,12 +1,19 @@
 #include "server.h"
-
-static inline HttpResponsePtr makeFailedResponse(std::string msg = "")
+#include "codec.h"
+#include "config.h"
+#include "primitives.h"
+#include "recorder.h"
+#include "trace.h"
+#include <boost/asio/post.hpp>
+
+static inline HttpResponsePtr makeFailedResponse(std::string msg = "",
+                                                  HttpStatusCode code = k500InternalServerError)
 {
     Json::Value json;
     json["success"] = false;
     json["data"] = msg;
     auto resp = HttpResponse::newHttpJsonResponse(json);
-    resp->setStatusCode(k500InternalServerError);
+    resp->setStatusCode(code);
     return resp;
 }
 
@@ -33,30 +40,232 @@ inline std::string getRandomString(size_t n) {
     return randomString;
 }
 
+static int64_t receivedAt(const HttpRequestPtr &req) {
+    return traceClockFromWallTime(req->creationDate().microSecondsSinceEpoch());
+}
+
+// drogon parses the body on first use.
+static std::shared_ptr<Json::Value> parseJson(const HttpRequestPtr &req) {
+    TraceSpan span("decode");
+    return req->jsonObject();
+}
+
+// Sessions can only be used once their kernel is built. Returns the
+// failure to respond with, or nullptr if the kernel is ready.
+static HttpResponsePtr notReady(const KernelItem &item) {
+    if (item.state == KernelState::Ready) {
+        return nullptr;
+    }
+    return makeFailedResponse(item.state == KernelState::Pending ? "Kernel is still compiling"
+                                                                : "Kernel failed to compile",
+                              k409Conflict);
+}
+
+static bool isReady(const KernelItem &item, HttpCallback &callback) {
+    auto failure = notReady(item);
+    if (failure) {
+        callback(failure);
+        return false;
+    }
+    return true;
+}
+
+// Tenants identify themselves with the X-Tenant header and pick a
+// scheduling class with X-Priority ("interactive" or "batch").
+static std::string tenantOf(const HttpRequestPtr &req) {
+    const auto &tenant = req->getHeader("X-Tenant");
+    return tenant.empty() ? "default" : tenant;
+}
+
+static Priority priorityOf(const HttpRequestPtr &req) {
+    return parsePriority(req->getHeader("X-Priority"));
+}
+
+Server::Server()
+    : m_scheduler(getConfigUInt("COMPUTE_DEVICE_SLOTS", 2))
+    , m_snapshotPath(getConfig("COMPUTE_SNAPSHOT"))
+    , m_local(m_kernels, m_scheduler)
+    , m_jobs(std::max<size_t>(getConfigUInt("COMPUTE_DEVICE_SLOTS", 2), 1))
+{
+    m_scheduler.configure(getConfig("COMPUTE_TENANT_LIMITS"));
+
+    const auto dataDir = getConfig("COMPUTE_DATA_DIR");
+    if (!dataDir.empty()) {
+        const auto count = m_datasets.scan(dataDir);
+        LOG_INFO << "Mapped " << count << " datasets from " << dataDir;
+    }
+
+    const auto localSocket = getConfig("COMPUTE_LOCAL_SOCKET");
+    std::string error;
+    if (!localSocket.empty() && !m_local.listen(localSocket, error)) {
+        LOG_ERROR << error;
+    } else if (!localSocket.empty()) {
+        LOG_INFO << "Serving local clients on " << localSocket;
+    }
+
+    const auto recording = getConfig("COMPUTE_RECORD");
+    const bool payloads = getConfig("COMPUTE_RECORD_INPUTS") != "hash";
+    if (!recording.empty() && !Recorder::instance().open(recording, payloads, error)) {
+        LOG_ERROR << error;
+    } else if (!recording.empty()) {
+        LOG_INFO << "Recording requests to " << recording;
+    }
+
+    if (m_snapshotPath.empty()) {
+        return;
+    }
+
+    const auto restored = m_kernels.restoreSnapshot(m_snapshotPath, m_datasets, m_scheduler);
+    LOG_INFO << "Restored " << restored << " kernels from " << m_snapshotPath;
+
+    const auto interval = getConfigUInt("COMPUTE_SNAPSHOT_INTERVAL", 0);
+    if (interval > 0) {
+        app().getLoop()->runEvery(static_cast<double>(interval), [this]() {
+            saveSnapshot();
+        });
+    }
+}
+
+void Server::saveSnapshot() {
+    if (m_snapshotPath.empty()) {
+        return;
+    }
+    if (!m_kernels.saveSnapshot(m_snapshotPath)) {
+        LOG_ERROR << "Failed to write snapshot " << m_snapshotPath;
+    }
+}
+
+// Parses the optional "buffers" and "pipeline" members of a create request:
+//   "buffers": { "tmp": 4096 },
+//   "pipeline": [ { "kernel": "scale", "args": [ "input:0", "buffer:tmp" ],
+//                   "work_size": 1024 }, ... ]
+static bool parsePipeline(const Json::Value &json, std::vector<PipelineStage> &stages,
+                          std::vector<size_t> &intermediates, std::string &error) {
+    const auto &buffers = json["buffers"];
+    const auto &pipeline = json["pipeline"];
+    if (pipeline.isNull()) {
+        return true;
+    }
+    if (!pipeline.isArray() || (!buffers.isNull() && !buffers.isObject())) {
+        error = "Invalid pipeline";
+        return false;
+    }
+
+    std::vector<std::string> names;
+    if (buffers.isObject()) {
+        names = buffers.getMemberNames();
+    }
+    for (const auto &name : names) {
+        if (!buffers[name].isUInt64() || buffers[name].asUInt64() == 0) {
+            error = "Invalid size of buffer " + name;
+            return false;
+        }
+        intermediates.push_back(buffers[name].asUInt64());
+    }
+
+    for (Json::ArrayIndex i = 0; i < pipeline.size(); i++) {
+        const auto &item = pipeline[i];
+        if (!item["kernel"].isString() || !item["args"].isArray() ||
+            (!item["work_size"].isNull() && !item["work_size"].isUInt64())) {
+            error = "Invalid pipeline stage " + std::to_string(i);
+            return false;
+        }
+
+        PipelineStage stage;
+        stage.entry = item["kernel"].asString();
+        stage.workSize = item["work_size"].asUInt64();
+        for (Json::ArrayIndex a = 0; a < item["args"].size(); a++) {
+            PipelineArg arg;
+            const auto &text = item["args"][a];
+            if (!text.isString() || !parsePipelineArg(text.asString(), names, arg)) {
+                error = "Invalid argument " + std::to_string(a) + " of pipeline stage " + std::to_string(i);
+                return false;
+            }
+            stage.args.push_back(arg);
+        }
+        stages.push_back(std::move(stage));
+    }
+    return true;
+}
+
+// The program is OpenCL C in "source", or base64-encoded SPIR-V (or another
+// IL the device takes) in "il", or a base64-encoded device binary in
+// "binary".
+static bool parseProgram(const Json::Value &json, std::string &source,
+                         std::vector<unsigned char> &il, std::vector<unsigned char> &binary,
+                         std::string &error) {
+    const int given = json["source"].isString() + json["il"].isString() + json["binary"].isString();
+    if (given != 1) {
+        error = "Exactly one of source, il or binary is required";
+        return false;
+    }
+
+    if (json["source"].isString()) {
+        source = json["source"].asString();
+        return true;
+    }
+
+    const auto &encoded = json["il"].isString() ? json["il"] : json["binary"];
+    const auto decoded = utils::base64Decode(encoded.asString());
+    if (decoded.empty()) {
+        error = "Program is not valid base64";
+        return false;
+    }
+    auto &program = json["il"].isString() ? il : binary;
+    program.assign(decoded.begin(), decoded.end());
+    return true;
+}
+
 void Server::createKernel(const HttpRequestPtr& req, HttpCallback callback) {
+    TraceRequest trace("create", receivedAt(req));
     std::string id = getRandomString(64);
-    // TODO: if already exists then return 50x error.
+    Recording recording(RecordOp::Create, id);
 
-    auto jsonPtr = req->jsonObject();
+    auto jsonPtr = parseJson(req);
     if (jsonPtr == nullptr) {
         return callback(makeFailedResponse("Invalid JSON"));
     }
 
     const Json::Value &json = *jsonPtr;
-    if (!json["source"].isString()) {
-        return callback(makeFailedResponse("Empty or missing kernel string"));
+    std::string source;
+    std::vector<unsigned char> il;
+    std::vector<unsigned char> binary;
+    std::string error;
+    if (!parseProgram(json, source, il, binary, error)) {
+        return callback(makeFailedResponse(error));
     } else if (!json["type"].isUInt()) {
         return callback(makeFailedResponse("Invalid data type"));
     } else if (!json["outputs"].isArray()) {
         return callback(makeFailedResponse("Missing outputs"));
     }
 
-    const auto source = json["source"].asString();
     const auto dataType = json["type"].asUInt();
     const auto outputsArray = json["outputs"];
     std::vector<size_t> outputs;
 
-    if (dataType != FLOAT && dataType != UINT32) {
+    if (!json["tile_budget"].isNull() && !json["tile_budget"].isUInt64()) {
+        return callback(makeFailedResponse("Invalid tile budget"));
+    }
+    const size_t tileBudget = json["tile_budget"].asUInt64();
+
+    std::vector<PipelineStage> stages;
+    std::vector<size_t> intermediates;
+    if (!parsePipeline(json, stages, intermediates, error)) {
+        return callback(makeFailedResponse(error));
+    }
+    // Pipelines declare how many inputs their stages read.
+    if (!json["inputs"].isNull() && !json["inputs"].isUInt()) {
+        return callback(makeFailedResponse("Invalid number of inputs"));
+    }
+    const size_t inputs = json["inputs"].asUInt();
+
+    if (!json["entry"].isNull() && !json["entry"].isString()) {
+        return callback(makeFailedResponse("Invalid entry point"));
+    }
+    // Pipelines name their entry points per stage.
+    const auto entry = stages.empty() ? json.get("entry", "add").asString() : "";
+
+    if (!isValidDataType(dataType)) {
         return callback(makeFailedResponse("Unrecognized data type"));
     }
 
@@ -71,107 +280,249 @@ void Server::createKernel(const HttpRequestPtr& req, HttpCallback callback) {
         outputs.push_back(value);
     }
 
-    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!validatePipeline(stages, inputs, outputs.size(), intermediates.size(), error)) {
+        return callback(makeFailedResponse(error));
+    }
+
+    const auto tenant = tenantOf(req);
+    size_t memory = 0;
+    for (const auto size : outputs) {
+        memory += size;
+    }
+    for (const auto size : intermediates) {
+        memory += size;
+    }
+    if (!m_scheduler.chargeMemory(tenant, memory, error)) {
+        return callback(makeFailedResponse(error, k429TooManyRequests));
+    }
 
     auto item = std::make_shared<KernelItem>();
     item->type = dataType;
+    item->tenant = tenant;
 
-    // TODO: is it safer to use smart pointers?
-    auto kernel = std::make_shared<Kernel>();
-
-    bool ret = kernel->compile(source);
-    if (!ret) {
-        return callback(makeFailedResponse("Failed to compile kernel"));
+    // Pipelines aren't replayed.
+    if (!stages.empty()) {
+        recording.discard();
+    }
+    recording.setKernel(dataType, entry, outputs, tileBudget);
+    recording.setProgram(source, il, binary);
+
+    // Compiling can take seconds, so it happens in the background; clients
+    // poll kernelInfo for the result.
+    const bool added = m_kernels.addPending(id, std::move(item), [=](Kernel &kernel, std::string &error) {
+        bool ret;
+        if (!binary.empty()) {
+            ret = kernel.compileBinary(binary, "", entry);
+        } else if (!il.empty()) {
+            ret = kernel.compileIL(il, entry);
+        } else {
+            ret = kernel.compile(source, entry);
+        }
+        if (ret) {
+            kernel.addOutputParams(outputs);
+            kernel.setTileBudget(tileBudget);
+            if (!stages.empty() && !kernel.setPipeline(stages, intermediates)) {
+                error = "Pipeline references an unknown kernel, or passes it the wrong number of arguments";
+                ret = false;
+            }
+        }
+        if (!ret) {
+            std::string ignored;
+            m_scheduler.chargeMemory(tenant, -static_cast<int64_t>(memory), ignored);
+        }
+        return ret;
+    });
+    if (!added) {
+        std::string ignored;
+        m_scheduler.chargeMemory(tenant, -static_cast<int64_t>(memory), ignored);
+        recording.discard();
+        return callback(makeFailedResponse("Kernel id is already in use"));
     }
-    kernel->addOutputParams(outputs);
-
-    item->kernel = std::move(*kernel);
-
-    m_kernels.emplace(id, std::move(item));
 
     Json::Value res;
     res["uuid"] = id;
     res["success"] = true;
-    res["data"] = "Kernel created successfully";
-    callback(HttpResponse::newHttpJsonResponse(std::move(res)));
+    res["state"] = kernelStateName(KernelState::Pending);
+    res["data"] = "Kernel is being compiled";
+    auto resp = HttpResponse::newHttpJsonResponse(std::move(res));
+    resp->setStatusCode(k202Accepted);
+    recording.succeed();
+    callback(resp);
 }
 
-void Server::kernelInfo(const HttpRequestPtr&, HttpCallback callback, const std::string& id) {
-    //std::lock_guard<std::mutex> lock(m_mutex);
-
-    auto itemPtr = [this, &id]() -> std::shared_ptr<KernelItem> {
-        // It is possible that the item is being removed while another
-        // thread tries to look it up. The mutex here prevents that from
-        // happening.
-        std::lock_guard<std::mutex> lock(m_mutex);
-        auto it = m_kernels.find(id);
-        if (it == m_kernels.end()) {
-            return nullptr;
-        }
-        return it->second;
-    }();
+void Server::kernelInfo(const HttpRequestPtr& req, HttpCallback callback, const std::string& id) {
+    TraceRequest trace("info", receivedAt(req));
+    auto itemPtr = m_kernels.find(id);
 
     if (itemPtr == nullptr) {
         return callback(makeFailedResponse("Kernel not found"));
     }
 
     auto& item = *itemPtr;
+
     // Prevents another thread from writing to the same item while this
     // thread reads. Could cause blockage if multiple clients are asking to
     // read the same object. But that should be rare.
-    std::lock_guard<std::mutex> lock(item.mtx);
+    const auto lock = tracedLock(item.mtx);
 
     Json::Value json;
     json["success"] = true;
     json["data"] = "Found";
+    json["state"] = kernelStateName(item.state);
+    json["build_log"] = item.buildLog;
+    json["device"] = static_cast<Json::UInt64>(item.device);
     // TODO: use item to return more info.
 
     return callback(HttpResponse::newHttpJsonResponse(json));
 }
 
+void Server::deleteKernel(const HttpRequestPtr& req, HttpCallback callback, const std::string& id) {
+    TraceRequest trace("delete", receivedAt(req));
+    auto itemPtr = m_kernels.find(id);
+
+    if (itemPtr == nullptr) {
+        return callback(makeFailedResponse("Kernel not found"));
+    }
+
+    {
+        // The build still accounts for the kernel's memory.
+        const auto lock = tracedLock(itemPtr->mtx);
+        if (itemPtr->state == KernelState::Pending) {
+            return callback(makeFailedResponse("Kernel is still compiling", k409Conflict));
+        }
+    }
+
+    const auto removed = m_kernels.remove(id);
+    if (removed == nullptr) {
+        return callback(makeFailedResponse("Kernel not found"));
+    }
+    {
+        const auto lock = tracedSharedLock(removed->mtx);
+        std::string ignored;
+        const size_t memory = removed->kernel ? removed->kernel->memory() : 0;
+        m_scheduler.chargeMemory(removed->tenant, -static_cast<int64_t>(memory), ignored);
+    }
+
+    Json::Value json;
+    json["success"] = true;
+    json["data"] = "Kernel deleted";
+    callback(HttpResponse::newHttpJsonResponse(json));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 enum InputError {
     Ok,
     InvalidType,
+    OutOfRange,
+    Corrupt,
 };
 
-static InputError addUIntData(Kernel* kernel, const Json::Value array) {
-    std::vector<uint32_t> data;
-    data.reserve(array.size());
-    for (int i=0; i<array.size(); i++) {
-        const auto arrayItem = array[i];
-        if (!arrayItem.isUInt()) {
-            return InvalidType;
-            //return callback(makeFailedResponse("Outputs is not a list of integers"));
+// Reads one JSON element as the wide type of its session's type, if it is
+// a number of that kind.
+static bool readWide(const Json::Value &value, uint64_t &out) {
+    if (!value.isUInt64()) {
+        return false;
+    }
+    out = value.asUInt64();
+    return true;
+}
+
+static bool readWide(const Json::Value &value, int64_t &out) {
+    if (!value.isInt64()) {
+        return false;
+    }
+    out = value.asInt64();
+    return true;
+}
+
+static bool readWide(const Json::Value &value, double &out) {
+    if (!value.isDouble()) {
+        return false;
+    }
+    out = value.asDouble();
+    return true;
+}
+
+// Converts one JSON element, if it has the session's type and is in its
+// range.
+template<typename T>
+static bool parseElement(const Json::Value &value, T &out) {
+    typedef DataTypeTraits<T> Traits;
+    typename Traits::Wide wide;
+    if (!readWide(value, wide) || !Traits::fits(wide)) {
+        return false;
+    }
+    out = Traits::fromWide(wide);
+    return true;
+}
+
+// Adds a new input, or overwrites part of input `index` starting at
+// element `offset` if an offset is given. A new input is parsed straight
+// into the staging buffer the kernel keeps; an update is parsed into the
+// thread's arena and copied once, into the existing input.
+template<typename T>
+static InputError addData(Kernel* kernel, const Json::Value &array, uint64_t index,
+                          const Json::Value &offset, Recording &recording) {
+    const size_t count = array.size();
+    if (!offset.isNull()) {
+        Arena::Scope scope;
+        T* data = Arena::local().allocate<T>(count);
+        for (Json::ArrayIndex i = 0; i < count; i++) {
+            if (!parseElement(array[i], data[i])) {
+                return InvalidType;
+            }
         }
-        const auto value = arrayItem.asUInt();
-        data.push_back(value);
+        recording.setInput(index, true, offset.asUInt64(), data, count * sizeof(T));
+        return kernel->updateInputData<T>(index, offset.asUInt64(), data, count) ? Ok : OutOfRange;
     }
 
-    kernel->addInputData<uint32_t>(data);
+    StagingBuffer staging(count * sizeof(T));
+    T* data = staging.as<T>();
+    for (Json::ArrayIndex i = 0; i < count; i++) {
+        if (!parseElement(array[i], data[i])) {
+            return InvalidType;
+        }
+    }
+    recording.setInput(index, false, 0, data, staging.size());
+    kernel->addInputData(std::move(staging), sizeof(T));
     return Ok;
 }
 
-static InputError addFloatData(Kernel* kernel, const Json::Value array) {
-    std::vector<float> data;
-    data.reserve(array.size());
-    for (int i=0; i<array.size(); i++) {
-        const auto arrayItem = array[i];
-        if (!arrayItem.isDouble()) {
-            return InvalidType;
-            //return callback(makeFailedResponse("Outputs is not a list of integers"));
+// Adds or updates an input sent with a compact encoding (see codec.h),
+// decoding it straight into the new input's staging buffer, or into the
+// thread's arena for a partial update.
+static InputError addEncoded(Kernel* kernel, unsigned int type, Encoding encoding,
+                             const std::string &encoded, size_t bytes, uint64_t index,
+                             const Json::Value &offset, Recording &recording,
+                             std::string &error) {
+    if (!offset.isNull()) {
+        Arena::Scope scope;
+        void* data = Arena::local().allocate(bytes);
+        if (!decode(encoding, type, encoded.data(), encoded.size(), data, bytes, error)) {
+            return Corrupt;
         }
-        const auto value = arrayItem.asFloat();
-        data.push_back(value);
+        recording.setInput(index, true, offset.asUInt64(), data, bytes);
+        const bool updated = visitDataType(type, [&](auto tag) {
+            typedef typename decltype(tag)::type T;
+            return kernel->updateInputData<T>(index, offset.asUInt64(), static_cast<T*>(data),
+                                              bytes / sizeof(T));
+        });
+        return updated ? Ok : OutOfRange;
     }
 
-    kernel->addInputData<float>(data);
+    StagingBuffer staging(bytes);
+    if (!decode(encoding, type, encoded.data(), encoded.size(), staging.data(), bytes, error)) {
+        return Corrupt;
+    }
+    recording.setInput(index, false, 0, staging.data(), bytes);
+    kernel->addInputData(std::move(staging), dataTypeSize(type));
     return Ok;
 }
 
 void Server::updateKernel(const HttpRequestPtr& req, HttpCallback callback, const std::string& id) {
-    auto jsonPtr = req->jsonObject();
+    TraceRequest trace("update", receivedAt(req));
+    auto jsonPtr = parseJson(req);
     if (jsonPtr == nullptr) {
         return callback(makeFailedResponse("Invalid JSON"));
     }
@@ -185,107 +536,429 @@ void Server::updateKernel(const HttpRequestPtr& req, HttpCallback callback, cons
 
     if (updateType == "input") {
         // TODO: separate method.
+    } else if (updateType == "dataset") {
+        return bindDataset(json, std::move(callback), id);
     } else {
         return callback(makeFailedResponse("Unrecognized update action"));
     }
 
-    // input() action.
+    // input() action. Data is a JSON array, or a base64 string if an
+    // encoding is given.
+    Recording recording(RecordOp::SetInput, id);
+    Encoding encoding = Encoding::Plain;
+    const bool encoded = json.isMember("encoding");
+    if (encoded && (!json["encoding"].isString() ||
+                    !parseEncoding(json["encoding"].asString(), encoding))) {
+        return callback(makeFailedResponse("Unknown encoding"));
+    }
     if (!json["index"].isUInt()) {
         return callback(makeFailedResponse("Missing index"));
-    } else if (!json["data"].isArray()) {
+    } else if (encoded ? !json["data"].isString() : !json["data"].isArray()) {
         return callback(makeFailedResponse("Missing input data"));
+    } else if (!json["offset"].isNull() && !json["offset"].isUInt64()) {
+        return callback(makeFailedResponse("Invalid offset"));
     }
 
-    const auto data = json["data"];
+    const auto &data = json["data"];
+    const auto index = json["index"].asUInt64();
+    const auto &offset = json["offset"];
 
-    auto itemPtr = [this, &id]() -> std::shared_ptr<KernelItem> {
-        // It is possible that the item is being removed while another
-        // thread tries to look it up. The mutex here prevents that from
-        // happening.
-        std::lock_guard<std::mutex> lock(m_mutex);
-        auto it = m_kernels.find(id);
-        if (it == m_kernels.end()) {
-            return nullptr;
-        }
-        return it->second;
-    }();
+    auto itemPtr = m_kernels.find(id);
 
     if (itemPtr == nullptr) {
         return callback(makeFailedResponse("Kernel not found"));
     }
 
     auto& item = *itemPtr;
-    std::lock_guard<std::mutex> lock(item.mtx);
+    const auto lock = tracedLock(item.mtx);
+    if (!isReady(item, callback)) {
+        return;
+    }
+
+    std::string error;
+    std::string payload;
+    size_t bytes = data.size() * dataTypeSize(item.type);
+    if (encoded) {
+        payload = utils::base64Decode(data.asString());
+        if (!decodedSize(encoding, item.type, payload.data(), payload.size(), bytes, error)) {
+            return callback(makeFailedResponse(error));
+        }
+    }
+
+    // New inputs take device memory; partial updates don't.
+    const int64_t memory = offset.isNull() ? bytes : 0;
+    if (!m_scheduler.chargeMemory(item.tenant, memory, error)) {
+        return callback(makeFailedResponse(error, k429TooManyRequests));
+    }
 
     int ret;
+    if (encoded) {
+        ret = addEncoded(item.kernel.get(), item.type, encoding, payload, bytes, index, offset,
+                         recording, error);
+    } else {
+        ret = visitDataType(item.type, [&](auto tag) {
+            typedef typename decltype(tag)::type T;
+            return addData<T>(item.kernel.get(), data, index, offset, recording);
+        });
+    }
+    if (ret != Ok) {
+        std::string ignored;
+        m_scheduler.chargeMemory(item.tenant, -memory, ignored);
+    }
+    if (ret == OutOfRange) {
+        return callback(makeFailedResponse("Range is outside of the input"));
+    } else if (ret == Corrupt) {
+        return callback(makeFailedResponse(error));
+    } else if (ret != Ok) {
+        return callback(makeFailedResponse("Input data does not match the kernel's data type"));
+    }
+    Json::Value res;
+    res["success"] = true;
+    res["data"] = "Data updated successfully (I think)";
+    recording.succeed();
+    callback(HttpResponse::newHttpJsonResponse(std::move(res)));
+}
 
-    switch (item.type) {
-        case DataType::FLOAT:
-            ret = addFloatData(&item.kernel, data);
-            if (ret != Ok) {
-                return callback(makeFailedResponse("Input data is not a list of floats"));
-            }
-            break;
-        case DataType::UINT32:
-            ret = addUIntData(&item.kernel, data);
-            if (ret != Ok) {
-                return callback(makeFailedResponse("Input data is not a list of integers"));
-            }
-            break;
-        default:
-            return callback(makeFailedResponse("Invalid data type (internal)"));
+void Server::bindDataset(const Json::Value &json, HttpCallback callback, const std::string& id) {
+    if (!json["index"].isUInt()) {
+        return callback(makeFailedResponse("Missing index"));
+    } else if (!json["name"].isString()) {
+        return callback(makeFailedResponse("Missing dataset name"));
+    }
+
+    auto dataset = m_datasets.find(json["name"].asString());
+    if (dataset == nullptr) {
+        return callback(makeFailedResponse("Dataset not found"));
+    }
+
+    const uint64_t offset = json["offset"].isUInt64() ? json["offset"].asUInt64() : 0;
+    if (offset > dataset->size()) {
+        return callback(makeFailedResponse("Offset is past the end of the dataset"));
+    }
+    const uint64_t length = json["length"].isUInt64() ? json["length"].asUInt64()
+                                                      : dataset->size() - offset;
+    if (length == 0 || length > dataset->size() - offset) {
+        return callback(makeFailedResponse("Invalid dataset range"));
+    }
+
+    auto itemPtr = m_kernels.find(id);
+    if (itemPtr == nullptr) {
+        return callback(makeFailedResponse("Kernel not found"));
+    }
+
+    auto& item = *itemPtr;
+    const auto lock = tracedLock(item.mtx);
+    if (!isReady(item, callback)) {
+        return;
     }
-    // addUIntData(Kernel* kernel, const Json::Value data);
 
-    //return callback(makeFailedResponse("Outputs is not a list of integers"));
+    const size_t typeSize = dataTypeSize(item.type);
+    if (typeSize == 0 || length % typeSize != 0) {
+        return callback(makeFailedResponse("Length is not a multiple of the element size"));
+    }
+
+    // Bound ranges count as the tenant's memory, instead of the input they
+    // replace.
+    const auto index = json["index"].asUInt();
+    const int64_t memory = static_cast<int64_t>(length) - item.kernel->inputBytes(index);
+    std::string error;
+    if (!m_scheduler.chargeMemory(item.tenant, memory, error)) {
+        return callback(makeFailedResponse(error, k429TooManyRequests));
+    }
 
-    // std::vector<uint32_t> data{bytes.begin(), bytes.end()};
-    //kernel->addInputData<uint32_t>(data);
+    boost::compute::buffer buffer;
+    if (!dataset->buffer(item.kernel->context(), offset, length, buffer, error)) {
+        std::string ignored;
+        m_scheduler.chargeMemory(item.tenant, -memory, ignored);
+        return callback(makeFailedResponse(error));
+    }
+    if (!item.kernel->addBufferInput(index, buffer, length / typeSize, typeSize,
+                                    dataset->name(), offset)) {
+        std::string ignored;
+        m_scheduler.chargeMemory(item.tenant, -memory, ignored);
+        return callback(makeFailedResponse("Index is past the end of the inputs"));
+    }
 
     Json::Value res;
     res["success"] = true;
-    res["data"] = "Data updated successfully (I think)";
+    res["data"] = "Dataset bound successfully";
     callback(HttpResponse::newHttpJsonResponse(std::move(res)));
 }
 
+void Server::listDatasets(const HttpRequestPtr&, HttpCallback callback) {
+    Json::Value datasets(Json::arrayValue);
+    for (const auto &dataset : m_datasets.list()) {
+        Json::Value entry;
+        entry["name"] = dataset->name();
+        entry["size"] = static_cast<Json::UInt64>(dataset->size());
+        datasets.append(entry);
+    }
+
+    Json::Value json;
+    json["success"] = true;
+    json["data"] = datasets;
+    callback(HttpResponse::newHttpJsonResponse(std::move(json)));
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
+// Reads output `index` back in the session's type. Half precision values are
+// returned as floats.
+static Json::Value readOutput(Kernel::Execution &execution, unsigned int type, size_t index) {
+    return visitDataType(type, [&](auto tag) {
+        typedef typename decltype(tag)::type T;
+        const auto output = execution.getOutput<T>(index);
+
+        Json::Value values(Json::arrayValue);
+        for (const auto &value : output) {
+            values.append(DataTypeTraits<T>::toWide(value));
+        }
+        return values;
+    });
+}
+
+// Reads output `index` back as its raw bytes, encoded.
+static bool readEncodedOutput(Kernel::Execution &execution, unsigned int type, size_t index,
+                              Encoding encoding, std::string &out, std::string &error) {
+    Arena::Scope scope;
+    const size_t bytes = execution.outputSize(index);
+    void* data = Arena::local().allocate(bytes);
+    execution.readOutput(index, data, bytes);
+    return encode(encoding, type, data, bytes, out, error);
+}
+
+// Records the hash of output `index`, for replays to compare theirs with.
+static void recordOutput(Recording &recording, Kernel::Execution &execution, size_t index) {
+    if (!recording.active()) {
+        return;
+    }
+    Arena::Scope scope;
+    const size_t bytes = execution.outputSize(index);
+    void* data = Arena::local().allocate(bytes);
+    execution.readOutput(index, data, bytes);
+    recording.setOutput(index, data, bytes);
+}
+
+void Server::schedule(const HttpRequestPtr& req, const KernelItem &item, HttpCallback callback,
+                      std::function<HttpResponsePtr(Scheduler::Ticket&)> job) {
+    // Jobs wait for their turn in the scheduler rather than on an IO thread,
+    // and run on the job threads, one per device slot.
+    std::function<void(const HttpResponsePtr&)> respond = std::move(callback);
+    const uint64_t trace = currentTrace();
+    std::string error;
+    const bool queued = m_scheduler.submit(item.tenant, priorityOf(req),
+                                           [this, respond, job, trace](Scheduler::Ticket ticket) {
+        auto slot = std::make_shared<Scheduler::Ticket>(std::move(ticket));
+        boost::asio::post(m_jobs, [respond, job, trace, slot]() {
+            TraceScope scope(trace);
+            HttpResponsePtr response;
+            try {
+                response = job(*slot);
+            } catch (const std::exception &e) {
+                response = makeFailedResponse(e.what());
+            }
+            slot->release();
+            respond(response);
+        });
+    }, error);
+    if (!queued) {
+        respond(makeFailedResponse(error, k429TooManyRequests));
+    }
+}
+
 void Server::executeKernel(const HttpRequestPtr& req, HttpCallback callback, const std::string& id) {
-    auto itemPtr = [this, &id]() -> std::shared_ptr<KernelItem> {
-        // It is possible that the item is being removed while another
-        // thread tries to look it up. The mutex here prevents that from
-        // happening.
-        std::lock_guard<std::mutex> lock(m_mutex);
-        auto it = m_kernels.find(id);
-        if (it == m_kernels.end()) {
-            return nullptr;
+    TraceRequest trace("compute", receivedAt(req));
+    auto recording = std::make_shared<Recording>(RecordOp::Compute, id);
+    auto itemPtr = m_kernels.find(id);
+
+    if (itemPtr == nullptr) {
+        return callback(makeFailedResponse("Kernel not found"));
+    }
+
+    // Return an output if one is asked for, e.g. ?output=0.
+    const auto output = req->getParameter("output");
+    char *end = nullptr;
+    const size_t index = output.empty() ? 0 : std::strtoul(output.c_str(), &end, 10);
+    if (!output.empty() && *end != '\0') {
+        return callback(makeFailedResponse("Invalid output index"));
+    }
+    // Or return it encoded as base64, e.g. ?output=0&encoding=shuffle.
+    const auto encodingName = req->getParameter("encoding");
+    Encoding encoding = Encoding::Plain;
+    if (!encodingName.empty() && !parseEncoding(encodingName, encoding)) {
+        return callback(makeFailedResponse("Unknown encoding"));
+    }
+
+    schedule(req, *itemPtr, std::move(callback), [=](Scheduler::Ticket &ticket) {
+        auto& item = *itemPtr;
+
+        // Executions only read the session, so they share the lock and run
+        // at once; updates wait for them to end.
+        const auto lock = tracedSharedLock(item.mtx);
+        auto failure = notReady(item);
+        if (failure) {
+            return failure;
         }
-        return it->second;
-    }();
 
+        auto execution = item.kernel->launch();
+        ticket.addDeviceTime(execution.deviceTime());
+        recordOutput(*recording, execution, index);
+        Json::Value json;
+        json["success"] = true;
+        json["data"] = "Let's see if it worked (fingers crossed)";
+        if (!encodingName.empty() && !output.empty()) {
+            std::string encoded;
+            std::string error;
+            if (!readEncodedOutput(execution, item.type, index, encoding, encoded, error)) {
+                return makeFailedResponse(error);
+            }
+            json["output"] = utils::base64Encode(reinterpret_cast<const unsigned char*>(encoded.data()),
+                                                 encoded.size());
+            json["encoding"] = encodingName;
+        } else if (!output.empty()) {
+            json["output"] = readOutput(execution, item.type, index);
+        }
+        recording->succeed();
+
+        return HttpResponse::newHttpJsonResponse(json);
+    });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Server::runPrimitive(const HttpRequestPtr& req, HttpCallback callback, const std::string& id) {
+    TraceRequest trace("primitive", receivedAt(req));
+    auto jsonPtr = parseJson(req);
+    if (jsonPtr == nullptr) {
+        return callback(makeFailedResponse("Invalid JSON"));
+    }
+
+    const Json::Value &json = *jsonPtr;
+    PrimitiveRequest request;
+    if (!json["op"].isString() || !parsePrimitive(json["op"].asString(), request.primitive)) {
+        return callback(makeFailedResponse("Unrecognized operation"));
+    } else if (!json["target"].isString() ||
+               !parsePipelineArg(json["target"].asString(), {}, request.target)) {
+        return callback(makeFailedResponse("Invalid target buffer"));
+    }
+
+    if (request.primitive == Primitive::SortByKey &&
+        (!json["values"].isString() ||
+         !parsePipelineArg(json["values"].asString(), {}, request.values))) {
+        return callback(makeFailedResponse("Invalid values buffer"));
+    }
+    if (json["bins"].isUInt()) {
+        request.bins = json["bins"].asUInt();
+    }
+    if (json["min"].isNumeric() && json["max"].isNumeric()) {
+        request.hasRange = true;
+        request.lo = json["min"].asDouble();
+        request.hi = json["max"].asDouble();
+    }
+    if (json["limit"].isUInt()) {
+        request.limit = json["limit"].asUInt();
+    }
+
+    auto itemPtr = m_kernels.find(id);
     if (itemPtr == nullptr) {
         return callback(makeFailedResponse("Kernel not found"));
     }
 
-    auto& item = *itemPtr;
-    // Prevents another thread from writing to the same item while this
-    // thread reads. Could cause blockage if multiple clients are asking to
-    // read the same object. But that should be rare.
-    std::lock_guard<std::mutex> lock(item.mtx);
+    schedule(req, *itemPtr, std::move(callback), [=](Scheduler::Ticket&) {
+        auto& item = *itemPtr;
+        const auto lock = tracedLock(item.mtx);
+        auto failure = notReady(item);
+        if (failure) {
+            return failure;
+        }
+
+        PrimitiveResult result;
+        std::string error;
+        if (!::runPrimitive(*item.kernel, item.type, request, result, error)) {
+            return makeFailedResponse(error);
+        }
 
-    Kernel* kernel = &item.kernel;
+        // Only the results of the data's kind are filled in; histograms
+        // return integer counts, and their range separately.
+        Json::Value data(Json::arrayValue);
+        for (const auto value : result.integers) {
+            data.append(static_cast<Json::UInt64>(value));
+        }
+        for (const auto value : result.signedIntegers) {
+            data.append(static_cast<Json::Int64>(value));
+        }
+        if (request.primitive != Primitive::Histogram) {
+            for (const auto value : result.reals) {
+                data.append(value);
+            }
+        }
 
-    kernel->execute();
+        Json::Value res;
+        res["success"] = true;
+        res["data"] = data;
+        if (request.primitive == Primitive::Histogram) {
+            res["min"] = result.reals[0];
+            res["max"] = result.reals[1];
+        }
+        return HttpResponse::newHttpJsonResponse(std::move(res));
+    });
+}
 
-    // get the output data.
-    uint32_t *c = kernel->getOutputData<uint32_t>(0);
-    // print out results in 'c'
-    std::cout << "c: [" << c[0] << ", " << c[1] << ", " << c[2] << ", " << c[3]
-              << "]" << std::endl;
+////////////////////////////////////////////////////////////////////////////////
+
+void Server::listTenants(const HttpRequestPtr&, HttpCallback callback) {
+    Json::Value tenants(Json::objectValue);
+    for (const auto &entry : m_scheduler.usage()) {
+        const auto &usage = entry.second;
+        Json::Value tenant;
+        tenant["jobs"] = static_cast<Json::UInt64>(usage.jobs);
+        tenant["running"] = static_cast<Json::UInt64>(usage.running);
+        tenant["waiting"] = static_cast<Json::UInt64>(usage.waiting);
+        tenant["rejected"] = static_cast<Json::UInt64>(usage.rejected);
+        tenant["memory"] = static_cast<Json::UInt64>(usage.memory);
+        tenant["device_time_ns"] = static_cast<Json::UInt64>(usage.deviceTime);
+        tenants[entry.first] = tenant;
+    }
 
     Json::Value json;
     json["success"] = true;
-    json["data"] = "Let's see if it worked (fingers crossed)";
+    json["data"] = tenants;
+    callback(HttpResponse::newHttpJsonResponse(std::move(json)));
+}
 
-    return callback(HttpResponse::newHttpJsonResponse(json));
+////////////////////////////////////////////////////////////////////////////////
+
+void Server::exportTrace(const HttpRequestPtr&, HttpCallback callback) {
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setContentTypeCode(CT_APPLICATION_JSON);
+    resp->setBody(Tracer::instance().chromeTrace());
+    callback(resp);
+}
+
+void Server::configureTrace(const HttpRequestPtr& req, HttpCallback callback) {
+    auto jsonPtr = req->jsonObject();
+    if (jsonPtr == nullptr) {
+        return callback(makeFailedResponse("Invalid JSON"));
+    }
+
+    const Json::Value &json = *jsonPtr;
+    if (!json["sample"].isNull() && !json["sample"].isUInt()) {
+        return callback(makeFailedResponse("Invalid sampling interval"));
+    }
+    if (!json["clear"].isNull() && !json["clear"].isBool()) {
+        return callback(makeFailedResponse("Invalid clear flag"));
+    }
+
+    auto &tracer = Tracer::instance();
+    if (json["sample"].isUInt()) {
+        tracer.setSampling(json["sample"].asUInt());
+    }
+    if (json["clear"].isBool() && json["clear"].asBool()) {
+        tracer.clear();
+    }
+
+    Json::Value res;
+    res["success"] = true;
+    res["sample"] = tracer.sampling();
+    callback(HttpResponse::newHttpJsonResponse(std::move(res)));
 }
@@ -1,43 +1,85 @@
 #ifndef Server_H
 #define Server_H
 
+#include <functional>
+#include <boost/asio/thread_pool.hpp>
 #include <drogon/drogon.h>
 #include "kernel.h"
+#include "local.h"
+#include "registry.h"
+#include "scheduler.h"
 
 using namespace drogon;
 
 using HttpCallback = std::function<void(const HttpResponsePtr &)> &&;
 
-enum DataType {
-    UINT32,
-    FLOAT,
-};
-
-struct KernelItem
-{
-    unsigned int type;
-    Kernel kernel;
-    std::mutex mtx;
-};
-
 class Server : public HttpController<Server>
 {
 public:
     METHOD_LIST_BEGIN
     ADD_METHOD_TO(Server::createKernel, "/create", Post);
     ADD_METHOD_VIA_REGEX(Server::kernelInfo, "/([a-f0-9]{64})", Get);
+    ADD_METHOD_VIA_REGEX(Server::deleteKernel, "/([a-f0-9]{64})", Delete);
     ADD_METHOD_VIA_REGEX(Server::updateKernel, "/update/([a-f0-9]{64})", Put);
     ADD_METHOD_VIA_REGEX(Server::executeKernel, "/compute/([a-f0-9]{64})", Get);
+    ADD_METHOD_VIA_REGEX(Server::runPrimitive, "/primitive/([a-f0-9]{64})", Post);
+    ADD_METHOD_TO(Server::listDatasets, "/datasets", Get);
+    ADD_METHOD_TO(Server::listTenants, "/tenants", Get);
+    ADD_METHOD_TO(Server::exportTrace, "/admin/trace", Get);
+    ADD_METHOD_TO(Server::configureTrace, "/admin/trace", Put);
     METHOD_LIST_END
 
+    /**
+     * @brief Maps the datasets in COMPUTE_DATA_DIR, restores the sessions
+     * from COMPUTE_SNAPSHOT, if set, and snapshots them again every
+     * COMPUTE_SNAPSHOT_INTERVAL seconds. Runs COMPUTE_DEVICE_SLOTS jobs
+     * at a time, with the tenant limits in COMPUTE_TENANT_LIMITS. Serves
+     * local clients on the Unix socket COMPUTE_LOCAL_SOCKET, if set.
+     */
+    Server();
+
+    /**
+     * @brief Snapshot all sessions to COMPUTE_SNAPSHOT, if set.
+     */
+    void saveSnapshot();
+
     void kernelInfo(const HttpRequestPtr&, HttpCallback callback, const std::string& id);
     void createKernel(const HttpRequestPtr& req, HttpCallback callback);
+    void deleteKernel(const HttpRequestPtr& req, HttpCallback callback, const std::string& id);
     void updateKernel(const HttpRequestPtr& req, HttpCallback callback, const std::string& id);
     void executeKernel(const HttpRequestPtr&, HttpCallback callback, const std::string& id);
+    void runPrimitive(const HttpRequestPtr& req, HttpCallback callback, const std::string& id);
+    void listDatasets(const HttpRequestPtr&, HttpCallback callback);
+    void listTenants(const HttpRequestPtr&, HttpCallback callback);
+
+    /**
+     * @brief Traced spans, as Chrome trace JSON.
+     */
+    void exportTrace(const HttpRequestPtr&, HttpCallback callback);
+
+    /**
+     * @brief Set the trace sampling interval ("sample") and/or discard the
+     * traced spans ("clear").
+     */
+    void configureTrace(const HttpRequestPtr& req, HttpCallback callback);
 
 private:
-    std::map<std::string, std::shared_ptr<KernelItem>> m_kernels;
-    std::mutex m_mutex;
+    void bindDataset(const Json::Value &json, HttpCallback callback, const std::string& id);
+
+    /**
+     * @brief Queue @p job for a device slot of the session's tenant, run it
+     * on a job thread once it gets one, and respond with its result.
+     */
+    void schedule(const HttpRequestPtr& req, const KernelItem &item, HttpCallback callback,
+                  std::function<HttpResponsePtr(Scheduler::Ticket&)> job);
+
+    KernelRegistry m_kernels;
+    DatasetRegistry m_datasets;
+    Scheduler m_scheduler;
+    std::string m_snapshotPath;
+    LocalTransport m_local;
+    // Declared last: jobs use everything above.
+    boost::asio::thread_pool m_jobs;
 };
 
 #endif
@@ -0,0 +1,150 @@
+#include "snapshot.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/streams/bufferstream.hpp>
+#include <boost/serialization/string.hpp>
+#include <boost/serialization/vector.hpp>
+
+namespace ipc = boost::interprocess;
+
+static const char SnapshotMagic[8] = { 'C', 'S', 'S', 'N', 'A', 'P', '0', '1' };
+
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t metadataOffset;
+    uint64_t metadataSize;
+};
+
+SnapshotWriter::SnapshotWriter(const std::string &path)
+    : m_path(path)
+    , m_tmpPath(path + ".tmp")
+    , m_file(m_tmpPath, std::ios::binary | std::ios::trunc)
+    , m_offset(0)
+{
+    // Reserve space for the header, it is filled in by commit().
+    const SnapshotHeader header = {};
+    m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_offset = sizeof(header);
+}
+
+void SnapshotWriter::pad() {
+    const uint64_t pageSize = ipc::mapped_region::get_page_size();
+    const uint64_t padding = (pageSize - m_offset % pageSize) % pageSize;
+    static const char zeros[4096] = {};
+    for (uint64_t left = padding; left > 0; ) {
+        const uint64_t chunk = std::min<uint64_t>(left, sizeof(zeros));
+        m_file.write(zeros, chunk);
+        left -= chunk;
+    }
+    m_offset += padding;
+}
+
+void SnapshotWriter::add(SnapshotSession session, const std::vector<Kernel::InputView> &inputs) {
+    session.inputs.clear();
+    session.inputs.reserve(inputs.size());
+
+    for (const auto &input : inputs) {
+        SnapshotInput info;
+        info.size = input.size;
+        info.typeSize = input.typeSize;
+
+        const uint64_t bytes = input.size * input.typeSize;
+        if (!input.dataset.empty()) {
+            info.dataset = input.dataset;
+            info.offset = input.datasetOffset;
+        } else if (input.ptr != nullptr && bytes > 0) {
+            pad();
+            info.offset = m_offset;
+            m_file.write(static_cast<const char*>(input.ptr), bytes);
+            m_offset += bytes;
+        }
+        session.inputs.push_back(info);
+    }
+
+    m_sessions.push_back(std::move(session));
+}
+
+bool SnapshotWriter::commit() {
+    std::ostringstream stream;
+    {
+        boost::archive::binary_oarchive archive(stream);
+        archive << m_sessions;
+    }
+    const std::string metadata = stream.str();
+
+    SnapshotHeader header;
+    memcpy(header.magic, SnapshotMagic, sizeof(SnapshotMagic));
+    header.metadataOffset = m_offset;
+    header.metadataSize = metadata.size();
+
+    m_file.write(metadata.data(), metadata.size());
+    m_file.seekp(0);
+    m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_file.close();
+
+    if (m_file.fail()) {
+        std::remove(m_tmpPath.c_str());
+        return false;
+    }
+    return std::rename(m_tmpPath.c_str(), m_path.c_str()) == 0;
+}
+
+bool SnapshotReader::open(const std::string &path) {
+    try {
+        ipc::file_mapping file(path.c_str(), ipc::read_only);
+        auto region = std::make_shared<ipc::mapped_region>(file, ipc::copy_on_write);
+
+        char* base = static_cast<char*>(region->get_address());
+        const uint64_t size = region->get_size();
+
+        SnapshotHeader header;
+        if (size < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, base, sizeof(header));
+        if (memcmp(header.magic, SnapshotMagic, sizeof(SnapshotMagic)) != 0 ||
+            header.metadataOffset > size ||
+            header.metadataSize > size - header.metadataOffset) {
+            return false;
+        }
+
+        ipc::ibufferstream buffer(base + header.metadataOffset, header.metadataSize);
+        std::istream &stream = buffer;
+        boost::archive::binary_iarchive archive(stream);
+        std::vector<SnapshotSession> sessions;
+        archive >> sessions;
+
+        for (const auto &session : sessions) {
+            for (const auto &input : session.inputs) {
+                if (!input.dataset.empty()) {
+                    continue;
+                }
+                const uint64_t bytes = input.size * input.typeSize;
+                if (input.offset > size || bytes > size - input.offset) {
+                    return false;
+                }
+            }
+        }
+
+        m_sessions = std::move(sessions);
+        m_base = base;
+        m_size = size;
+        m_mapping = std::move(region);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+void* SnapshotReader::data(uint64_t offset) const {
+    if (m_base == nullptr || offset == 0 || offset >= m_size) {
+        return nullptr;
+    }
+    return m_base + offset;
+}
@@ -0,0 +1,140 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/serialization/version.hpp>
+#include "kernel.h"
+#include "pipeline.h"
+
+/**
+ * @brief Location of one input parameter inside a snapshot file.
+ * Inputs bound to a dataset store the dataset name and the byte offset
+ * within it instead of their data.
+ */
+struct SnapshotInput {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t typeSize = 0;
+    std::string dataset;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version) {
+        ar & offset & size & typeSize;
+        if (version >= 1) {
+            ar & dataset;
+        }
+    }
+};
+
+BOOST_CLASS_VERSION(SnapshotInput, 1)
+
+/**
+ * @brief Everything needed to recreate one kernel session.
+ */
+struct SnapshotSession {
+    std::string id;
+    unsigned int type = 0;
+    std::string source;
+    std::vector<unsigned char> binary;
+    std::vector<uint64_t> outputs;
+    std::vector<SnapshotInput> inputs;
+    uint64_t tileBudget = 0;
+    std::string entry = "add";
+    std::vector<PipelineStage> pipeline;
+    std::vector<uint64_t> intermediates;
+    std::string tenant;
+    std::vector<unsigned char> il;
+
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version) {
+        ar & id & type & source & binary & outputs & inputs;
+        if (version >= 1) {
+            ar & tileBudget;
+        }
+        if (version >= 2) {
+            ar & entry & pipeline & intermediates;
+        }
+        if (version >= 3) {
+            ar & tenant;
+        }
+        if (version >= 4) {
+            ar & il;
+        }
+    }
+};
+
+BOOST_CLASS_VERSION(SnapshotSession, 4)
+
+/**
+ * @brief Writes a snapshot file.
+ *
+ * Input data is stored raw and page-aligned so that a reader can map the
+ * file and hand the pages straight to the kernels. Session metadata is
+ * serialized with Boost.Serialization after the data. The file is written
+ * next to its destination and renamed into place by commit(), so readers
+ * (and kernels still using an older mapping) never see a partial file.
+ */
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const std::string &path);
+
+    /**
+     * @brief Append a session and its input data.
+     */
+    void add(SnapshotSession session, const std::vector<Kernel::InputView> &inputs);
+
+    /**
+     * @brief Finish the file and move it into place.
+     */
+    bool commit();
+
+private:
+    void pad();
+
+    std::string m_path;
+    std::string m_tmpPath;
+    std::ofstream m_file;
+    uint64_t m_offset;
+    std::vector<SnapshotSession> m_sessions;
+};
+
+/**
+ * @brief Maps a snapshot file into memory.
+ */
+class SnapshotReader {
+public:
+    /**
+     * @brief Map @p path and read its session metadata.
+     */
+    bool open(const std::string &path);
+
+    const std::vector<SnapshotSession>& sessions() const {
+        return m_sessions;
+    }
+
+    /**
+     * @brief Address of the data stored at @p offset.
+     * The mapping is private, so kernels may modify it without touching
+     * the file.
+     */
+    void* data(uint64_t offset) const;
+
+    /**
+     * @brief Handle that keeps the mapping alive.
+     */
+    std::shared_ptr<void> mapping() const {
+        return m_mapping;
+    }
+
+private:
+    std::shared_ptr<void> m_mapping;
+    char* m_base = nullptr;
+    uint64_t m_size = 0;
+    std::vector<SnapshotSession> m_sessions;
+};
+
+#endif
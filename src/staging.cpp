@@ -0,0 +1,104 @@
+#include "staging.h"
+#include <algorithm>
+#include <utility>
+
+StagingBuffer::StagingBuffer(size_t bytes)
+    : m_data(bytes > 0 ? new unsigned char[bytes] : nullptr)
+    , m_size(bytes)
+{
+}
+
+StagingBuffer::StagingBuffer(StagingBuffer &&other) noexcept
+    : m_data(std::move(other.m_data))
+    , m_size(other.m_size)
+    , m_transfer(std::move(other.m_transfer))
+{
+    other.m_size = 0;
+}
+
+StagingBuffer& StagingBuffer::operator=(StagingBuffer &&other) noexcept {
+    if (this != &other) {
+        release();
+        m_data = std::move(other.m_data);
+        m_size = other.m_size;
+        m_transfer = std::move(other.m_transfer);
+        other.m_size = 0;
+    }
+    return *this;
+}
+
+StagingBuffer::~StagingBuffer() {
+    release();
+}
+
+void StagingBuffer::wait() {
+    if (m_transfer.get()) {
+        try {
+            m_transfer.wait();
+        } catch (...) {
+            // A failed transfer no longer reads the memory either.
+        }
+        m_transfer = boost::compute::event();
+    }
+}
+
+void StagingBuffer::release() {
+    wait();
+    m_data.reset();
+    m_size = 0;
+}
+
+Arena::Arena(size_t chunkSize)
+    : m_chunkSize(chunkSize)
+    , m_current(0)
+    , m_offset(0)
+{
+}
+
+Arena& Arena::local() {
+    static thread_local Arena arena;
+    return arena;
+}
+
+void* Arena::allocate(size_t bytes, size_t alignment) {
+    while (m_current < m_chunks.size()) {
+        auto &chunk = m_chunks[m_current];
+        const size_t start = (m_offset + alignment - 1) / alignment * alignment;
+        if (start + bytes <= chunk.size) {
+            m_offset = start + bytes;
+            return chunk.data.get() + start;
+        }
+        m_current++;
+        m_offset = 0;
+    }
+
+    // Chunks come from new[], which is suitably aligned for any type.
+    const size_t size = std::max(m_chunkSize, bytes);
+    m_chunks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[size]), size });
+    m_current = m_chunks.size() - 1;
+    m_offset = bytes;
+    return m_chunks.back().data.get();
+}
+
+void Arena::rewind(size_t chunk, size_t offset) {
+    m_current = chunk;
+    m_offset = offset;
+    // Once a request is done, give oversized chunks back so one large upload
+    // doesn't pin its memory to the thread forever.
+    if (chunk == 0 && offset == 0) {
+        m_chunks.erase(std::remove_if(m_chunks.begin(), m_chunks.end(), [this](const Chunk &c) {
+            return c.size > m_chunkSize;
+        }), m_chunks.end());
+    }
+}
+
+Arena::Scope::Scope()
+    : m_arena(Arena::local())
+    , m_chunk(m_arena.m_current)
+    , m_offset(m_arena.m_offset)
+{
+}
+
+Arena::Scope::~Scope() {
+    m_arena.rewind(m_chunk, m_offset);
+}
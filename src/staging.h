@@ -0,0 +1,130 @@
+#ifndef STAGING_H
+#define STAGING_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <boost/compute/event.hpp>
+
+/**
+ * @brief Host memory holding an input until, and while, it is transferred
+ * to the device.
+ *
+ * Move-only, so that the data is never copied by accident. Transfers read
+ * the memory asynchronously, so the buffer is not freed before the last
+ * transfer registered with fence() has completed.
+ */
+class StagingBuffer {
+public:
+    StagingBuffer() = default;
+
+    /**
+     * @brief Allocate @p bytes of uninitialized memory.
+     */
+    explicit StagingBuffer(size_t bytes);
+
+    StagingBuffer(StagingBuffer &&other) noexcept;
+    StagingBuffer& operator=(StagingBuffer &&other) noexcept;
+    StagingBuffer(const StagingBuffer&) = delete;
+    StagingBuffer& operator=(const StagingBuffer&) = delete;
+    ~StagingBuffer();
+
+    void* data() {
+        return m_data.get();
+    }
+
+    const void* data() const {
+        return m_data.get();
+    }
+
+    template<typename T>
+    T* as() {
+        return reinterpret_cast<T*>(m_data.get());
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+    /**
+     * @brief Keep the memory alive until @p transfer, which reads from it,
+     * has completed.
+     */
+    void fence(const boost::compute::event &transfer) {
+        m_transfer = transfer;
+    }
+
+    /**
+     * @brief Wait until the memory is no longer read by a transfer, e.g.
+     * before overwriting it.
+     */
+    void wait();
+
+private:
+    void release();
+
+    std::unique_ptr<unsigned char[]> m_data;
+    size_t m_size = 0;
+    boost::compute::event m_transfer;
+};
+
+/**
+ * @brief Bump allocator for memory that only lives as long as a request.
+ *
+ * Each thread has its own arena (local()), so allocating takes no lock and
+ * chunks are reused from one request to the next instead of going back to
+ * the heap.
+ */
+class Arena {
+public:
+    explicit Arena(size_t chunkSize = 1 << 20);
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    /**
+     * @brief The calling thread's arena.
+     */
+    static Arena& local();
+
+    void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t));
+
+    template<typename T>
+    T* allocate(size_t count) {
+        return static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+    }
+
+    /**
+     * @brief Frees everything allocated in the thread's arena while it
+     * exists. Scopes nest.
+     */
+    class Scope {
+    public:
+        Scope();
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Arena &m_arena;
+        size_t m_chunk;
+        size_t m_offset;
+    };
+
+private:
+    struct Chunk {
+        std::unique_ptr<unsigned char[]> data;
+        size_t size;
+    };
+
+    void rewind(size_t chunk, size_t offset);
+
+    size_t m_chunkSize;
+    std::vector<Chunk> m_chunks;
+    // Chunk being allocated from, and the first free byte in it.
+    size_t m_current;
+    size_t m_offset;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include "trace.h"
+#include "config.h"
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+namespace compute = boost::compute;
+
+static thread_local uint64_t t_trace = 0;
+
+int64_t traceClock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t traceClockFromWallTime(int64_t microseconds) {
+    const int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    return traceClock() - (now - microseconds) * 1000;
+}
+
+// Small, stable thread numbers read better in trace viewers than thread ids.
+static uint32_t threadNumber() {
+    static std::atomic<uint32_t> next(1);
+    static thread_local const uint32_t number = next++;
+    return number;
+}
+
+Tracer& Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+Tracer::Tracer()
+    : m_every(getConfigUInt("COMPUTE_TRACE_SAMPLE", 0))
+    , m_requests(0)
+    , m_nextTrace(1)
+    , m_events(std::max<size_t>(getConfigUInt("COMPUTE_TRACE_BUFFER", 65536), 1))
+    , m_next(0)
+    , m_wrapped(false)
+{
+}
+
+void Tracer::setSampling(unsigned every) {
+    m_every = every;
+}
+
+uint64_t Tracer::sample() {
+    const unsigned every = m_every;
+    if (every == 0 || m_requests++ % every != 0) {
+        return 0;
+    }
+    return m_nextTrace++;
+}
+
+void Tracer::record(const TraceEvent &event) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events[m_next] = event;
+    if (++m_next == m_events.size()) {
+        m_next = 0;
+        m_wrapped = true;
+    }
+}
+
+void Tracer::clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_next = 0;
+    m_wrapped = false;
+}
+
+std::string Tracer::chromeTrace() {
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_wrapped) {
+            events.assign(m_events.begin() + m_next, m_events.end());
+        }
+        events.insert(events.end(), m_events.begin(), m_events.begin() + m_next);
+    }
+
+    // Host spans are grouped by thread, device spans by request.
+    std::ostringstream out;
+    out.precision(3);
+    out << std::fixed;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":["
+        << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"host\"}},"
+        << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"device\"}}";
+    for (const auto &event : events) {
+        out << ",{\"name\":\"" << event.name << "\",\"cat\":\""
+            << (event.device ? "device" : "host") << "\",\"ph\":\"X\""
+            << ",\"ts\":" << event.start / 1000.0
+            << ",\"dur\":" << event.duration / 1000.0
+            << ",\"pid\":" << (event.device ? 2 : 1)
+            << ",\"tid\":" << (event.device ? event.trace : event.thread)
+            << ",\"args\":{\"trace\":" << event.trace;
+        if (event.arg >= 0) {
+            out << ",\"arg\":" << event.arg;
+        }
+        out << "}}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+uint64_t currentTrace() {
+    return t_trace;
+}
+
+TraceRequest::TraceRequest(const char* name, int64_t received)
+    : m_previous(t_trace)
+    , m_trace(Tracer::instance().sample())
+    , m_name(name)
+    , m_start(0)
+{
+    if (m_trace == 0) {
+        return;
+    }
+    t_trace = m_trace;
+    m_start = traceClock();
+    if (received > 0 && received < m_start) {
+        TraceEvent event;
+        event.name = "receive";
+        event.trace = m_trace;
+        event.start = received;
+        event.duration = m_start - received;
+        event.thread = threadNumber();
+        Tracer::instance().record(event);
+    }
+}
+
+TraceRequest::~TraceRequest() {
+    if (m_trace == 0) {
+        return;
+    }
+    TraceEvent event;
+    event.name = m_name;
+    event.trace = m_trace;
+    event.start = m_start;
+    event.duration = traceClock() - m_start;
+    event.thread = threadNumber();
+    Tracer::instance().record(event);
+    t_trace = m_previous;
+}
+
+TraceScope::TraceScope(uint64_t trace)
+    : m_previous(t_trace)
+{
+    t_trace = trace;
+}
+
+TraceScope::~TraceScope() {
+    t_trace = m_previous;
+}
+
+TraceSpan::TraceSpan(const char* name, int64_t arg)
+    : m_trace(t_trace)
+    , m_name(name)
+    , m_arg(arg)
+    , m_start(m_trace != 0 ? traceClock() : 0)
+{
+}
+
+TraceSpan::~TraceSpan() {
+    if (m_trace == 0) {
+        return;
+    }
+    TraceEvent event;
+    event.name = m_name;
+    event.trace = m_trace;
+    event.start = m_start;
+    event.duration = traceClock() - m_start;
+    event.thread = threadNumber();
+    event.arg = m_arg;
+    Tracer::instance().record(event);
+}
+
+void traceDeviceEvent(const char* name, const compute::event &event, int64_t arg) {
+    const uint64_t trace = t_trace;
+    if (trace == 0 || !event.get()) {
+        return;
+    }
+
+    const int64_t queued = traceClock();
+    compute::event command = event;
+    try {
+        command.set_callback([=]() {
+            try {
+                const auto deviceQueued = command.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_QUEUED);
+                const auto deviceStart = command.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_START);
+                const auto deviceEnd = command.get_profiling_info<cl_ulong>(CL_PROFILING_COMMAND_END);
+
+                TraceEvent span;
+                span.name = name;
+                span.trace = trace;
+                span.start = queued + static_cast<int64_t>(deviceStart - deviceQueued);
+                span.duration = static_cast<int64_t>(deviceEnd - deviceStart);
+                span.device = true;
+                span.arg = arg;
+                Tracer::instance().record(span);
+            } catch (...) {
+                // The queue doesn't have profiling enabled.
+            }
+        });
+    } catch (...) {
+        // Callbacks need OpenCL 1.1.
+    }
+}
@@ -0,0 +1,179 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <boost/compute/event.hpp>
+
+/**
+ * @brief Current time on the host trace clock, in nanoseconds.
+ */
+int64_t traceClock();
+
+/**
+ * @brief Convert a wall clock time in microseconds since the epoch, e.g.
+ * when a request was received, to the trace clock.
+ */
+int64_t traceClockFromWallTime(int64_t microseconds);
+
+/**
+ * @brief One span of a traced request.
+ */
+struct TraceEvent {
+    /** Static string; spans are recorded without allocating. */
+    const char* name = "";
+    uint64_t trace = 0;
+    int64_t start = 0;
+    int64_t duration = 0;
+    uint32_t thread = 0;
+    /** Timed by the device rather than the host. */
+    bool device = false;
+    /** Span specific detail, e.g. an index or a byte count. -1 if none. */
+    int64_t arg = -1;
+};
+
+/**
+ * @brief Keeps the spans of sampled requests in a fixed-size ring buffer.
+ *
+ * Every COMPUTE_TRACE_SAMPLE-th request is traced (none if 0, the default);
+ * the buffer holds the last COMPUTE_TRACE_BUFFER spans (65536 by default).
+ * Requests that aren't sampled cost a thread-local check per span.
+ */
+class Tracer {
+public:
+    static Tracer& instance();
+
+    /**
+     * @brief Trace every @p every-th request, or none if 0.
+     */
+    void setSampling(unsigned every);
+
+    unsigned sampling() const {
+        return m_every;
+    }
+
+    /**
+     * @brief Decide whether to trace a new request.
+     * @returns its trace id, or 0 if it isn't traced.
+     */
+    uint64_t sample();
+
+    void record(const TraceEvent &event);
+
+    /**
+     * @brief The buffered spans in Chrome trace event format, which
+     * chrome://tracing and Perfetto open.
+     */
+    std::string chromeTrace();
+
+    void clear();
+
+private:
+    Tracer();
+
+    std::atomic<unsigned> m_every;
+    std::atomic<uint64_t> m_requests;
+    std::atomic<uint64_t> m_nextTrace;
+    std::mutex m_mutex;
+    std::vector<TraceEvent> m_events;
+    size_t m_next;
+    bool m_wrapped;
+};
+
+/**
+ * @brief Trace id of the request being handled by this thread, or 0.
+ */
+uint64_t currentTrace();
+
+/**
+ * @brief Traces a request, if it is sampled, from construction to
+ * destruction. Spans started on the same thread meanwhile belong to it.
+ */
+class TraceRequest {
+public:
+    /**
+     * @param name Request type.
+     * @param received When the request was received, on the trace clock, if
+     * known. Adds a span for the time before it was handled.
+     */
+    explicit TraceRequest(const char* name, int64_t received = 0);
+    ~TraceRequest();
+
+    TraceRequest(const TraceRequest&) = delete;
+    TraceRequest& operator=(const TraceRequest&) = delete;
+
+private:
+    uint64_t m_previous;
+    uint64_t m_trace;
+    const char* m_name;
+    int64_t m_start;
+};
+
+/**
+ * @brief Continues a request's trace on another thread, e.g. a build thread.
+ */
+class TraceScope {
+public:
+    explicit TraceScope(uint64_t trace);
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    uint64_t m_previous;
+};
+
+/**
+ * @brief Times a step of the current request on the host.
+ */
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, int64_t arg = -1);
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    uint64_t m_trace;
+    const char* m_name;
+    int64_t m_arg;
+    int64_t m_start;
+};
+
+/**
+ * @brief Record the device-side execution of a command of the current
+ * request once it completes.
+ *
+ * Uses OpenCL event profiling, so the command's queue must have profiling
+ * enabled. Device timestamps are moved to the host trace clock using the
+ * command's queued timestamp, which is taken to be now: call this right
+ * after enqueuing.
+ */
+void traceDeviceEvent(const char* name, const boost::compute::event &event, int64_t arg = -1);
+
+/**
+ * @brief Lock @p mutex, recording the wait as a "lock" span.
+ */
+template<typename Mutex>
+std::unique_lock<Mutex> tracedLock(Mutex &mutex) {
+    TraceSpan span("lock");
+    return std::unique_lock<Mutex>(mutex);
+}
+
+/**
+ * @brief Lock @p mutex for shared access, recording the wait as a "lock"
+ * span.
+ */
+template<typename Mutex>
+std::shared_lock<Mutex> tracedSharedLock(Mutex &mutex) {
+    TraceSpan span("lock");
+    return std::shared_lock<Mutex>(mutex);
+}
+
+#endif
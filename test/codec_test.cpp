@@ -0,0 +1,113 @@
+// Encodes arrays with every encoding that applies to their type, decodes
+// them again and checks that the elements come back unchanged, and that
+// truncated or mismatched input fails instead of decoding.
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+#include "dtype.h"
+
+static const char* name(Encoding encoding) {
+    switch (encoding) {
+        case Encoding::Plain: return "plain";
+        case Encoding::Delta: return "delta";
+        case Encoding::Shuffle: return "shuffle";
+    }
+    return "?";
+}
+
+template<typename T>
+static bool roundTrip(Encoding encoding, unsigned int type, const std::vector<T> &values) {
+    const size_t bytes = values.size() * sizeof(T);
+    std::string encoded, error;
+    if (!encode(encoding, type, values.data(), bytes, encoded, error)) {
+        std::cerr << name(encoding) << ": encode failed: " << error << std::endl;
+        return false;
+    }
+
+    size_t decodedBytes = 0;
+    if (!decodedSize(encoding, type, encoded.data(), encoded.size(), decodedBytes, error)) {
+        std::cerr << name(encoding) << ": decodedSize failed: " << error << std::endl;
+        return false;
+    } else if (decodedBytes != bytes) {
+        std::cerr << name(encoding) << ": decoded size is " << decodedBytes
+                  << ", expected " << bytes << std::endl;
+        return false;
+    }
+
+    std::vector<T> decoded(values.size());
+    if (!decode(encoding, type, encoded.data(), encoded.size(), decoded.data(), bytes, error)) {
+        std::cerr << name(encoding) << ": decode failed: " << error << std::endl;
+        return false;
+    } else if (bytes > 0 && std::memcmp(decoded.data(), values.data(), bytes) != 0) {
+        std::cerr << name(encoding) << ": decoded " << values.size()
+                  << " elements differ from the input" << std::endl;
+        return false;
+    }
+
+    // Losing part of the data must be caught, not read past.
+    if (encoding != Encoding::Plain && encoded.size() > 16) {
+        const size_t truncated = encoded.size() / 2;
+        if (decodedSize(encoding, type, encoded.data(), truncated, decodedBytes, error) &&
+            decode(encoding, type, encoded.data(), truncated, decoded.data(), bytes, error)) {
+            std::cerr << name(encoding) << ": truncated input decoded" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    bool ok = true;
+
+    Encoding encoding;
+    if (!parseEncoding("delta", encoding) || encoding != Encoding::Delta ||
+        !parseEncoding("shuffle", encoding) || encoding != Encoding::Shuffle ||
+        !parseEncoding("", encoding) || encoding != Encoding::Plain ||
+        parseEncoding("zip", encoding)) {
+        std::cerr << "parseEncoding accepted or rejected the wrong names" << std::endl;
+        ok = false;
+    }
+
+    // Sorted ids, with a count that leaves a partial block.
+    std::vector<int32_t> ids(1000);
+    for (size_t i = 0; i < ids.size(); i++) {
+        ids[i] = static_cast<int32_t>(i * 3 + (i % 7));
+    }
+    // Counters that go down as well as up, across the whole range.
+    std::vector<int64_t> counters(300);
+    for (size_t i = 0; i < counters.size(); i++) {
+        counters[i] = (i % 2 ? INT64_MAX : INT64_MIN) + static_cast<int64_t>(i % 5);
+    }
+    std::vector<uint8_t> bytes(129);
+    for (size_t i = 0; i < bytes.size(); i++) {
+        bytes[i] = static_cast<uint8_t>(255 - i);
+    }
+    std::vector<float> reals(517);
+    for (size_t i = 0; i < reals.size(); i++) {
+        reals[i] = static_cast<float>(i) * 0.25f - 10.0f;
+    }
+    std::vector<double> doubles(64, 3.5);
+
+    for (Encoding e : { Encoding::Plain, Encoding::Delta, Encoding::Shuffle }) {
+        ok &= roundTrip(e, INT32, ids);
+        ok &= roundTrip(e, INT64, counters);
+        ok &= roundTrip(e, UINT8, bytes);
+        ok &= roundTrip(e, INT32, std::vector<int32_t>());
+    }
+    for (Encoding e : { Encoding::Plain, Encoding::Shuffle }) {
+        ok &= roundTrip(e, FLOAT, reals);
+        ok &= roundTrip(e, DOUBLE, doubles);
+    }
+
+    std::string encoded, error;
+    if (encode(Encoding::Delta, FLOAT, reals.data(), reals.size() * sizeof(float), encoded, error)) {
+        std::cerr << "Delta encoding accepted floats" << std::endl;
+        ok = false;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+// Parses pipeline stage arguments and checks that pipelines referring to
+// undeclared buffers are refused when the kernel is created. Runs without an
+// OpenCL device.
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+static bool check(bool condition, const char *what) {
+    if (!condition) {
+        std::cerr << what << std::endl;
+    }
+    return condition;
+}
+
+static PipelineArg parse(const std::string &text, const std::vector<std::string> &buffers) {
+    PipelineArg arg;
+    if (!parsePipelineArg(text, buffers, arg)) {
+        std::cerr << "Failed to parse " << text << std::endl;
+    }
+    return arg;
+}
+
+int main() {
+    const std::vector<std::string> buffers = { "sums", "counts" };
+    bool ok = true;
+
+    const auto input = parse("input:2", buffers);
+    ok &= check(input.kind == PipelineArg::Input && input.index == 2, "input:2 parsed wrong");
+    const auto output = parse("output:0", buffers);
+    ok &= check(output.kind == PipelineArg::Output && output.index == 0, "output:0 parsed wrong");
+    const auto buffer = parse("buffer:counts", buffers);
+    ok &= check(buffer.kind == PipelineArg::Intermediate && buffer.index == 1,
+                "buffer:counts parsed wrong");
+
+    PipelineArg arg;
+    for (const char *text : { "input", "input:", "input:-1", "input:1x", "output:two",
+                              "buffer:totals", "scratch:0" }) {
+        if (parsePipelineArg(text, buffers, arg)) {
+            std::cerr << "Parsed " << text << std::endl;
+            ok = false;
+        }
+    }
+
+    PipelineStage reduce;
+    reduce.entry = "reduce";
+    reduce.args = { parse("input:0", buffers), parse("buffer:sums", buffers) };
+    PipelineStage finish;
+    finish.entry = "finish";
+    finish.args = { parse("buffer:sums", buffers), parse("output:0", buffers) };
+    std::vector<PipelineStage> stages = { reduce, finish };
+
+    std::string error;
+    ok &= check(validatePipeline(stages, 1, 1, 1, error), "a valid pipeline was refused");
+    ok &= check(!validatePipeline(stages, 0, 1, 1, error), "an undeclared input was accepted");
+    ok &= check(error == "Argument 0 of pipeline stage 0 refers to an undeclared buffer",
+                "wrong error for an undeclared input");
+    ok &= check(!validatePipeline(stages, 1, 0, 1, error), "an undeclared output was accepted");
+    ok &= check(error == "Argument 1 of pipeline stage 1 refers to an undeclared buffer",
+                "wrong error for an undeclared output");
+    ok &= check(!validatePipeline(stages, 1, 1, 0, error), "an undeclared buffer was accepted");
+    return ok ? 0 : 1;
+}
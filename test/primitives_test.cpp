@@ -0,0 +1,56 @@
+// Sums a large float input with the Sum primitive, which has to run as a
+// parallel reduction on the device, and checks it against the host.
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "dtype.h"
+#include "kernel.h"
+#include "primitives.h"
+
+static const char Source[] =
+    "__kernel void add(__global const float *a, __global float *c)"
+    "{"
+    "    const uint i = get_global_id(0);"
+    "    c[i] = a[i];"
+    "}";
+
+int main() {
+    const size_t count = 1 << 22;
+    std::vector<float> data(count);
+    double expected = 0;
+    for (size_t i = 0; i < count; i++) {
+        data[i] = static_cast<float>(i % 1000) / 1000.0f;
+        expected += data[i];
+    }
+
+    Kernel kernel;
+    if (!kernel.compile(Source)) {
+        std::cerr << "Failed to compile the kernel" << std::endl;
+        return 1;
+    }
+    kernel.addInputData(data);
+
+    PrimitiveRequest request;
+    request.primitive = Primitive::Sum;
+    request.target.kind = PipelineArg::Input;
+    request.target.index = 0;
+
+    PrimitiveResult result;
+    std::string error;
+    if (!runPrimitive(kernel, FLOAT, request, result, error)) {
+        std::cerr << "Sum failed: " << error << std::endl;
+        return 1;
+    } else if (result.reals.size() != 1) {
+        std::cerr << "Sum returned " << result.reals.size() << " values" << std::endl;
+        return 1;
+    }
+
+    // Float partial sums lose some precision, in whatever order they run.
+    const double actual = result.reals[0];
+    if (std::fabs(actual - expected) > expected * 1e-4) {
+        std::cerr << "Sum is " << actual << ", expected " << expected << std::endl;
+        return 1;
+    }
+    return 0;
+}
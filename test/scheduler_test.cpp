@@ -0,0 +1,123 @@
+// Checks the scheduler's per-tenant quotas and the order in which waiting
+// jobs get a device slot. Runs without an OpenCL device.
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "scheduler.h"
+
+static bool check(bool condition, const char *what) {
+    if (!condition) {
+        std::cerr << what << std::endl;
+    }
+    return condition;
+}
+
+// Memory is refused past the limit, and freed memory can be used again.
+static bool memoryQuota() {
+    Scheduler scheduler;
+    scheduler.configure("alice:memory=1000;*:memory=100");
+
+    std::string error;
+    bool ok = true;
+    ok &= check(scheduler.chargeMemory("alice", 600, error), "alice could not charge 600 bytes");
+    ok &= check(!scheduler.chargeMemory("alice", 500, error), "alice went over the memory limit");
+    ok &= check(error == "Device memory quota exceeded", "wrong memory quota error");
+    ok &= check(scheduler.chargeMemory("alice", -600, error), "alice could not free memory");
+    ok &= check(scheduler.chargeMemory("alice", 1000, error), "freed memory was not credited");
+    ok &= check(!scheduler.chargeMemory("bob", 101, error), "bob did not get the default limit");
+
+    auto usage = scheduler.usage();
+    ok &= check(usage["alice"].memory == 1000, "alice's memory usage is wrong");
+    ok &= check(usage["alice"].rejected == 1, "alice's rejection was not counted");
+    ok &= check(usage["bob"].memory == 0, "bob was charged for a rejected allocation");
+    return ok;
+}
+
+// Once a tenant used up its device time, its jobs are rejected without
+// waiting, while other tenants still run.
+static bool timeQuota() {
+    Scheduler scheduler;
+    scheduler.configure("carol:time=1");
+
+    std::string error;
+    bool ok = true;
+    {
+        Scheduler::Ticket ticket;
+        ok &= check(scheduler.acquire("carol", Priority::Interactive, ticket, error),
+                    "carol's first job was rejected");
+        ticket.addDeviceTime(2000000);
+    }
+    ok &= check(scheduler.usage()["carol"].deviceTime == 2000000,
+                "profiled device time was not charged");
+
+    Scheduler::Ticket ticket;
+    ok &= check(!scheduler.acquire("carol", Priority::Interactive, ticket, error),
+                "carol ran past the device time quota");
+    ok &= check(error == "Device time quota exceeded", "wrong device time quota error");
+    ok &= check(!scheduler.submit("carol", Priority::Batch, [](Scheduler::Ticket) {}, error),
+                "carol queued a job past the device time quota");
+    ok &= check(scheduler.usage()["carol"].rejected == 2, "the rejections were not counted");
+    ok &= check(scheduler.acquire("dave", Priority::Interactive, ticket, error),
+                "dave was rejected for carol's usage");
+    return ok;
+}
+
+// Waiting interactive jobs run before batch jobs that were queued earlier.
+static bool priorities() {
+    Scheduler scheduler(1);
+    std::string error;
+    std::vector<std::string> order;
+    std::vector<Scheduler::Ticket> tickets;
+    const auto grant = [&](const std::string &name) {
+        return [&, name](Scheduler::Ticket ticket) {
+            order.push_back(name);
+            tickets.push_back(std::move(ticket));
+        };
+    };
+
+    Scheduler::Ticket running;
+    bool ok = scheduler.acquire("alice", Priority::Interactive, running, error);
+    ok &= scheduler.submit("bob", Priority::Batch, grant("bob"), error);
+    ok &= scheduler.submit("carol", Priority::Interactive, grant("carol"), error);
+    ok &= check(order.empty(), "a job ran while the only slot was taken");
+    ok &= check(scheduler.usage()["bob"].waiting == 1, "bob's job is not waiting");
+
+    running.release();
+    ok &= check(order == std::vector<std::string>{ "carol" }, "carol's interactive job did not run first");
+    Scheduler::Ticket carol = std::move(tickets.back());
+    carol.release();
+    ok &= check(order == std::vector<std::string>{ "carol", "bob" }, "bob's batch job did not run next");
+    return ok;
+}
+
+// A tenant at its job limit waits even though a slot is free.
+static bool jobLimit() {
+    Scheduler scheduler(2);
+    scheduler.configure("alice:jobs=1");
+    std::string error;
+
+    Scheduler::Ticket first;
+    bool granted = false;
+    Scheduler::Ticket second;
+    bool ok = scheduler.acquire("alice", Priority::Interactive, first, error);
+    ok &= scheduler.submit("alice", Priority::Interactive, [&](Scheduler::Ticket ticket) {
+        granted = true;
+        second = std::move(ticket);
+    }, error);
+    ok &= check(!granted, "alice ran more jobs than the job limit");
+
+    first.release();
+    ok &= check(granted, "alice's second job did not run once the first finished");
+    ok &= check(scheduler.usage()["alice"].jobs == 2, "alice's jobs were not counted");
+    return ok;
+}
+
+int main() {
+    bool ok = true;
+    ok &= memoryQuota();
+    ok &= timeQuota();
+    ok &= priorities();
+    ok &= jobLimit();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,149 @@
+// Saves two sessions to a snapshot file and reads them back: the metadata
+// must survive unchanged, inline inputs must come back page-aligned with
+// their data, and dataset-bound inputs must keep their dataset and offset.
+// Runs without an OpenCL device.
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+static bool check(bool condition, const char *what) {
+    if (!condition) {
+        std::cerr << what << std::endl;
+    }
+    return condition;
+}
+
+static Kernel::InputView inlineInput(const void *data, size_t size, size_t typeSize) {
+    Kernel::InputView view = { data, size, typeSize, std::string(), 0 };
+    return view;
+}
+
+int main() {
+    const std::string path = "snapshot_test.snap";
+    const std::vector<float> reals = { 1.5f, -2.0f, 3.25f };
+    const std::vector<int64_t> ids = { 7, 11, 13, 17, 19 };
+
+    SnapshotSession first;
+    first.id = std::string(64, 'a');
+    first.type = 1;
+    first.source = "__kernel void add(__global const float *a, __global float *c) {}";
+    first.binary = { 0x7f, 'E', 'L', 'F' };
+    first.outputs = { 3 };
+    first.tileBudget = 1 << 20;
+    first.tenant = "alice";
+
+    SnapshotSession second;
+    second.id = std::string(64, 'b');
+    second.type = 5;
+    second.entry = "scale";
+    second.il = { 0x03, 0x02, 0x23, 0x07 };
+    second.intermediates = { 5 };
+    PipelineStage stage;
+    stage.entry = "scale";
+    stage.args = { PipelineArg(), PipelineArg() };
+    stage.args[1].kind = PipelineArg::Intermediate;
+    stage.workSize = 5;
+    second.pipeline = { stage };
+
+    Kernel::InputView dataset = { nullptr, 1024, 4, "clicks", 4096 };
+    {
+        SnapshotWriter writer(path);
+        writer.add(first, { inlineInput(reals.data(), reals.size(), sizeof(float)),
+                            inlineInput(nullptr, 0, sizeof(float)) });
+        writer.add(second, { inlineInput(ids.data(), ids.size(), sizeof(int64_t)), dataset });
+        if (!writer.commit()) {
+            std::cerr << "Failed to write the snapshot" << std::endl;
+            return 1;
+        }
+    }
+
+    bool ok = check(access((path + ".tmp").c_str(), F_OK) != 0, "the temporary file was left behind");
+
+    SnapshotReader reader;
+    if (!reader.open(path)) {
+        std::cerr << "Failed to read the snapshot" << std::endl;
+        std::remove(path.c_str());
+        return 1;
+    }
+    const auto &sessions = reader.sessions();
+    if (sessions.size() != 2) {
+        std::cerr << "Read " << sessions.size() << " sessions, expected 2" << std::endl;
+        std::remove(path.c_str());
+        return 1;
+    }
+
+    const auto &a = sessions[0];
+    ok &= check(a.id == first.id && a.type == first.type && a.source == first.source,
+                "the first session's id, type or source changed");
+    ok &= check(a.binary == first.binary && a.outputs == first.outputs,
+                "the first session's binary or outputs changed");
+    ok &= check(a.tileBudget == first.tileBudget && a.tenant == "alice",
+                "the first session's tile budget or tenant changed");
+    ok &= check(a.entry == "add" && a.pipeline.empty(), "the first session gained a pipeline");
+    ok &= check(a.inputs.size() == 2, "the first session has the wrong number of inputs");
+
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    if (a.inputs.size() == 2) {
+        const auto &input = a.inputs[0];
+        ok &= check(input.size == reals.size() && input.typeSize == sizeof(float),
+                    "the float input's size changed");
+        ok &= check(input.offset % pageSize == 0, "the float input is not page-aligned");
+        const void *data = reader.data(input.offset);
+        ok &= check(data != nullptr && std::memcmp(data, reals.data(), reals.size() * sizeof(float)) == 0,
+                    "the float input's data changed");
+        ok &= check(a.inputs[1].size == 0 && reader.data(a.inputs[1].offset) == nullptr,
+                    "the empty input has data");
+    }
+
+    const auto &b = sessions[1];
+    ok &= check(b.entry == "scale" && b.il == second.il && b.intermediates == second.intermediates,
+                "the second session's entry, IL or intermediates changed");
+    ok &= check(b.pipeline.size() == 1 && b.pipeline[0].entry == "scale" &&
+                b.pipeline[0].workSize == 5 && b.pipeline[0].args.size() == 2 &&
+                b.pipeline[0].args[1].kind == PipelineArg::Intermediate,
+                "the second session's pipeline changed");
+    ok &= check(b.inputs.size() == 2, "the second session has the wrong number of inputs");
+    if (b.inputs.size() == 2) {
+        const auto &input = b.inputs[0];
+        ok &= check(input.offset % pageSize == 0, "the integer input is not page-aligned");
+        void *data = reader.data(input.offset);
+        ok &= check(data != nullptr && std::memcmp(data, ids.data(), ids.size() * sizeof(int64_t)) == 0,
+                    "the integer input's data changed");
+        ok &= check(b.inputs[1].dataset == "clicks" && b.inputs[1].offset == 4096 &&
+                    b.inputs[1].size == 1024 && b.inputs[1].typeSize == 4,
+                    "the dataset input changed");
+
+        // Kernels write to the mapping, which must not reach the file.
+        if (data != nullptr) {
+            std::memset(data, 0, ids.size() * sizeof(int64_t));
+            SnapshotReader again;
+            ok &= check(again.open(path) &&
+                        std::memcmp(again.data(input.offset), ids.data(), ids.size() * sizeof(int64_t)) == 0,
+                        "writing to the mapping changed the file");
+        }
+    }
+
+    // A file that is not a snapshot, or has lost its end, is refused.
+    std::ifstream in(path, std::ios::binary);
+    const std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    const std::string broken = path + ".broken";
+    std::ofstream(broken, std::ios::binary).write(contents.data(), contents.size() - 16);
+    SnapshotReader truncated;
+    ok &= check(!truncated.open(broken), "a truncated snapshot was read");
+    std::ofstream(broken, std::ios::binary | std::ios::trunc) << "not a snapshot";
+    ok &= check(!truncated.open(broken), "a file that is not a snapshot was read");
+    ok &= check(!truncated.open(path + ".missing"), "a missing snapshot was read");
+
+    std::remove(broken.c_str());
+    std::remove(path.c_str());
+    return ok ? 0 : 1;
+}